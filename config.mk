@@ -0,0 +1,29 @@
+# cmdline: ./configure --disable-lua
+#
+# This version of config.mk was generated by the vis configure script
+# Any changes made here will be lost if configure is re-run
+SRCDIR=.
+PREFIX=/usr/local
+EXEC_PREFIX=$(PREFIX)
+BINDIR=$(EXEC_PREFIX)/bin
+DOCPREFIX=$(PREFIX)/share/doc
+MANPREFIX=$(PREFIX)/share/man
+SHAREPREFIX=$(PREFIX)/share
+LUAPREFIX=$(PREFIX)/share/lua/
+
+CC=cc
+CFLAGS=-fdata-sections -ffunction-sections -O2 -Wall -Wextra -Wpedantic -Wno-missing-field-initializers -Wno-unused-parameter
+LDFLAGS=-Wl,-z,relro -Wl,-z,now 
+CFLAGS_STD=-DCONFIG_STRING="\" +curses\"" -DVERSION="\"df81165-dirty\"" -std=c99 -D_XOPEN_SOURCE=700 -D_POSIX_C_SOURCE=200809L -DCONFIG_INOTIFY -DCONFIG_COPY_FILE_RANGE -DCONFIG_SYNCFS -pthread -DCONFIG_PTHREAD -DCONFIG_HELP
+LDFLAGS_STD=-lc -pthread
+CFLAGS_AUTO=-fstack-protector-all 
+LDFLAGS_AUTO=-Wl,--gc-sections -pie 
+CFLAGS_RELEASE=-fdata-sections -ffunction-sections -O2 -Wall -Wextra -Wpedantic -Wno-missing-field-initializers -Wno-unused-parameter
+CFLAGS_DEBUG=-U_FORTIFY_SOURCE -DDEBUG -O0 -g3 -ggdb
+
+LUAC=cat
+
+REGEX=text-regex
+UI_TERMINAL_BACKEND=ui-terminal-curses
+CFLAGS_CURSES=-DCONFIG_CURSES  
+LDFLAGS_CURSES=-lncursesw -ltinfo
@@ -24,6 +24,10 @@ vis.events.subscribe(vis.events.WIN_STATUS, function(win)
 	table.insert(left_parts, (file.name or '[No Name]') ..
 		(file.modified and ' [+]' or '') .. (vis.recording and ' @' or ''))
 
+	if file.loading then
+		table.insert(left_parts, 'loading '..file.loading..'%')
+	end
+
 	local count = vis.count
 	local keys = vis.input_queue
 	if keys ~= '' then
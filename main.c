@@ -1126,14 +1126,10 @@ int main(int argc, char *argv[]) {
 			if (strcmp(argv[i], "-") == 0) {
 				if (!vis_window_new_fd(vis, STDOUT_FILENO))
 					vis_die(vis, "Can not create empty buffer\n");
-				ssize_t len = 0;
-				char buf[PIPE_BUF];
-				Text *txt = vis_text(vis);
-				while ((len = read(STDIN_FILENO, buf, sizeof buf)) > 0)
-					text_insert(txt, text_size(txt), buf, len);
-				if (len == -1)
+				/* keep the pipe, data is appended as it arrives */
+				int in = dup(STDIN_FILENO);
+				if (!vis_window_stream(vis_window(vis), in))
 					vis_die(vis, "Can not read from stdin\n");
-				text_snapshot(txt);
 				int fd = ui->open(ui);
 				if (fd == -1)
 					vis_die(vis, "Can not reopen stdin\n");
@@ -1146,7 +1142,7 @@ int main(int argc, char *argv[]) {
 		} else if (argv[i][0] == '+' && !end_of_options) {
 			cmd = argv[i] + (argv[i][1] == '/' || argv[i][1] == '?');
 			continue;
-		} else if (!vis_window_new(vis, argv[i])) {
+		} else if (!vis_window_new_lazy(vis, argv[i])) {
 			vis_die(vis, "Can not load '%s': %s\n", argv[i], strerror(errno));
 		}
 		win_created = true;
@@ -106,6 +106,7 @@ static bool cmd_new(Vis*, Win*, Command*, const char *argv[], Selection*, Filera
 static bool cmd_vnew(Vis*, Win*, Command*, const char *argv[], Selection*, Filerange*);
 static bool cmd_wq(Vis*, Win*, Command*, const char *argv[], Selection*, Filerange*);
 static bool cmd_earlier_later(Vis*, Win*, Command*, const char *argv[], Selection*, Filerange*);
+static bool cmd_recover(Vis*, Win*, Command*, const char *argv[], Selection*, Filerange*);
 static bool cmd_help(Vis*, Win*, Command*, const char *argv[], Selection*, Filerange*);
 static bool cmd_map(Vis*, Win*, Command*, const char *argv[], Selection*, Filerange*);
 static bool cmd_unmap(Vis*, Win*, Command*, const char *argv[], Selection*, Filerange*);
@@ -234,6 +235,9 @@ static const CommandDef cmds[] = {
 	}, {
 		"later",        VIS_HELP("Go to newer text state")
 		CMD_ARGV|CMD_ONCE|CMD_ADDRESS_NONE, NULL, cmd_earlier_later
+	}, {
+		"recover",      VIS_HELP("Replay the crash recovery journal of the file")
+		CMD_FORCE|CMD_ONCE|CMD_ADDRESS_NONE, NULL, cmd_recover
 	},
 	{ NULL, VIS_HELP(NULL) CMD_NONE, NULL, NULL },
 };
@@ -269,6 +273,13 @@ enum {
 	OPTION_CHANGE_256COLORS,
 	OPTION_LAYOUT,
 	OPTION_IGNORECASE,
+	OPTION_HISTORY_REVISIONS,
+	OPTION_HISTORY_AGE,
+	OPTION_HISTORY_SIZE,
+	OPTION_STREAM_LIMIT,
+	OPTION_FOLLOW,
+	OPTION_JOURNAL,
+	OPTION_SESSION,
 };
 
 static const OptionDef options[] = {
@@ -340,7 +351,7 @@ static const OptionDef options[] = {
 	[OPTION_LOAD_METHOD] = {
 		{ "loadmethod" },
 		VIS_OPTION_TYPE_STRING,
-		VIS_HELP("How to load existing files 'auto', 'read' or 'mmap'")
+		VIS_HELP("How to load existing files 'auto', 'read', 'mmap' or 'progressive'")
 	},
 	[OPTION_CHANGE_256COLORS] = {
 		{ "change-256colors" },
@@ -357,6 +368,41 @@ static const OptionDef options[] = {
 		VIS_OPTION_TYPE_BOOL,
 		VIS_HELP("Ignore case when searching")
 	},
+	[OPTION_HISTORY_REVISIONS] = {
+		{ "history-revisions" },
+		VIS_OPTION_TYPE_NUMBER,
+		VIS_HELP("Maximal number of undo revisions per file, 0 for unlimited")
+	},
+	[OPTION_HISTORY_AGE] = {
+		{ "history-age" },
+		VIS_OPTION_TYPE_NUMBER,
+		VIS_HELP("Maximal age of undo revisions in seconds, 0 for unlimited")
+	},
+	[OPTION_HISTORY_SIZE] = {
+		{ "history-size" },
+		VIS_OPTION_TYPE_NUMBER,
+		VIS_HELP("Maximal undo history size per file in KiB, 0 for unlimited")
+	},
+	[OPTION_STREAM_LIMIT] = {
+		{ "streamlimit" },
+		VIS_OPTION_TYPE_NUMBER,
+		VIS_HELP("Maximal size of a file read from a stream in KiB, 0 for unlimited")
+	},
+	[OPTION_FOLLOW] = {
+		{ "follow" },
+		VIS_OPTION_TYPE_BOOL|VIS_OPTION_NEED_WINDOW,
+		VIS_HELP("Append data written to the file on disk")
+	},
+	[OPTION_JOURNAL] = {
+		{ "journal" },
+		VIS_OPTION_TYPE_BOOL|VIS_OPTION_NEED_WINDOW,
+		VIS_HELP("Record changes in a crash recovery journal")
+	},
+	[OPTION_SESSION] = {
+		{ "session" },
+		VIS_OPTION_TYPE_BOOL,
+		VIS_HELP("Preserve the undo history of files across editor sessions")
+	},
 };
 
 bool sam_init(Vis *vis) {
@@ -457,6 +503,29 @@ static void sam_transcript_free(Transcript *t) {
 	}
 }
 
+/* convert the transcript into a sorted list of TextEdit */
+static bool sam_transcript_edits(Transcript *t, Array *edits) {
+	for (Change *c = t->changes; c; c = c->next) {
+		int count = c->type & TRANSCRIPT_INSERT ? c->count : 0;
+		TextEdit edit = { .pos = c->range.start };
+		if (c->type & TRANSCRIPT_DELETE)
+			edit.len = text_range_size(&c->range);
+		if (count > 0) {
+			edit.data = c->data;
+			edit.size = c->len;
+		}
+		if (!array_add(edits, &edit))
+			return false;
+		/* repeated insertions follow the deletion range */
+		edit = (TextEdit){ .pos = c->range.end, .data = c->data, .size = c->len };
+		for (int i = 1; i < count; i++) {
+			if (!array_add(edits, &edit))
+				return false;
+		}
+	}
+	return true;
+}
+
 static bool sam_insert(Win *win, Selection *sel, size_t pos, const char *data, size_t len, int count) {
 	Filerange range = text_range_new(pos, pos);
 	Change *c = change_new(&win->file->transcript, TRANSCRIPT_INSERT, &range, win, sel);
@@ -1062,7 +1131,7 @@ static Filerange address_evaluate(Address *addr, File *file, Selection *sel, Fil
 			size_t idx = sel ? view_selections_number(sel) : 0;
 			SelectionRegion *sr = array_get(marks, idx);
 			if (sr)
-				pos = text_mark_get(file->text, sr->cursor);
+				pos = text_mark_update(file->text, &sr->cursor);
 			ret = text_range_new(pos, pos);
 			break;
 		}
@@ -1130,6 +1199,8 @@ static bool count_evaluate(Command *cmd) {
 
 static bool sam_execute(Vis *vis, Win *win, Command *cmd, Selection *sel, Filerange *range) {
 	bool ret = true;
+	if (win && !file_load(vis, win->file))
+		return false;
 	if (cmd->address && win)
 		*range = address_evaluate(cmd->address, win->file, sel, range, 0);
 
@@ -1235,12 +1306,21 @@ enum SamError sam_cmd(Vis *vis, const char *s) {
 			continue;
 		}
 		vis_file_snapshot(vis, file);
+		Array edits;
+		array_init_sized(&edits, sizeof(TextEdit));
+		if (!sam_transcript_edits(t, &edits) ||
+		    !text_edit(file->text, array_get(&edits, 0), array_length(&edits), NULL)) {
+			err = SAM_ERR_MEMORY;
+			array_release(&edits);
+			sam_transcript_free(t);
+			continue;
+		}
+		array_release(&edits);
 		ptrdiff_t delta = 0;
 		for (Change *c = t->changes; c; c = c->next) {
 			c->range.start += delta;
 			c->range.end += delta;
 			if (c->type & TRANSCRIPT_DELETE) {
-				text_delete_range(file->text, &c->range);
 				delta -= text_range_size(&c->range);
 				if (c->sel && c->type == TRANSCRIPT_DELETE) {
 					if (visual)
@@ -1250,10 +1330,7 @@ enum SamError sam_cmd(Vis *vis, const char *s) {
 				}
 			}
 			if (c->type & TRANSCRIPT_INSERT) {
-				for (int i = 0; i < c->count; i++) {
-					text_insert(file->text, c->range.start, c->data, c->len);
-					delta += c->len;
-				}
+				delta += c->len * c->count;
 				Filerange r = text_range_new(c->range.start,
 				                             c->range.start + c->len * c->count);
 				if (c->sel) {
@@ -1607,8 +1684,14 @@ static bool cmd_write(Vis *vis, Win *win, Command *cmd, const char *argv[], Sele
 	File *file = win->file;
 	if (sam_transcript_error(&file->transcript, SAM_ERR_WRITE_CONFLICT))
 		return false;
+	/* complete previous saves, the file on disk might still change */
+	vis_save_wait(vis, file);
 
 	Text *text = file->text;
+	if (text_loading(text)) {
+		vis_info_show(vis, "Can not write while loading");
+		return false;
+	}
 	Filerange range_all = text_range_new(0, text_size(text));
 	bool write_entire_file = text_range_equal(r, &range_all);
 
@@ -1693,7 +1776,39 @@ static bool cmd_write(Vis *vis, Win *win, Command *cmd, const char *argv[], Sele
 		if (write_entire_file)
 			*r = text_range_new(0, text_size(text));
 
-		TextSave *ctx = text_save_begin(text, AT_FDCWD, path, file->save_method);
+		bool visual = vis->mode->visual;
+
+		if (file->save_method != TEXT_SAVE_INPLACE) {
+			/* write an immutable view of the current revision in the background */
+			text_snapshot(text);
+			const Text *snapshot = text_snapshot_acquire(text);
+			TextSave *ctx = snapshot ? text_save_begin((Text*)snapshot, AT_FDCWD, path, TEXT_SAVE_ATOMIC) : NULL;
+			if (ctx) {
+				Array ranges;
+				array_init_sized(&ranges, sizeof(Filerange));
+				for (Selection *s = view_selections(win->view); s; s = view_selections_next(s)) {
+					Filerange range = visual ? view_selections_get(s) : *r;
+					if (!array_add(&ranges, &range) || !visual)
+						break;
+				}
+				if (vis_save_add(vis, file, snapshot, ctx, path, &ranges, existing_file, same_file))
+					continue;
+				array_release(&ranges);
+				text_save_cancel(ctx);
+				text_snapshot_release(snapshot);
+				vis_info_show(vis, "Can't write `%s': %s", path, strerror(ENOMEM));
+				goto err;
+			}
+			if (snapshot)
+				text_snapshot_release(snapshot);
+			if (file->save_method == TEXT_SAVE_ATOMIC || errno == ENOSPC) {
+				const char *msg = errno ? strerror(errno) : "try changing `:set savemethod`";
+				vis_info_show(vis, "Can't write `%s': %s", path, msg);
+				goto err;
+			}
+		}
+
+		TextSave *ctx = text_save_begin(text, AT_FDCWD, path, TEXT_SAVE_INPLACE);
 		if (!ctx) {
 			const char *msg = errno ? strerror(errno) : "try changing `:set savemethod`";
 			vis_info_show(vis, "Can't write `%s': %s", path, msg);
@@ -1701,7 +1816,6 @@ static bool cmd_write(Vis *vis, Win *win, Command *cmd, const char *argv[], Sele
 		}
 
 		bool failure = false;
-		bool visual = vis->mode->visual;
 
 		for (Selection *s = view_selections(win->view); s; s = view_selections_next(s)) {
 			Filerange range = visual ? view_selections_get(s) : *r;
@@ -1725,8 +1839,10 @@ static bool cmd_write(Vis *vis, Win *win, Command *cmd, const char *argv[], Sele
 			file_name_set(file, path);
 			same_file = true;
 		}
-		if (same_file || (!existing_file && strcmp(file->name, path) == 0))
-			file->stat = text_stat(text);
+		if (same_file || (!existing_file && strcmp(file->name, path) == 0)) {
+			file_stat_set(vis, file, text_stat(text));
+			file_journal_reset(vis, file);
+		}
 		vis_event_emit(vis, VIS_EVENT_FILE_SAVE_POST, file, path);
 		free(path);
 		continue;
@@ -1735,6 +1851,9 @@ static bool cmd_write(Vis *vis, Win *win, Command *cmd, const char *argv[], Sele
 		free(path);
 		return false;
 	}
+	/* when quitting the outcome needs to be known right away */
+	if (strchr(argv[0], 'q'))
+		return vis_save_wait(vis, file);
 	return true;
 }
 
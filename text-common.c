@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdio.h>
 #include "text.h"
+#include "util.h"
 
 static bool text_vprintf(Text *txt, size_t pos, const char *format, va_list ap) {
 	va_list ap_save;
@@ -70,3 +71,57 @@ char *text_bytes_alloc0(const Text *txt, size_t pos, size_t len) {
 	buf[len] = '\0';
 	return buf;
 }
+
+/* fill in the chunk for the current iterator position, skipping empty pieces */
+static bool chunk_fill(TextChunk *c) {
+	Iterator *it = &c->it;
+	while (text_iterator_valid(it) && it->pos < c->end) {
+		size_t len = MIN((size_t)(it->end - it->text), c->end - it->pos);
+		if (len) {
+			c->data = it->text;
+			c->len = len;
+			c->pos = it->pos;
+			/* merge subsequent pieces which are adjacent in memory */
+			for (Iterator next = *it; c->pos + c->len < c->end &&
+			     text_iterator_next(&next) && next.text == c->data + c->len; *it = next)
+				c->len += MIN((size_t)(next.end - next.text), c->end - next.pos);
+			return true;
+		}
+		text_iterator_next(it);
+	}
+	c->data = NULL;
+	c->len = 0;
+	return false;
+}
+
+bool text_chunk_init(const Text *txt, TextChunk *c, size_t pos, size_t len) {
+	size_t size = text_size(txt);
+	if (pos > size)
+		pos = size;
+	*c = (TextChunk){ .pos = pos, .end = pos + MIN(len, size - pos) };
+	text_iterator_init(txt, &c->it, pos);
+	return chunk_fill(c);
+}
+
+bool text_chunk_next(TextChunk *c) {
+	if (!c->data)
+		return false;
+	text_iterator_next(&c->it);
+	return chunk_fill(c);
+}
+
+const char *text_bytes_contiguous(const Text *txt, size_t pos, size_t *len, char *buf) {
+	TextChunk c;
+	if (!text_chunk_init(txt, &c, pos, *len)) {
+		*len = 0;
+		return buf ? buf : "";
+	}
+	if (c.len == c.end - c.pos) {
+		*len = c.len;
+		return c.data;
+	}
+	if (!buf)
+		return NULL;
+	*len = text_bytes_get(txt, pos, c.end - pos, buf);
+	return buf;
+}
@@ -8,28 +8,64 @@
 /* Block holding the file content, either readonly mmap(2)-ed from the original
  * file or heap allocated to store the modifications.
  */
-typedef struct {
+typedef struct Block Block;
+struct Block {
 	size_t size;               /* maximal capacity */
 	size_t len;                /* current used length / insertion position */
 	char *data;                /* actual data */
+	size_t pieces;             /* number of pieces referring to this block */
+	size_t refs;               /* number of texts (including snapshots) holding this block */
+	int fd;                    /* file mmap(2)-ed from, used to drop cached pages, or -1 */
+	Block *owner;              /* block holding fd if it is shared, NULL if fd is owned */
+	off_t offset;              /* offset of the mapping within the file */
 	enum {                     /* type of allocation */
 		BLOCK_TYPE_MMAP_ORIG, /* mmap(2)-ed from an external file */
 		BLOCK_TYPE_MMAP,      /* mmap(2)-ed from a temporary file only known to this process */
 		BLOCK_TYPE_MALLOC,    /* heap allocated block using malloc(3) */
 	} type;
-} Block;
+};
 
 Block *block_alloc(size_t size);
 Block *block_read(size_t size, int fd);
+ssize_t block_read_more(Block*, size_t len);
 Block *block_mmap(size_t size, int fd, off_t offset);
 Block *block_load(int dirfd, const char *filename, enum TextLoadMethod method, struct stat *info);
+/* the original content of an interrupted in place save of filename if its
+ * journal matches the file, which is left untouched. Never changes errno. */
+Block *journal_load(int dirfd, const char *filename, struct stat *info);
 void block_free(Block*);
 bool block_capacity(Block*, size_t len);
 const char *block_append(Block*, const char *data, size_t len);
 bool block_insert(Block*, size_t pos, const char *data, size_t len);
 bool block_delete(Block*, size_t pos, size_t len);
+void block_advise(Block*, size_t off, size_t len, enum TextAdvice);
 
-Block *text_block_mmaped(Text*);
+/* iterate over all blocks memory mapped from the underlying file */
+Block *text_block_mmaped(Text*, size_t *index);
+/* get the mmap(2)-ed block containing data, or NULL if it is heap allocated */
+Block *text_block_mapped(const Text*, const char *data);
+/* call func for the data of all pieces of the text and its undo history,
+ * returns true as soon as it does */
+bool text_pieces_find(const Text*, bool (*func)(void *context, const char *data, size_t len), void *context);
 void text_saved(Text*, struct stat *meta);
+/* write count bytes of buf to fd, retrying partial writes */
+ssize_t write_all(int fd, const char *buf, size_t count);
+/* name of the hidden file `.basename<suffix>` next to filename, to be freed */
+char *sidecar_name(const char *filename, const char *suffix);
+
+/* crash recovery journal of the changes to a text, see text-io.c */
+typedef struct Recovery Recovery;
+/* create a journal for the file described by info, fails with EEXIST if
+ * one with changes of a previous session exists */
+Recovery *recovery_create(const char *filename, const struct stat *info);
+/* replay the existing journal of filename onto txt, which is continued */
+Recovery *recovery_replay(Text *txt, const char *filename, bool force);
+/* discard all records, the file is now described by info */
+bool recovery_reset(Recovery*, const struct stat *info);
+/* record that del bytes at pos were replaced by the ins bytes of txt at pos */
+bool recovery_change(Recovery*, const Text *txt, size_t pos, size_t del, size_t ins);
+bool recovery_snapshot(Recovery*);
+bool recovery_sync(Recovery*);
+void recovery_close(Recovery*, bool remove);
 
 #endif
@@ -1,3 +1,6 @@
+#if CONFIG_COPY_FILE_RANGE || CONFIG_SYNCFS
+#define _GNU_SOURCE /* copy_file_range(2), syncfs(2) */
+#endif
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -6,7 +9,9 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #if CONFIG_ACL
 #include <sys/acl.h>
 #endif
@@ -18,6 +23,7 @@
 #include "text-internal.h"
 #include "text-util.h"
 #include "util.h"
+#include "array.h"
 
 struct TextSave {                  /* used to hold context between text_save_{begin,commit} calls */
 	Text *txt;                 /* text to operate on */
@@ -26,8 +32,42 @@ struct TextSave {                  /* used to hold context between text_save_{be
 	int fd;                    /* file descriptor to write data to using text_save_write */
 	int dirfd;                 /* directory file descriptor, relative to which we save */
 	enum TextSaveMethod type;  /* method used to save file */
+	bool started;              /* whether an in place overwrite started */
+	bool synced;               /* whether the data was already flushed by text_save_sync */
+	char *journal;             /* name of the journal of an in place save, or NULL */
 };
 
+/* An in place save of the whole text only overwrites the part of the file
+ * which changed. Its original content is first stored in a journal named
+ * `.filename.vis.journal` next to the file, which is removed once the new
+ * content is durable. The file is resized upfront, while being overwritten
+ * it thus has a known size and a modification time not older than the
+ * journal. If one is found when loading a file in this state, the original
+ * content is restored in memory. The file itself is only written by the
+ * next save, until then the journal is kept.
+ */
+typedef struct {
+	char magic[8];             /* JOURNAL_MAGIC, written last */
+	uint64_t offset;           /* start of the overwritten range */
+	uint64_t size;             /* original file size */
+	uint64_t len;              /* number of original bytes following the header */
+	uint64_t dev, ino;         /* identity of the file */
+	uint64_t state_size;       /* file size during the save */
+	int64_t state_mtime;       /* lower bound of its modification time */
+} Journal;
+
+#define JOURNAL_MAGIC "visjrnl2"
+#define JOURNAL_SUFFIX ".vis.journal"
+
+static bool journal_restore(int dirfd, const char *filename);
+static int journal_remove(TextSave *ctx);
+
+/* Chunks up to this size are collected and written with a single writev(2) */
+#define WRITE_BATCH_SIZE (1 << 16)
+#ifndef IOV_MAX
+#define IOV_MAX 16
+#endif
+
 /* Allocate blocks holding the actual file content in chunks of size: */
 #ifndef BLOCK_SIZE
 #define BLOCK_SIZE (1 << 20)
@@ -50,6 +90,8 @@ Block *block_alloc(size_t size) {
 	}
 	blk->type = BLOCK_TYPE_MALLOC;
 	blk->size = size;
+	blk->refs = 1;
+	blk->fd = -1;
 	return blk;
 }
 
@@ -57,22 +99,38 @@ Block *block_read(size_t size, int fd) {
 	Block *blk = block_alloc(size);
 	if (!blk)
 		return NULL;
-	char *data = blk->data;
-	size_t rem = size;
+	blk->fd = fd;
+	ssize_t len = block_read_more(blk, size);
+	blk->fd = -1;
+	if (len == -1) {
+		block_free(blk);
+		return NULL;
+	}
+	return blk;
+}
+
+/* append at most len bytes read from the block's file descriptor, stops
+ * short only at end of file. Returns the number of bytes read or -1. */
+ssize_t block_read_more(Block *blk, size_t len) {
+	if (len > blk->size - blk->len)
+		len = blk->size - blk->len;
+	char *data = blk->data + blk->len;
+	size_t rem = len;
 	while (rem > 0) {
-		ssize_t len = read(fd, data, rem);
-		if (len == -1) {
-			block_free(blk);
-			return NULL;
-		} else if (len == 0) {
+		ssize_t n = read(blk->fd, data, rem);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		} else if (n == 0) {
 			break;
 		} else {
-			data += len;
-			rem -= len;
+			data += n;
+			rem -= n;
 		}
 	}
-	blk->len = size - rem;
-	return blk;
+	blk->len += len - rem;
+	return len - rem;
 }
 
 Block *block_mmap(size_t size, int fd, off_t offset) {
@@ -89,6 +147,9 @@ Block *block_mmap(size_t size, int fd, off_t offset) {
 	blk->type = BLOCK_TYPE_MMAP_ORIG;
 	blk->size = size;
 	blk->len = size;
+	blk->refs = 1;
+	blk->fd = fd;
+	blk->offset = offset;
 	return blk;
 }
 
@@ -110,14 +171,33 @@ Block *block_load(int dirfd, const char *filename, enum TextLoadMethod method, s
 		goto out;
 	if (method == TEXT_LOAD_READ || (method == TEXT_LOAD_AUTO && size < BLOCK_MMAP_SIZE))
 		block = block_read(size, fd);
+	else if (method == TEXT_LOAD_PROGRESSIVE && size < BLOCK_MMAP_SIZE && (block = block_alloc(size)))
+		block->fd = fd; /* content is read by text_load_continue */
 	else
 		block = block_mmap(size, fd, 0);
+	if (block && block->fd == fd)
+		fd = -1; /* kept open by the block */
 out:
 	if (fd != -1)
 		close(fd);
 	return block;
 }
 
+/* release the file descriptor of a block, a shared one is closed together
+ * with the last block using it */
+static int block_fd_release(Block *blk) {
+	int fd = blk->fd;
+	Block *owner = blk->owner;
+	blk->fd = -1;
+	blk->owner = NULL;
+	if (owner) {
+		if (--owner->refs == 0)
+			block_free(owner);
+		return 0;
+	}
+	return fd == -1 ? 0 : close(fd);
+}
+
 void block_free(Block *blk) {
 	if (!blk)
 		return;
@@ -125,9 +205,46 @@ void block_free(Block *blk) {
 		free(blk->data);
 	else if ((blk->type == BLOCK_TYPE_MMAP_ORIG || blk->type == BLOCK_TYPE_MMAP) && blk->data)
 		munmap(blk->data, blk->size);
+	block_fd_release(blk);
 	free(blk);
 }
 
+/* tell the kernel how the mmap(2)-ed block data [off, off+len) will be accessed */
+void block_advise(Block *blk, size_t off, size_t len, enum TextAdvice advice) {
+	if (blk->type == BLOCK_TYPE_MALLOC || off >= blk->size)
+		return;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t end = MIN(off + len, blk->size);
+	off -= off % page;
+	end += (page - end % page) % page;
+	char *addr = blk->data + off;
+	len = end - off;
+	switch (advice) {
+	case TEXT_ADVICE_NORMAL:
+		posix_madvise(addr, len, POSIX_MADV_NORMAL);
+		break;
+	case TEXT_ADVICE_RANDOM:
+		posix_madvise(addr, len, POSIX_MADV_RANDOM);
+		break;
+	case TEXT_ADVICE_SEQUENTIAL:
+		posix_madvise(addr, len, POSIX_MADV_SEQUENTIAL);
+		break;
+	case TEXT_ADVICE_WILLNEED:
+		posix_madvise(addr, len, POSIX_MADV_WILLNEED);
+		break;
+	case TEXT_ADVICE_DONTNEED:
+#ifdef MADV_DONTNEED
+		/* POSIX_MADV_DONTNEED is commonly ignored, whereas madvise(2)
+		 * releases the pages of the shared file mapping. They are read
+		 * back from the file upon the next access. */
+		madvise(addr, len, MADV_DONTNEED);
+#else
+		posix_madvise(addr, len, POSIX_MADV_DONTNEED);
+#endif
+		break;
+	}
+}
+
 /* check whether block has enough free space to store len bytes */
 bool block_capacity(Block *blk, size_t len) {
 	return blk->size - blk->len >= len;
@@ -182,7 +299,7 @@ Text *text_load_method(const char *filename, enum TextLoadMethod method) {
 	return text_loadat_method(AT_FDCWD, filename, method);
 }
 
-static ssize_t write_all(int fd, const char *buf, size_t count) {
+ssize_t write_all(int fd, const char *buf, size_t count) {
 	size_t rem = count;
 	while (rem > 0) {
 		ssize_t written = write(fd, buf, rem > INT_MAX ? INT_MAX : rem);
@@ -199,6 +316,61 @@ static ssize_t write_all(int fd, const char *buf, size_t count) {
 	return count - rem;
 }
 
+static ssize_t writev_all(int fd, struct iovec *iov, int iovcnt) {
+	size_t count = 0;
+	for (int i = 0; i < iovcnt; i++)
+		count += iov[i].iov_len;
+	size_t rem = count;
+	while (rem > 0) {
+		ssize_t written = writev(fd, iov, iovcnt);
+		if (written < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -1;
+		} else if (written == 0) {
+			break;
+		}
+		rem -= written;
+		for (; iovcnt > 0 && (size_t)written >= iov->iov_len; iov++, iovcnt--)
+			written -= iov->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return count - rem;
+}
+
+/* Copy len bytes starting at offset off of file in to the current offset
+ * of out without passing them through user space. File systems which
+ * support it share the underlying storage instead of copying (reflink).
+ * Returns -1 with errno EOPNOTSUPP if this is not supported for out. */
+static ssize_t file_copy(int in, off_t off, size_t len, int out) {
+#if CONFIG_COPY_FILE_RANGE
+	size_t rem = len;
+	while (rem > 0) {
+		ssize_t copied = copy_file_range(in, &off, out, NULL, rem, 0);
+		if (copied < 0) {
+			if (errno == EINTR)
+				continue;
+			if (rem != len)
+				break;
+			/* e.g. old kernels copying between file systems, fd is a pipe */
+			if (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EBADF)
+				errno = EOPNOTSUPP;
+			return -1;
+		} else if (copied == 0) {
+			break;
+		}
+		rem -= copied;
+	}
+	return len - rem;
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
 static bool preserve_acl(int src, int dest) {
 #if CONFIG_ACL
 	acl_t acl = acl_get_fd(src);
@@ -334,7 +506,7 @@ err:
 }
 
 static bool text_save_commit_atomic(TextSave *ctx) {
-	if (fsync(ctx->fd) == -1)
+	if (!ctx->synced && fsync(ctx->fd) == -1)
 		return false;
 
 	struct stat meta = { 0 };
@@ -348,6 +520,8 @@ static bool text_save_commit_atomic(TextSave *ctx) {
 
 	if (renameat(ctx->dirfd, ctx->tmpname, ctx->dirfd, ctx->filename) == -1)
 		return false;
+	if (journal_remove(ctx) == -1)
+		return false;
 
 	free(ctx->tmpname);
 	ctx->tmpname = NULL;
@@ -368,65 +542,408 @@ static bool text_save_commit_atomic(TextSave *ctx) {
 	return true;
 }
 
-static bool text_save_begin_inplace(TextSave *ctx) {
-	Text *txt = ctx->txt;
-	struct stat now = { 0 };
-	int newfd = -1, saved_errno;
-	if ((ctx->fd = openat(ctx->dirfd, ctx->filename, O_CREAT|O_WRONLY, 0666)) == -1)
+/* Copy the first len bytes of a mmap-ed block to an unlinked temporary file
+ * and remap the block from there at the same address, such that all pointers
+ * from the various pieces are still valid.
+ */
+static bool block_remap(Block *block, size_t len) {
+	int saved_errno;
+	char tmpname[32] = "/tmp/vis-XXXXXX";
+	int fd = mkstemp(tmpname);
+	if (fd == -1)
+		return false;
+	if (unlink(tmpname) == -1)
 		goto err;
+	ssize_t written = write_all(fd, block->data, len);
+	if (written == -1 || (size_t)written != len)
+		goto err;
+	if (ftruncate(fd, block->size) == -1)
+		goto err;
+	void *data = mmap(block->data, block->size, PROT_READ, MAP_SHARED|MAP_FIXED, fd, 0);
+	if (data == MAP_FAILED)
+		goto err;
+	bool close_failed = block_fd_release(block) == -1;
+	block->fd = fd;
+	block->offset = 0;
+	block->type = BLOCK_TYPE_MMAP;
+	return !close_failed;
+err:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return false;
+}
+
+/* The file we are going to overwrite might currently be mmap-ed from
+ * text_load or text_append_file, therefore the affected blocks are moved
+ * to temporary files. Mappings of appended ranges might extend beyond the
+ * end of file, only the part backed by the file is copied.
+ */
+static bool text_save_remap(TextSave *ctx) {
+	struct stat now;
 	if (fstat(ctx->fd, &now) == -1)
+		return false;
+	Block *block;
+	for (size_t i = 0; (block = text_block_mmaped(ctx->txt, &i)); ) {
+		struct stat mapped;
+		if (fstat(block->fd, &mapped) == -1)
+			return false;
+		if (mapped.st_dev != now.st_dev || mapped.st_ino != now.st_ino)
+			continue;
+		size_t valid = mapped.st_size > block->offset ? MIN(block->size, (size_t)(mapped.st_size - block->offset)) : 0;
+		if (!block_remap(block, valid))
+			return false;
+	}
+	return true;
+}
+
+/* make the creation or removal of a directory entry durable */
+static bool dir_sync(int dirfd, const char *filename) {
+	char *name = strdup(filename);
+	if (!name)
+		return false;
+	int dir = openat(dirfd, dirname(name), O_DIRECTORY|O_RDONLY);
+	free(name);
+	if (dir == -1)
+		return false;
+	bool synced = fsync(dir) == 0 || errno == EINVAL;
+	return close(dir) == 0 && synced;
+}
+
+/* copy len bytes starting at offset off of in to the current offset of out */
+static bool file_copy_all(int in, off_t off, size_t len, int out) {
+	ssize_t copied = file_copy(in, off, len, out);
+	if (copied != -1)
+		return (size_t)copied == len;
+	if (errno != EOPNOTSUPP)
+		return false;
+	char buf[1 << 16];
+	while (len > 0) {
+		ssize_t n = pread(in, buf, MIN(len, sizeof buf), off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return false;
+		}
+		if (write_all(out, buf, n) != n)
+			return false;
+		off += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* name of the hidden file `.filename<suffix>` next to filename */
+char *sidecar_name(const char *filename, const char *suffix) {
+	size_t len = strlen(filename) + sizeof("./.") + strlen(suffix);
+	char *dir = strdup(filename);
+	char *base = strdup(filename);
+	char *name = dir && base ? malloc(len) : NULL;
+	if (name)
+		snprintf(name, len, "%s/.%s%s", dirname(dir), basename(base), suffix);
+	free(dir);
+	free(base);
+	return name;
+}
+
+/* Store the original file content starting at offset start in a journal,
+ * the file is going to be resized to state_size. The header is only written
+ * once the content is durable, a journal without it is incomplete and the
+ * file has not yet been touched.
+ */
+static bool text_save_journal(TextSave *ctx, int orig, size_t start, size_t state_size) {
+	struct stat meta, journal;
+	if (fstat(orig, &meta) == -1)
+		return false;
+	if (!(ctx->journal = sidecar_name(ctx->filename, JOURNAL_SUFFIX)))
+		return false;
+	int fd = openat(ctx->dirfd, ctx->journal, O_CREAT|O_TRUNC|O_WRONLY, 0600);
+	if (fd == -1)
 		goto err;
-	struct stat loaded = text_stat(txt);
-	Block *block = text_block_mmaped(txt);
-	if (block && now.st_dev == loaded.st_dev && now.st_ino == loaded.st_ino) {
-		/* The file we are going to overwrite is currently mmap-ed from
-		 * text_load, therefore we copy the mmap-ed block to a temporary
-		 * file and remap it at the same position such that all pointers
-		 * from the various pieces are still valid.
-		 */
-		size_t size = block->size;
-		char tmpname[32] = "/tmp/vis-XXXXXX";
-		newfd = mkstemp(tmpname);
-		if (newfd == -1)
-			goto err;
-		if (unlink(tmpname) == -1)
-			goto err;
-		ssize_t written = write_all(newfd, block->data, size);
-		if (written == -1 || (size_t)written != size)
-			goto err;
-		void *data = mmap(block->data, size, PROT_READ, MAP_SHARED|MAP_FIXED, newfd, 0);
-		if (data == MAP_FAILED)
-			goto err;
-		bool close_failed = (close(newfd) == -1);
-		newfd = -1;
-		if (close_failed)
-			goto err;
-		block->type = BLOCK_TYPE_MMAP;
+	size_t size = meta.st_size;
+	Journal header = {
+		.offset = start,
+		.size = size,
+		.len = size > start ? size - start : 0,
+		.dev = meta.st_dev,
+		.ino = meta.st_ino,
+		.state_size = state_size,
+	};
+	bool written = lseek(fd, sizeof header, SEEK_SET) != -1 &&
+	               file_copy_all(orig, start, header.len, fd) && fsync(fd) == 0 &&
+	               fstat(fd, &journal) == 0;
+	if (written) {
+		/* both reside in the same directory, hence use the same clock */
+		header.state_mtime = journal.st_mtime;
+		memcpy(header.magic, JOURNAL_MAGIC, sizeof header.magic);
+		written = pwrite(fd, &header, sizeof header, 0) == sizeof header && fsync(fd) == 0;
 	}
-	/* overwrite the existing file content, if something goes wrong
-	 * here we are screwed, TODO: make a backup before? */
-	if (ftruncate(ctx->fd, 0) == -1)
+	if (close(fd) == -1 || !written || !dir_sync(ctx->dirfd, ctx->filename))
 		goto err;
-	ctx->type = TEXT_SAVE_INPLACE;
 	return true;
-err:
-	saved_errno = errno;
-	if (newfd != -1)
-		close(newfd);
-	if (ctx->fd != -1)
-		close(ctx->fd);
-	ctx->fd = -1;
+err:;
+	int saved_errno = errno;
+	unlinkat(ctx->dirfd, ctx->journal, 0);
+	free(ctx->journal);
+	ctx->journal = NULL;
 	errno = saved_errno;
 	return false;
 }
 
+static bool journal_read(int fd, Journal *header) {
+	struct stat meta;
+	return pread(fd, header, sizeof *header, 0) == sizeof *header &&
+	       memcmp(header->magic, JOURNAL_MAGIC, sizeof header->magic) == 0 &&
+	       fstat(fd, &meta) == 0 && (uint64_t)meta.st_size >= sizeof *header + header->len &&
+	       MIN(header->offset, header->size) + header->len == header->size;
+}
+
+/* whether the file described by info is in the state an interrupted save left it in */
+static bool journal_matches(const Journal *header, const struct stat *info) {
+	return S_ISREG(info->st_mode) && header->size > 0 &&
+	       header->dev == (uint64_t)info->st_dev && header->ino == (uint64_t)info->st_ino &&
+	       header->state_size == (uint64_t)info->st_size && header->state_mtime <= (int64_t)info->st_mtime &&
+	       MIN(header->offset, header->size) <= header->state_size;
+}
+
+Block *journal_load(int dirfd, const char *filename, struct stat *info) {
+	int saved_errno = errno;
+	Block *block = NULL;
+	int fd = -1, file = -1;
+	char *name = sidecar_name(filename, JOURNAL_SUFFIX);
+	if (!name || (fd = openat(dirfd, name, O_RDONLY)) == -1 ||
+	    (file = openat(dirfd, filename, O_RDONLY)) == -1)
+		goto out;
+	Journal header;
+	if (!journal_read(fd, &header) || fstat(file, info) == -1 || !journal_matches(&header, info))
+		goto out;
+	size_t prefix = MIN(header.offset, header.size);
+	if (!(block = block_alloc(header.size)) || lseek(fd, sizeof header, SEEK_SET) == -1)
+		goto out;
+	block->fd = file;
+	bool read = block_read_more(block, prefix) == (ssize_t)prefix;
+	block->fd = fd;
+	read = read && block_read_more(block, header.len) == (ssize_t)header.len;
+	block->fd = -1;
+	if (!read) {
+		block_free(block);
+		block = NULL;
+	}
+out:
+	if (fd != -1)
+		close(fd);
+	if (file != -1)
+		close(file);
+	free(name);
+	errno = saved_errno;
+	return block;
+}
+
+bool text_journal_exists(const char *filename) {
+	Journal header;
+	char *name = sidecar_name(filename, JOURNAL_SUFFIX);
+	int fd = name ? open(name, O_RDONLY) : -1;
+	bool exists = fd != -1 && journal_read(fd, &header);
+	if (fd != -1)
+		close(fd);
+	free(name);
+	return exists;
+}
+
+/* Once the file holds the saved content, a journal left behind by an earlier
+ * interrupted save is obsolete. Returns 1 if one was removed, 0 if there was
+ * none and -1 on error. The directory is synced by the caller. */
+static int journal_remove(TextSave *ctx) {
+	char *name = ctx->journal ? ctx->journal : sidecar_name(ctx->filename, JOURNAL_SUFFIX);
+	int ret = !name ? -1 : unlinkat(ctx->dirfd, name, 0) == 0 ? 1 : errno == ENOENT ? 0 : -1;
+	free(name);
+	ctx->journal = NULL;
+	return ret;
+}
+
+/* Roll back a failed in place save using its journal. */
+static bool journal_restore(int dirfd, const char *filename) {
+	char *name = sidecar_name(filename, JOURNAL_SUFFIX);
+	if (!name)
+		return false;
+	int fd = openat(dirfd, name, O_RDONLY);
+	if (fd == -1) {
+		free(name);
+		return errno == ENOENT;
+	}
+	bool restored = true;
+	Journal header;
+	struct stat meta;
+	if (pread(fd, &header, sizeof header, 0) == sizeof header &&
+	    memcmp(header.magic, JOURNAL_MAGIC, sizeof header.magic) == 0 &&
+	    fstat(fd, &meta) == 0 && (uint64_t)meta.st_size >= sizeof header + header.len) {
+		int file = openat(dirfd, filename, O_WRONLY);
+		restored = file != -1 && lseek(file, header.offset, SEEK_SET) != -1 &&
+		           file_copy_all(fd, sizeof header, header.len, file) &&
+		           ftruncate(file, header.size) == 0 && fsync(file) == 0;
+		if (file != -1)
+			close(file);
+	}
+	close(fd);
+	if (restored)
+		restored = unlinkat(dirfd, name, 0) == 0 && dir_sync(dirfd, filename);
+	free(name);
+	return restored;
+}
+
+typedef struct {
+	Array blocks;              /* blocks mapping the file being overwritten */
+	Array changed;             /* sorted disjoint ranges of the file whose content changes */
+} Delta;
+
+/* whether data refers to a part of the file whose content changes */
+static bool delta_changed(void *context, const char *data, size_t len) {
+	Delta *delta = context;
+	for (size_t i = 0, n = array_length(&delta->blocks); i < n; i++) {
+		Block *block = array_get_ptr(&delta->blocks, i);
+		if (data < block->data || data >= block->data + block->size)
+			continue;
+		size_t start = block->offset + (data - block->data);
+		size_t lo = 0, hi = array_length(&delta->changed);
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			Filerange *r = array_get(&delta->changed, mid);
+			if (r->end <= start)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		Filerange *r = array_get(&delta->changed, lo);
+		return r && r->start < start + len;
+	}
+	return false;
+}
+
+static bool delta_add(Delta *delta, size_t start, size_t end) {
+	size_t len = array_length(&delta->changed);
+	Filerange *last = len ? array_get(&delta->changed, len - 1) : NULL;
+	if (last && last->end == start) {
+		last->end = end;
+		return true;
+	}
+	Filerange r = text_range_new(start, end);
+	return array_add(&delta->changed, &r);
+}
+
+/* Overwrite only the part of the file which differs from the text. Pieces
+ * referring to a mapping of the file at their original offset are known to
+ * be unchanged. The original content of the rewritten range is stored in
+ * a journal first. Returns 1 if the file was written, 0 if this approach
+ * is not applicable and -1 on error.
+ */
+static int text_save_delta(TextSave *ctx) {
+	Text *txt = ctx->txt;
+	int ret = -1, orig = -1, saved_errno;
+	Delta delta;
+	array_init(&delta.blocks);
+	array_init_sized(&delta.changed, sizeof(Filerange));
+	struct stat now;
+	if (fstat(ctx->fd, &now) == -1)
+		goto out;
+	bool shared = false;
+	Block *block;
+	for (size_t i = 0; (block = text_block_mmaped(txt, &i)); ) {
+		struct stat mapped;
+		if (fstat(block->fd, &mapped) == -1)
+			goto out;
+		if (mapped.st_dev != now.st_dev || mapped.st_ino != now.st_ino)
+			continue;
+		if (!array_add_ptr(&delta.blocks, block))
+			goto out;
+		/* snapshots might refer to any part of it */
+		shared |= block->refs > 1;
+	}
+
+	size_t size = text_size(txt), old = now.st_size, start = EPOS, end = size;
+	TextChunk c;
+	for (bool ok = text_chunk_init(txt, &c, 0, size); ok; ok = text_chunk_next(&c)) {
+		bool same = false;
+		for (size_t i = 0, n = array_length(&delta.blocks); i < n && !same; i++) {
+			block = array_get_ptr(&delta.blocks, i);
+			same = block->data <= c.data && c.data < block->data + block->size &&
+			       block->offset + (size_t)(c.data - block->data) == c.pos && c.pos + c.len <= old;
+		}
+		if (same)
+			continue;
+		if (start == EPOS)
+			start = c.pos;
+		end = c.pos + c.len;
+		if (c.pos < old && !delta_add(&delta, c.pos, MIN(end, old)))
+			goto out;
+	}
+	if (size < old && !delta_add(&delta, size, old))
+		goto out;
+	start = MIN(start, size);
+	if (start == 0) {
+		/* nothing to gain over rewriting everything */
+		ret = 0;
+		goto out;
+	}
+
+	/* changed content still referred to has to be preserved */
+	if ((shared || text_pieces_find(txt, delta_changed, &delta)) && !text_save_remap(ctx))
+		goto out;
+	if ((orig = openat(ctx->dirfd, ctx->filename, O_RDONLY)) == -1)
+		goto out;
+	if (!text_save_journal(ctx, orig, start, size))
+		goto out;
+
+	ctx->started = true;
+	Filerange range = text_range_new(start, end);
+	if (ftruncate(ctx->fd, size) == -1 || lseek(ctx->fd, start, SEEK_SET) == -1)
+		goto out;
+	ssize_t written = text_write_range(txt, &range, ctx->fd);
+	if (written == -1 || (size_t)written != text_range_size(&range))
+		goto out;
+	if (lseek(ctx->fd, size, SEEK_SET) == -1)
+		goto out;
+	ret = 1;
+out:
+	saved_errno = errno;
+	if (orig != -1)
+		close(orig);
+	array_release(&delta.blocks);
+	array_release(&delta.changed);
+	errno = saved_errno;
+	return ret;
+}
+
+static bool text_save_begin_inplace(TextSave *ctx) {
+	if ((ctx->fd = openat(ctx->dirfd, ctx->filename, O_CREAT|O_WRONLY, 0666)) == -1)
+		return false;
+	ctx->type = TEXT_SAVE_INPLACE;
+	return true;
+}
+
+/* Start to overwrite the existing file content, if something goes wrong
+ * here we are screwed, TODO: make a backup before? */
+static bool text_save_truncate(TextSave *ctx) {
+	ctx->started = true;
+	return text_save_remap(ctx) && ftruncate(ctx->fd, 0) == 0;
+}
+
 static bool text_save_commit_inplace(TextSave *ctx) {
-	if (fsync(ctx->fd) == -1)
+	if (!ctx->started && !text_save_truncate(ctx))
+		return false;
+	if (!ctx->synced && fsync(ctx->fd) == -1)
 		return false;
 	struct stat meta = { 0 };
 	if (fstat(ctx->fd, &meta) == -1)
 		return false;
-	if (close(ctx->fd) == -1)
+	bool close_failed = (close(ctx->fd) == -1);
+	ctx->fd = -1;
+	if (close_failed)
+		return false;
+	/* the new content is durable, the journal no longer needed */
+	int removed = journal_remove(ctx);
+	if (removed == -1 || (removed && !dir_sync(ctx->dirfd, ctx->filename)))
 		return false;
 	text_saved(ctx->txt, &meta);
 	return true;
@@ -435,6 +952,10 @@ static bool text_save_commit_inplace(TextSave *ctx) {
 TextSave *text_save_begin(Text *txt, int dirfd, const char *filename, enum TextSaveMethod type) {
 	if (!filename)
 		return NULL;
+	if (text_loading(txt)) {
+		errno = EBUSY;
+		return NULL;
+	}
 	TextSave *ctx = calloc(1, sizeof *ctx);
 	if (!ctx)
 		return NULL;
@@ -455,6 +976,45 @@ err:
 	return NULL;
 }
 
+/* whether all data to be written was written, but not yet flushed */
+static bool text_save_pending(TextSave *ctx) {
+	return ctx && !ctx->synced && (ctx->type == TEXT_SAVE_ATOMIC || ctx->started);
+}
+
+bool text_save_sync(TextSave *ctxs[], size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		TextSave *ctx = ctxs[i];
+		if (!text_save_pending(ctx))
+			continue;
+#if CONFIG_SYNCFS
+		/* flush a file system only once if it holds multiple files */
+		struct stat meta, other;
+		if (fstat(ctx->fd, &meta) == -1)
+			return false;
+		size_t shared = 0;
+		for (size_t j = i + 1; j < count; j++) {
+			if (text_save_pending(ctxs[j]) && fstat(ctxs[j]->fd, &other) == 0 &&
+			    other.st_dev == meta.st_dev)
+				shared++;
+		}
+		if (shared) {
+			if (syncfs(ctx->fd) == -1)
+				return false;
+			for (size_t j = i; j < count; j++) {
+				if (text_save_pending(ctxs[j]) && fstat(ctxs[j]->fd, &other) == 0 &&
+				    other.st_dev == meta.st_dev)
+					ctxs[j]->synced = true;
+			}
+			continue;
+		}
+#endif
+		if (fsync(ctx->fd) == -1)
+			return false;
+		ctx->synced = true;
+	}
+	return true;
+}
+
 bool text_save_commit(TextSave *ctx) {
 	if (!ctx)
 		return true;
@@ -483,6 +1043,9 @@ void text_save_cancel(TextSave *ctx) {
 		close(ctx->fd);
 	if (ctx->tmpname && ctx->tmpname[0])
 		unlinkat(ctx->dirfd, ctx->tmpname, 0);
+	if (ctx->journal)
+		journal_restore(ctx->dirfd, ctx->filename);
+	free(ctx->journal);
 	free(ctx->tmpname);
 	free(ctx->filename);
 	free(ctx);
@@ -523,6 +1086,16 @@ bool text_saveat_method(Text *txt, int dirfd, const char *filename, enum TextSav
 }
 
 ssize_t text_save_write_range(TextSave *ctx, const Filerange *range) {
+	if (ctx->type == TEXT_SAVE_INPLACE && !ctx->started) {
+		size_t size = text_size(ctx->txt);
+		if (range->start == 0 && range->end == size) {
+			int delta = text_save_delta(ctx);
+			if (delta != 0)
+				return delta == 1 ? (ssize_t)size : -1;
+		}
+		if (!text_save_truncate(ctx))
+			return -1;
+	}
 	return text_write_range(ctx->txt, range, ctx->fd);
 }
 
@@ -531,20 +1104,344 @@ ssize_t text_write(const Text *txt, int fd) {
 	return text_write_range(txt, &r, fd);
 }
 
+/* Unmodified parts still stored in a file are copied within the kernel,
+ * small modified pieces are collected and written in batches. */
 ssize_t text_write_range(const Text *txt, const Filerange *range, int fd) {
 	size_t size = text_range_size(range), rem = size;
-	for (Iterator it = text_iterator_get(txt, range->start);
-	     rem > 0 && text_iterator_valid(&it);
-	     text_iterator_next(&it)) {
-		size_t prem = it.end - it.text;
-		if (prem > rem)
-			prem = rem;
-		ssize_t written = write_all(fd, it.text, prem);
+	/* large ranges are streamed window wise: the next window is read
+	 * ahead while the already written ones are released */
+	bool windowed = size > TEXT_WINDOW_SIZE;
+	size_t window = range->start;
+	if (windowed)
+		text_advise(txt, range->start, size, TEXT_ADVICE_SEQUENTIAL);
+	bool copy = true;
+	struct iovec iov[IOV_MAX];
+	int iovcnt = 0;
+	size_t batched = 0;
+	TextChunk c;
+	for (bool ok = text_chunk_init(txt, &c, range->start, size); ok; ok = text_chunk_next(&c)) {
+		Block *blk = copy ? text_block_mapped(txt, c.data) : NULL;
+		bool file = blk && blk->fd != -1;
+		bool batch = !file && c.len <= WRITE_BATCH_SIZE;
+		if (iovcnt && (!batch || iovcnt == IOV_MAX || batched + c.len > WRITE_BATCH_SIZE)) {
+			ssize_t written = writev_all(fd, iov, iovcnt);
+			if (written == -1)
+				return -1;
+			rem -= written;
+			if ((size_t)written != batched)
+				return size - rem;
+			iovcnt = 0;
+			batched = 0;
+		}
+		if (batch) {
+			iov[iovcnt].iov_base = (char*)c.data;
+			iov[iovcnt++].iov_len = c.len;
+			batched += c.len;
+			continue;
+		}
+		if (file) {
+			ssize_t copied = file_copy(blk->fd, blk->offset + (c.data - blk->data), c.len, fd);
+			if (copied == -1 && errno != EOPNOTSUPP)
+				return -1;
+			if (copied != -1) {
+				rem -= copied;
+				if ((size_t)copied != c.len)
+					return size - rem;
+				continue;
+			}
+			copy = false;
+		}
+		for (size_t off = 0; off < c.len; ) {
+			size_t len = MIN(c.len - off, TEXT_WINDOW_SIZE);
+			ssize_t written = write_all(fd, c.data + off, len);
+			if (written == -1)
+				return -1;
+			rem -= written;
+			off += written;
+			if ((size_t)written != len)
+				return size - rem;
+			size_t pos = c.pos + off;
+			if (windowed && pos >= window + TEXT_WINDOW_SIZE) {
+				text_advise(txt, pos, TEXT_WINDOW_SIZE, TEXT_ADVICE_WILLNEED);
+				text_advise(txt, window, pos - window, TEXT_ADVICE_DONTNEED);
+				window = pos;
+			}
+		}
+	}
+	if (iovcnt) {
+		ssize_t written = writev_all(fd, iov, iovcnt);
 		if (written == -1)
 			return -1;
 		rem -= written;
-		if ((size_t)written != prem)
-			break;
 	}
+	if (windowed)
+		text_advise(txt, window, range->end - window, TEXT_ADVICE_NORMAL);
 	return size - rem;
 }
+
+/* A recovery journal `.filename.vis.recovery` records all changes of a text
+ * relative to the file on disk. Following a header identifying the file,
+ * each record consists of a type byte and LEB128 encoded numbers:
+ *
+ *  'd' pos len         deletion of len bytes at pos
+ *  'i' pos len data    insertion of len bytes at pos
+ *  's'                 snapshot boundary
+ *
+ * Records are buffered and appended at snapshot boundaries, flushing them to
+ * disk with fdatasync(2) is left to the caller. Replaying the journal onto
+ * the file content restores the text after a crash.
+ */
+typedef struct {
+	char magic[8];             /* RECOVERY_MAGIC */
+	uint64_t size;             /* size of the file */
+	uint64_t ino;              /* inode number of the file */
+	int64_t mtime;             /* modification time of the file */
+} RecoveryHeader;
+
+#define RECOVERY_MAGIC "visrcvr1"
+#define RECOVERY_SUFFIX ".vis.recovery"
+/* Records are collected in a buffer of this size before being written */
+#define RECOVERY_BUFFER (1 << 12)
+/* Maximal size of an encoded record header: type and two numbers */
+#define RECOVERY_RECORD (1 + 2*10)
+
+struct Recovery {
+	int fd;                    /* journal file descriptor, positioned at its end */
+	char *name;                /* journal file name */
+	int error;                 /* errno(3) value of the first failure, 0 otherwise */
+	bool dirty;                /* whether data was written since the last fdatasync(2) */
+	size_t len;                /* number of buffered bytes */
+	char buf[RECOVERY_BUFFER]; /* records not yet written */
+};
+
+static size_t varint_encode(char *buf, uint64_t value) {
+	size_t len = 0;
+	do {
+		unsigned char byte = value & 0x7f;
+		value >>= 7;
+		buf[len++] = byte | (value ? 0x80 : 0);
+	} while (value);
+	return len;
+}
+
+static bool varint_decode(const unsigned char **data, const unsigned char *end, uint64_t *value) {
+	*value = 0;
+	for (unsigned int shift = 0; *data < end && shift < 64; shift += 7) {
+		unsigned char byte = *(*data)++;
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+static void recovery_header(RecoveryHeader *header, const struct stat *info) {
+	memset(header, 0, sizeof *header);
+	memcpy(header->magic, RECOVERY_MAGIC, sizeof header->magic);
+	header->size = info->st_size;
+	header->ino = info->st_ino;
+	header->mtime = info->st_mtime;
+}
+
+static bool recovery_write(Recovery *rec, const char *data, size_t len) {
+	if (rec->error)
+		return false;
+	if (len == 0)
+		return true;
+	if (write_all(rec->fd, data, len) != (ssize_t)len) {
+		rec->error = errno ? errno : EIO;
+		return false;
+	}
+	rec->dirty = true;
+	return true;
+}
+
+static bool recovery_flush(Recovery *rec) {
+	size_t len = rec->len;
+	rec->len = 0;
+	return recovery_write(rec, rec->buf, len);
+}
+
+static Recovery *recovery_new(const char *filename) {
+	Recovery *rec = calloc(1, sizeof *rec);
+	if (!rec)
+		return NULL;
+	rec->fd = -1;
+	if (!(rec->name = sidecar_name(filename, RECOVERY_SUFFIX))) {
+		free(rec);
+		return NULL;
+	}
+	return rec;
+}
+
+Recovery *recovery_create(const char *filename, const struct stat *info) {
+	Recovery *rec = recovery_new(filename);
+	if (!rec)
+		return NULL;
+	/* never discard the changes of a previous session */
+	struct stat meta;
+	if (stat(rec->name, &meta) == 0 && (size_t)meta.st_size > sizeof(RecoveryHeader)) {
+		errno = EEXIST;
+		goto err;
+	}
+	if ((rec->fd = open(rec->name, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0600)) == -1)
+		goto err;
+	if (!recovery_reset(rec, info))
+		goto err;
+	return rec;
+err:;
+	int saved_errno = errno;
+	recovery_close(rec, rec->fd != -1);
+	errno = saved_errno;
+	return NULL;
+}
+
+bool recovery_reset(Recovery *rec, const struct stat *info) {
+	RecoveryHeader header;
+	recovery_header(&header, info);
+	rec->len = 0;
+	if (rec->error || ftruncate(rec->fd, 0) == -1 || lseek(rec->fd, 0, SEEK_SET) == -1) {
+		if (!rec->error)
+			rec->error = errno;
+		return false;
+	}
+	return recovery_write(rec, (char*)&header, sizeof header);
+}
+
+bool recovery_change(Recovery *rec, const Text *txt, size_t pos, size_t del, size_t ins) {
+	if (rec->error)
+		return false;
+	if (rec->len + 2*RECOVERY_RECORD > sizeof rec->buf && !recovery_flush(rec))
+		return false;
+	if (del > 0) {
+		rec->buf[rec->len++] = 'd';
+		rec->len += varint_encode(rec->buf + rec->len, pos);
+		rec->len += varint_encode(rec->buf + rec->len, del);
+	}
+	if (ins == 0)
+		return true;
+	rec->buf[rec->len++] = 'i';
+	rec->len += varint_encode(rec->buf + rec->len, pos);
+	rec->len += varint_encode(rec->buf + rec->len, ins);
+	/* large insertions bypass the buffer */
+	bool buffered = rec->len + ins <= sizeof rec->buf;
+	if (!buffered && !recovery_flush(rec))
+		return false;
+	TextChunk c;
+	for (bool ok = text_chunk_init(txt, &c, pos, ins); ok; ok = text_chunk_next(&c)) {
+		if (buffered) {
+			memcpy(rec->buf + rec->len, c.data, c.len);
+			rec->len += c.len;
+		} else if (!recovery_write(rec, c.data, c.len)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool recovery_snapshot(Recovery *rec) {
+	if (rec->error)
+		return false;
+	if (rec->len == sizeof rec->buf && !recovery_flush(rec))
+		return false;
+	rec->buf[rec->len++] = 's';
+	return recovery_flush(rec);
+}
+
+bool recovery_sync(Recovery *rec) {
+	if (!recovery_flush(rec))
+		goto err;
+	if (rec->dirty && fdatasync(rec->fd) == -1) {
+		rec->error = errno;
+		goto err;
+	}
+	rec->dirty = false;
+	return true;
+err:
+	errno = rec->error;
+	return false;
+}
+
+void recovery_close(Recovery *rec, bool remove) {
+	if (!rec)
+		return;
+	if (rec->fd != -1)
+		close(rec->fd);
+	if (remove)
+		unlink(rec->name);
+	free(rec->name);
+	free(rec);
+}
+
+Recovery *recovery_replay(Text *txt, const char *filename, bool force) {
+	Recovery *rec = recovery_new(filename);
+	if (!rec)
+		return NULL;
+	char *data = MAP_FAILED;
+	size_t size = 0;
+	struct stat meta;
+	if ((rec->fd = open(rec->name, O_RDWR|O_CLOEXEC)) == -1 || fstat(rec->fd, &meta) == -1)
+		goto err;
+	size = meta.st_size;
+	RecoveryHeader header, loaded;
+	struct stat info = text_stat(txt);
+	recovery_header(&loaded, &info);
+	if (size < sizeof header || pread(rec->fd, &header, sizeof header, 0) != sizeof header ||
+	    memcmp(header.magic, RECOVERY_MAGIC, sizeof header.magic)) {
+		errno = EINVAL;
+		goto err;
+	}
+	/* the file might have grown since, while it was followed */
+	if (header.size > text_size(txt) || (!force &&
+	    (header.ino != loaded.ino || header.mtime != loaded.mtime || header.size != loaded.size))) {
+		errno = ESTALE;
+		goto err;
+	}
+	if ((data = mmap(NULL, size, PROT_READ, MAP_SHARED, rec->fd, 0)) == MAP_FAILED)
+		goto err;
+	if (!text_delete(txt, header.size, text_size(txt) - header.size))
+		goto err;
+	/* apply all complete records, a partially written one is dropped */
+	const unsigned char *cur = (unsigned char*)data + sizeof header, *end = (unsigned char*)data + size;
+	const unsigned char *valid = cur;
+	while (cur < end) {
+		unsigned char type = *cur++;
+		uint64_t pos, len;
+		bool ok = true;
+		if (type == 's') {
+			text_snapshot(txt);
+		} else if (type == 'd' || type == 'i') {
+			if (!varint_decode(&cur, end, &pos) || !varint_decode(&cur, end, &len))
+				break;
+			if (type == 'd') {
+				ok = text_delete(txt, pos, len);
+			} else if ((uint64_t)(end - cur) < len) {
+				break;
+			} else {
+				ok = text_insert(txt, pos, (const char*)cur, len);
+				cur += len;
+			}
+		} else {
+			ok = false;
+		}
+		if (!ok) {
+			errno = EINVAL;
+			goto err;
+		}
+		valid = cur;
+	}
+	text_snapshot(txt);
+	off_t offset = (char*)valid - data;
+	munmap(data, size);
+	data = MAP_FAILED;
+	if (ftruncate(rec->fd, offset) == -1 || lseek(rec->fd, offset, SEEK_SET) == -1)
+		goto err;
+	return rec;
+err:;
+	int saved_errno = errno;
+	if (data != MAP_FAILED)
+		munmap(data, size);
+	recovery_close(rec, false);
+	errno = saved_errno;
+	return NULL;
+}
@@ -0,0 +1,1580 @@
+/* Regex backend based on a lazily constructed DFA.
+ *
+ * Patterns are parsed into a syntax tree which is compiled into a byte
+ * oriented NFA program, once for forward and once for backward matching.
+ * Multibyte characters are expanded into alternatives of byte sequences.
+ * Back references are not supported.
+ *
+ * Searches run in time linear in the size of the input:
+ *
+ *  1) a forward scan determines the end of the leftmost-longest match,
+ *     DFA states keep NFA threads grouped by their starting position
+ *  2) a backward scan from there determines its start
+ *  3) submatches are recovered by simulating the NFA over the match
+ *
+ * DFA states are created on demand and kept in a cache of bounded size
+ * which is flushed when full. If this happens too often, the automaton
+ * is simulated without caching any states.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <ctype.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#include "text-regex.h"
+#include "text-regex-literal.h"
+#include "text-motions.h"
+#include "text-util.h"
+#include "util.h"
+
+/* Backward searches are performed on line aligned windows of about this size */
+#define SEARCH_WINDOW_SIZE (1 << 20)
+/* Maximal number of program instructions */
+#define PROG_MAX (1 << 14)
+/* Memory used by cached DFA states before the cache is flushed */
+#define DFA_CACHE_SIZE (1 << 21)
+/* Number of cache flushes during a scan before giving up on caching */
+#define DFA_FLUSH_MAX 8
+/* Number of memoized DFA states of earlier scans, see search_last */
+#define MEMO_SIZE (1 << 16)
+/* Number of scans remembered before the memo is reset */
+#define MEMO_RUNS (1 << 16)
+/* Largest code point considered for case folding and character classes */
+#define FOLD_MAX 0x2FFFF
+
+enum {
+	OP_BYTE,   /* match a byte in [lo, hi] */
+	OP_SPLIT,  /* continue at x and y, x is preferred */
+	OP_JMP,    /* continue at x */
+	OP_ASSERT, /* zero width assertion of kind lo */
+	OP_SAVE,   /* store current position in submatch slot x */
+	OP_MATCH,
+};
+
+enum {
+	ASSERT_BOL,        /* ^ */
+	ASSERT_EOL,        /* $ */
+	ASSERT_BEGIN,      /* \` */
+	ASSERT_END,        /* \' */
+	ASSERT_WORD_BEGIN, /* \< */
+	ASSERT_WORD_END,   /* \> */
+	ASSERT_WORD,       /* \b */
+	ASSERT_NOT_WORD,   /* \B */
+};
+
+/* context of a position in the input, as seen from one side */
+enum {
+	CTX_OTHER,
+	CTX_WORD,
+	CTX_NEWLINE,
+	CTX_BEGIN,        /* start of the searched range */
+	CTX_BEGIN_NOTBOL, /* start of the searched range with REG_NOTBOL */
+	CTX_END,          /* end of the searched range */
+	CTX_END_NOTEOL,   /* end of the searched range with REG_NOTEOL */
+};
+
+typedef struct {
+	unsigned char op, lo, hi;
+	int x, y;
+} Inst;
+
+typedef struct {
+	Inst *inst;
+	int len, cap;
+} Prog;
+
+typedef struct {
+	unsigned lo, hi;
+} Range;
+
+/* set of code points and additionally matched raw bytes */
+typedef struct {
+	Range *ranges;
+	size_t len, cap;
+	unsigned char bytes[32];
+} Set;
+
+enum {
+	NODE_EMPTY,
+	NODE_SET,
+	NODE_CAT,
+	NODE_ALT,
+	NODE_REPEAT,
+	NODE_GROUP,
+	NODE_ASSERT,
+};
+
+typedef struct Node Node;
+struct Node {
+	int type;
+	Node *left, *right; /* CAT, ALT; REPEAT and GROUP only use left */
+	int min, max;       /* REPEAT, max is -1 if unbounded; GROUP index and ASSERT kind in min */
+	Set set;            /* SET */
+	Node *all;          /* list of all allocated nodes */
+};
+
+typedef struct {
+	const char *s; /* remaining pattern */
+	int cflags;
+	bool utf8;
+	int err;
+	size_t nsub;
+	Node *nodes;
+} Parser;
+
+typedef struct {
+	int ctx;      /* context of the previously consumed byte */
+	bool matched; /* whether a match was found, no further threads are started */
+	int len;      /* instructions, groups of threads in order of priority are separated by -1 */
+	int *insts;
+	unsigned hash;
+	int chain;
+} DState;
+
+/* Transitions are stored as the offset of the target state's row in the
+ * transition table shifted left by 3 and combined with flags, -1 if not yet
+ * computed */
+#define TRANS_MATCH   1 /* the state before the transition matches */
+#define TRANS_DEAD    2 /* the state after the transition has no threads */
+#define TRANS_MATCHED 4 /* the state after the transition found a match */
+#define TRANS_SHIFT   3
+
+typedef struct Dfa Dfa;
+struct Dfa {
+	Regex *regex;
+	Prog *prog;
+	bool reverse;  /* whether input is consumed backwards */
+	bool anchored; /* whether threads are only started at the beginning */
+	bool nocache;  /* whether states are no longer cached */
+	int flushes;
+	unsigned generation; /* incremented whenever the cache is flushed */
+	DState *states;
+	int nstates, cap;
+	int *table; /* transitions, nclasses per state */
+	int *buckets;
+	int nbuckets;
+	size_t mem;
+	/* scratch space */
+	int *stack, *buf, *sparse, *dense, ndense;
+};
+
+/* DFA state reached by an earlier scan at a position */
+typedef struct {
+	size_t pos;
+	int row;
+	unsigned epoch;
+	unsigned run;
+} MemoEntry;
+
+typedef struct {
+	MemoEntry *entries; /* indexed by position modulo MEMO_SIZE */
+	size_t *runs;       /* last match found by each scan, EPOS if none */
+	unsigned nruns;
+	unsigned epoch;     /* entries of other epochs are invalid */
+	unsigned generation; /* of the DFA cache the entries refer to */
+} Memo;
+
+struct Regex {
+	Prog forward, backward;
+	Dfa dfa, rdfa;
+	Memo memo;
+	size_t nsub;
+	int cflags;
+	bool multiline; /* whether a match might span multiple lines */
+	RegexLiteral literal;
+	unsigned char classes[256]; /* byte class of each byte */
+	unsigned char sample[256];  /* representative byte of each class */
+	int nclasses;
+	int refcount;
+};
+
+static bool set_add(Set *s, unsigned lo, unsigned hi) {
+	if (s->len == s->cap) {
+		size_t cap = s->cap ? 2*s->cap : 8;
+		Range *ranges = realloc(s->ranges, cap * sizeof *ranges);
+		if (!ranges)
+			return false;
+		s->ranges = ranges;
+		s->cap = cap;
+	}
+	s->ranges[s->len++] = (Range){ lo, hi };
+	return true;
+}
+
+static void set_byte(Set *s, unsigned char b) {
+	s->bytes[b / 8] |= 1 << (b % 8);
+}
+
+static bool set_has_byte(const Set *s, unsigned char b) {
+	return s->bytes[b / 8] & (1 << (b % 8));
+}
+
+static int range_cmp(const void *a, const void *b) {
+	const Range *r1 = a, *r2 = b;
+	return r1->lo < r2->lo ? -1 : r1->lo > r2->lo;
+}
+
+/* sort and merge overlapping or adjacent ranges */
+static void set_normalize(Set *s) {
+	if (!s->len)
+		return;
+	qsort(s->ranges, s->len, sizeof *s->ranges, range_cmp);
+	size_t j = 0;
+	for (size_t i = 1; i < s->len; i++) {
+		if (s->ranges[i].lo <= s->ranges[j].hi + 1) {
+			if (s->ranges[i].hi > s->ranges[j].hi)
+				s->ranges[j].hi = s->ranges[i].hi;
+		} else {
+			s->ranges[++j] = s->ranges[i];
+		}
+	}
+	s->len = j + 1;
+}
+
+static bool set_negate(Set *s, unsigned max) {
+	set_normalize(s);
+	Set n = { 0 };
+	unsigned next = 0;
+	for (size_t i = 0; i < s->len; i++) {
+		if (s->ranges[i].lo > next && !set_add(&n, next, s->ranges[i].lo - 1))
+			goto err;
+		next = s->ranges[i].hi + 1;
+	}
+	if (next <= max && !set_add(&n, next, max))
+		goto err;
+	for (size_t i = 0; i < sizeof s->bytes; i++)
+		n.bytes[i] = ~s->bytes[i];
+	free(s->ranges);
+	*s = n;
+	return true;
+err:
+	free(n.ranges);
+	return false;
+}
+
+static bool set_fold(Set *s, bool utf8) {
+	for (size_t i = 0, len = s->len; i < len; i++) {
+		unsigned hi = MIN(s->ranges[i].hi, utf8 ? FOLD_MAX : 0xFF);
+		for (unsigned c = s->ranges[i].lo; c <= hi; c++) {
+			unsigned l = utf8 ? (unsigned)towlower(c) : (unsigned)tolower(c);
+			unsigned u = utf8 ? (unsigned)towupper(c) : (unsigned)toupper(c);
+			if ((l != c && !set_add(s, l, l)) || (u != c && !set_add(s, u, u)))
+				return false;
+		}
+	}
+	return true;
+}
+
+static bool class_member(wctype_t type, unsigned c, bool utf8) {
+	if (utf8)
+		return iswctype(c, type);
+	wint_t wc = btowc(c);
+	return wc != WEOF && iswctype(wc, type);
+}
+
+/* add the members of a character class like [:alpha:] */
+static bool set_class(Set *s, const char *name, bool utf8) {
+	wctype_t type = wctype(name);
+	if (!type)
+		return false;
+	unsigned max = utf8 ? FOLD_MAX : 0xFF;
+	for (unsigned c = 0; c <= max; c++) {
+		if (!class_member(type, c, utf8))
+			continue;
+		unsigned lo = c;
+		while (c < max && class_member(type, c + 1, utf8))
+			c++;
+		if (!set_add(s, lo, c))
+			return false;
+	}
+	return true;
+}
+
+static Node *node_new(Parser *p, int type, Node *left, Node *right) {
+	Node *n = calloc(1, sizeof *n);
+	if (!n) {
+		p->err = REG_ESPACE;
+		return NULL;
+	}
+	n->type = type;
+	n->left = left;
+	n->right = right;
+	n->all = p->nodes;
+	p->nodes = n;
+	return n;
+}
+
+static void nodes_free(Node *n) {
+	while (n) {
+		Node *all = n->all;
+		free(n->set.ranges);
+		free(n);
+		n = all;
+	}
+}
+
+/* decode a character of the pattern, invalid bytes are returned as negative values */
+static int pattern_char(Parser *p) {
+	const unsigned char *s = (const unsigned char*)p->s;
+	if (!p->utf8 || *s < 0x80) {
+		p->s++;
+		return *s;
+	}
+	mbstate_t ps = { 0 };
+	wchar_t wc;
+	size_t len = mbrtowc(&wc, p->s, strlen(p->s), &ps);
+	if (len == (size_t)-1 || len == (size_t)-2 || len == 0) {
+		p->s++;
+		return -(int)*s;
+	}
+	p->s += len;
+	return wc;
+}
+
+static Node *node_char(Parser *p, int c) {
+	Node *n = node_new(p, NODE_SET, NULL, NULL);
+	if (!n)
+		return NULL;
+	if (c < 0) {
+		set_byte(&n->set, -c);
+		return n;
+	}
+	if (!set_add(&n->set, c, c) || ((p->cflags & REG_ICASE) && !set_fold(&n->set, p->utf8)))
+		p->err = REG_ESPACE;
+	return n;
+}
+
+/* a set of all characters, except newline with REG_NEWLINE */
+static Node *node_any(Parser *p) {
+	Node *n = node_new(p, NODE_SET, NULL, NULL);
+	if (!n)
+		return NULL;
+	if ((p->cflags & REG_NEWLINE) && !set_add(&n->set, '\n', '\n'))
+		p->err = REG_ESPACE;
+	if (!set_negate(&n->set, p->utf8 ? 0x10FFFF : 0xFF))
+		p->err = REG_ESPACE;
+	return n;
+}
+
+static Node *node_class(Parser *p, const char *name, bool negate) {
+	Node *n = node_new(p, NODE_SET, NULL, NULL);
+	if (!n)
+		return NULL;
+	if (!set_class(&n->set, name, p->utf8) || (!strcmp(name, "alnum") && !set_add(&n->set, '_', '_')))
+		p->err = REG_ESPACE;
+	/* unlike non-matching lists, \W matches a newline even with REG_NEWLINE */
+	if (negate && !set_negate(&n->set, p->utf8 ? 0x10FFFF : 0xFF))
+		p->err = REG_ESPACE;
+	return n;
+}
+
+static Node *parse_bracket(Parser *p) {
+	Node *n = node_new(p, NODE_SET, NULL, NULL);
+	if (!n)
+		return NULL;
+	bool negate = *p->s == '^';
+	if (negate)
+		p->s++;
+	for (bool first = true; first || *p->s != ']'; first = false) {
+		if (!*p->s) {
+			p->err = REG_EBRACK;
+			return n;
+		}
+		int lo;
+		if (p->s[0] == '[' && (p->s[1] == ':' || p->s[1] == '.' || p->s[1] == '=')) {
+			char delim = p->s[1], name[16];
+			const char *start = p->s + 2, *end = strchr(start, delim);
+			if (!end || end[1] != ']') {
+				p->err = REG_EBRACK;
+				return n;
+			}
+			p->s = end + 2;
+			if (delim == ':') {
+				size_t len = end - start;
+				if (len >= sizeof name) {
+					p->err = REG_ECTYPE;
+					return n;
+				}
+				memcpy(name, start, len);
+				name[len] = '\0';
+				if (!set_class(&n->set, name, p->utf8)) {
+					p->err = REG_ECTYPE;
+					return n;
+				}
+				continue;
+			}
+			/* collating symbols and equivalence classes of a single character */
+			Parser q = *p;
+			q.s = start;
+			lo = pattern_char(&q);
+			if (q.s != end) {
+				p->err = REG_ECOLLATE;
+				return n;
+			}
+		} else {
+			lo = pattern_char(p);
+		}
+		int hi = lo;
+		if (p->s[0] == '-' && p->s[1] && p->s[1] != ']') {
+			p->s++;
+			hi = pattern_char(p);
+			if (hi < lo) {
+				p->err = REG_ERANGE;
+				return n;
+			}
+		}
+		if (lo < 0) {
+			if (hi >= 0) {
+				p->err = REG_ERANGE;
+				return n;
+			}
+			for (int b = -lo; b <= -hi; b++)
+				set_byte(&n->set, b);
+		} else if (!set_add(&n->set, lo, hi)) {
+			p->err = REG_ESPACE;
+			return n;
+		}
+	}
+	p->s++;
+	if ((p->cflags & REG_ICASE) && !set_fold(&n->set, p->utf8))
+		p->err = REG_ESPACE;
+	if (negate) {
+		if ((p->cflags & REG_NEWLINE) && !set_add(&n->set, '\n', '\n'))
+			p->err = REG_ESPACE;
+		if (!set_negate(&n->set, p->utf8 ? 0x10FFFF : 0xFF))
+			p->err = REG_ESPACE;
+	}
+	return n;
+}
+
+static Node *parse_alternation(Parser *p, int depth);
+
+static Node *parse_atom(Parser *p, int depth) {
+	Node *n;
+	switch (*p->s) {
+	case '(':
+		p->s++;
+		size_t index = ++p->nsub;
+		Node *sub = parse_alternation(p, depth + 1);
+		if (p->err)
+			return NULL;
+		if (*p->s != ')') {
+			p->err = REG_EPAREN;
+			return NULL;
+		}
+		p->s++;
+		if ((n = node_new(p, NODE_GROUP, sub, NULL)))
+			n->min = index;
+		return n;
+	case '[':
+		p->s++;
+		return parse_bracket(p);
+	case '.':
+		p->s++;
+		return node_any(p);
+	case '^':
+	case '$':
+		if ((n = node_new(p, NODE_ASSERT, NULL, NULL)))
+			n->min = *p->s == '^' ? ASSERT_BOL : ASSERT_EOL;
+		p->s++;
+		return n;
+	case '*':
+	case '+':
+	case '?':
+		p->err = REG_BADRPT;
+		return NULL;
+	case '\\':
+		p->s++;
+		char c = *p->s;
+		if (!c) {
+			p->err = REG_EESCAPE;
+			return NULL;
+		}
+		if (c >= '1' && c <= '9') {
+			/* back references can not be expressed by a finite automaton */
+			p->err = REG_ESUBREG;
+			return NULL;
+		}
+		const char *assertions = "<>bB`'";
+		const char *assertion = strchr(assertions, c);
+		if (assertion) {
+			static const int kinds[] = {
+				ASSERT_WORD_BEGIN, ASSERT_WORD_END, ASSERT_WORD,
+				ASSERT_NOT_WORD, ASSERT_BEGIN, ASSERT_END,
+			};
+			p->s++;
+			if ((n = node_new(p, NODE_ASSERT, NULL, NULL)))
+				n->min = kinds[assertion - assertions];
+			return n;
+		}
+		switch (c) {
+		case 'w':
+		case 'W':
+			p->s++;
+			return node_class(p, "alnum", c == 'W');
+		case 's':
+		case 'S':
+			p->s++;
+			return node_class(p, "space", c == 'S');
+		}
+		return node_char(p, pattern_char(p));
+	default:
+		return node_char(p, pattern_char(p));
+	}
+}
+
+static Node *parse_repetition(Parser *p, int depth) {
+	Node *n = parse_atom(p, depth);
+	while (n && !p->err) {
+		int min, max;
+		switch (*p->s) {
+		case '*':
+			min = 0;
+			max = -1;
+			break;
+		case '+':
+			min = 1;
+			max = -1;
+			break;
+		case '?':
+			min = 0;
+			max = 1;
+			break;
+		case '{':
+			if (!isdigit((unsigned char)p->s[1]) && p->s[1] != ',')
+				return n;
+			char *end;
+			/* a missing lower bound is zero */
+			min = max = strtol(p->s + 1, &end, 10);
+			if (*end == ',') {
+				max = -1;
+				if (isdigit((unsigned char)end[1]))
+					max = strtol(end + 1, &end, 10);
+				else
+					end++;
+			}
+			if (*end != '}' || min > RE_DUP_MAX || max > RE_DUP_MAX || (max != -1 && max < min)) {
+				p->err = REG_BADBR;
+				return NULL;
+			}
+			p->s = end;
+			break;
+		default:
+			return n;
+		}
+		p->s++;
+		if ((n = node_new(p, NODE_REPEAT, n, NULL))) {
+			n->min = min;
+			n->max = max;
+		}
+	}
+	return n;
+}
+
+static Node *parse_concatenation(Parser *p, int depth) {
+	Node *n = node_new(p, NODE_EMPTY, NULL, NULL);
+	while (n && !p->err && *p->s && *p->s != '|' && !(*p->s == ')' && depth > 0)) {
+		Node *right = parse_repetition(p, depth);
+		if (right)
+			n = n->type == NODE_EMPTY ? right : node_new(p, NODE_CAT, n, right);
+	}
+	return n;
+}
+
+static Node *parse_alternation(Parser *p, int depth) {
+	Node *n = parse_concatenation(p, depth);
+	while (n && !p->err && *p->s == '|') {
+		p->s++;
+		Node *right = parse_concatenation(p, depth);
+		if (right)
+			n = node_new(p, NODE_ALT, n, right);
+	}
+	if (!p->err && *p->s == ')' && depth == 0)
+		p->err = REG_EPAREN;
+	return p->err ? NULL : n;
+}
+
+static int emit(Prog *prog, int op, int lo, int hi, int x, int y) {
+	if (prog->len >= PROG_MAX)
+		return -1;
+	if (prog->len == prog->cap) {
+		int cap = prog->cap ? 2*prog->cap : 64;
+		Inst *inst = realloc(prog->inst, cap * sizeof *inst);
+		if (!inst)
+			return -1;
+		prog->inst = inst;
+		prog->cap = cap;
+	}
+	prog->inst[prog->len] = (Inst){ .op = op, .lo = lo, .hi = hi, .x = x, .y = y };
+	return prog->len++;
+}
+
+/* emit a sequence of byte ranges, followed by a jump to be patched */
+static bool emit_sequence(Prog *prog, int n, const unsigned char lo[], const unsigned char hi[], bool reverse, bool last, int *jumps, int *njumps) {
+	int split = -1;
+	if (!last && (split = emit(prog, OP_SPLIT, 0, 0, prog->len + 1, -1)) == -1)
+		return false;
+	for (int i = 0; i < n; i++) {
+		int j = reverse ? n - 1 - i : i;
+		if (emit(prog, OP_BYTE, lo[j], hi[j], 0, 0) == -1)
+			return false;
+	}
+	if (!last) {
+		int jmp = emit(prog, OP_JMP, 0, 0, -1, 0);
+		if (jmp == -1)
+			return false;
+		jumps[(*njumps)++] = jmp;
+		prog->inst[split].y = prog->len;
+	}
+	return true;
+}
+
+static int utf8_encode(unsigned c, unsigned char buf[4]) {
+	if (c < 0x80) {
+		buf[0] = c;
+		return 1;
+	} else if (c < 0x800) {
+		buf[0] = 0xC0 | (c >> 6);
+		buf[1] = 0x80 | (c & 0x3F);
+		return 2;
+	} else if (c < 0x10000) {
+		buf[0] = 0xE0 | (c >> 12);
+		buf[1] = 0x80 | ((c >> 6) & 0x3F);
+		buf[2] = 0x80 | (c & 0x3F);
+		return 3;
+	}
+	buf[0] = 0xF0 | (c >> 18);
+	buf[1] = 0x80 | ((c >> 12) & 0x3F);
+	buf[2] = 0x80 | ((c >> 6) & 0x3F);
+	buf[3] = 0x80 | (c & 0x3F);
+	return 4;
+}
+
+typedef struct {
+	int n;
+	unsigned char lo[4], hi[4];
+} Sequence;
+
+typedef struct {
+	Sequence *seq;
+	size_t len, cap;
+} Sequences;
+
+static bool sequence_add(Sequences *s, int n, const unsigned char lo[], const unsigned char hi[]) {
+	if (s->len == s->cap) {
+		size_t cap = s->cap ? 2*s->cap : 16;
+		Sequence *seq = realloc(s->seq, cap * sizeof *seq);
+		if (!seq)
+			return false;
+		s->seq = seq;
+		s->cap = cap;
+	}
+	Sequence *seq = &s->seq[s->len++];
+	seq->n = n;
+	memcpy(seq->lo, lo, n);
+	memcpy(seq->hi, hi, n);
+	return true;
+}
+
+/* split a range of code points into ranges of UTF-8 byte sequences */
+static bool utf8_sequences(Sequences *s, unsigned lo, unsigned hi) {
+	static const unsigned max[] = { 0x7F, 0x7FF, 0xFFFF };
+	if (lo > hi)
+		return true;
+	if (lo <= 0xDFFF && hi >= 0xD800) {
+		/* surrogates are not valid in UTF-8 */
+		return (lo >= 0xD800 || utf8_sequences(s, lo, 0xD7FF)) &&
+		       (hi <= 0xDFFF || utf8_sequences(s, 0xE000, hi));
+	}
+	for (int i = 0; i < 3; i++) {
+		if (lo <= max[i] && hi > max[i])
+			return utf8_sequences(s, lo, max[i]) && utf8_sequences(s, max[i] + 1, hi);
+	}
+	for (int i = 1; i < 4 && hi >= 0x80; i++) {
+		unsigned m = (1u << (6*i)) - 1;
+		if ((lo & ~m) != (hi & ~m)) {
+			if (lo & m)
+				return utf8_sequences(s, lo, lo | m) && utf8_sequences(s, (lo | m) + 1, hi);
+			if ((hi & m) != m)
+				return utf8_sequences(s, lo, (hi & ~m) - 1) && utf8_sequences(s, hi & ~m, hi);
+		}
+	}
+	unsigned char a[4], b[4];
+	int n = utf8_encode(lo, a);
+	utf8_encode(hi, b);
+	return sequence_add(s, n, a, b);
+}
+
+static bool emit_set(Prog *prog, Set *set, bool utf8, bool reverse) {
+	Sequences seqs = { 0 };
+	bool ok = true;
+	set_normalize(set);
+	for (size_t i = 0; ok && i < set->len; i++) {
+		unsigned lo = set->ranges[i].lo, hi = set->ranges[i].hi;
+		if (utf8) {
+			ok = utf8_sequences(&seqs, lo, MIN(hi, 0x10FFFF));
+		} else if (lo <= 0xFF) {
+			unsigned char l = lo, h = MIN(hi, 0xFF);
+			ok = sequence_add(&seqs, 1, &l, &h);
+		}
+	}
+	/* raw bytes which never start a valid UTF-8 sequence, continuation bytes
+	 * are excluded to avoid matches starting within a character */
+	for (int b = 0xC0; ok && b <= 0xFF; b++) {
+		if (!utf8 || !set_has_byte(set, b) || (b >= 0xC2 && b <= 0xF4))
+			continue;
+		unsigned char l = b, h = b;
+		while (h < 0xFF && set_has_byte(set, h + 1) && h + 1 > 0xF4)
+			h++;
+		ok = sequence_add(&seqs, 1, &l, &h);
+		b = h;
+	}
+	if (ok && !seqs.len) {
+		/* empty set, never matches */
+		ok = emit(prog, OP_BYTE, 1, 0, 0, 0) != -1;
+	}
+	int *jumps = ok ? malloc(seqs.len * sizeof *jumps) : NULL, njumps = 0;
+	ok = ok && (jumps || !seqs.len);
+	for (size_t i = 0; ok && i < seqs.len; i++) {
+		Sequence *seq = &seqs.seq[i];
+		ok = emit_sequence(prog, seq->n, seq->lo, seq->hi, reverse, i + 1 == seqs.len, jumps, &njumps);
+	}
+	for (int i = 0; ok && i < njumps; i++)
+		prog->inst[jumps[i]].x = prog->len;
+	free(jumps);
+	free(seqs.seq);
+	return ok;
+}
+
+static bool compile(Prog *prog, Node *n, bool utf8, bool reverse) {
+	int split, jmp, loop;
+	switch (n->type) {
+	case NODE_EMPTY:
+		return true;
+	case NODE_SET:
+		return emit_set(prog, &n->set, utf8, reverse);
+	case NODE_CAT:
+		if (reverse)
+			return compile(prog, n->right, utf8, reverse) && compile(prog, n->left, utf8, reverse);
+		return compile(prog, n->left, utf8, reverse) && compile(prog, n->right, utf8, reverse);
+	case NODE_ALT:
+		if ((split = emit(prog, OP_SPLIT, 0, 0, prog->len + 1, -1)) == -1 ||
+		    !compile(prog, n->left, utf8, reverse) ||
+		    (jmp = emit(prog, OP_JMP, 0, 0, -1, 0)) == -1)
+			return false;
+		prog->inst[split].y = prog->len;
+		if (!compile(prog, n->right, utf8, reverse))
+			return false;
+		prog->inst[jmp].x = prog->len;
+		return true;
+	case NODE_GROUP:
+		if (reverse)
+			return compile(prog, n->left, utf8, reverse);
+		return emit(prog, OP_SAVE, 0, 0, 2*n->min, 0) != -1 &&
+		       compile(prog, n->left, utf8, reverse) &&
+		       emit(prog, OP_SAVE, 0, 0, 2*n->min + 1, 0) != -1;
+	case NODE_ASSERT:
+		return emit(prog, OP_ASSERT, n->min, 0, 0, 0) != -1;
+	case NODE_REPEAT:
+		for (int i = 0; i < n->min; i++) {
+			if (!compile(prog, n->left, utf8, reverse))
+				return false;
+		}
+		if (n->max == -1) {
+			if ((loop = split = emit(prog, OP_SPLIT, 0, 0, prog->len + 1, -1)) == -1 ||
+			    !compile(prog, n->left, utf8, reverse) ||
+			    emit(prog, OP_JMP, 0, 0, loop, 0) == -1)
+				return false;
+			prog->inst[split].y = prog->len;
+			return true;
+		}
+		int first = prog->len;
+		for (int i = n->min; i < n->max; i++) {
+			if (emit(prog, OP_SPLIT, 0, 0, prog->len + 1, -1) == -1 ||
+			    !compile(prog, n->left, utf8, reverse))
+				return false;
+		}
+		for (int pc = first; pc < prog->len; pc++) {
+			if (prog->inst[pc].op == OP_SPLIT && prog->inst[pc].y == -1)
+				prog->inst[pc].y = prog->len;
+		}
+		return true;
+	}
+	return false;
+}
+
+static void dfa_flush(Dfa *d) {
+	for (int i = 0; i < d->nstates; i++) {
+		free(d->states[i].insts);
+	}
+	d->nstates = 0;
+	d->mem = 0;
+	d->generation++;
+	for (int i = 0; i < d->nbuckets; i++)
+		d->buckets[i] = -1;
+}
+
+static void dfa_free(Dfa *d) {
+	dfa_flush(d);
+	free(d->states);
+	free(d->table);
+	free(d->buckets);
+	free(d->stack);
+	free(d->buf);
+	free(d->sparse);
+	free(d->dense);
+}
+
+static bool dfa_init(Dfa *d, Regex *r, Prog *prog, bool reverse, bool anchored) {
+	int n = prog->len;
+	d->regex = r;
+	d->prog = prog;
+	d->reverse = reverse;
+	d->anchored = anchored;
+	d->nbuckets = 64;
+	d->buckets = malloc(d->nbuckets * sizeof *d->buckets);
+	/* every instruction appears at most once per state, plus group separators */
+	d->stack = malloc(2 * (n + 1) * sizeof *d->stack);
+	d->buf = malloc(4 * (n + 1) * sizeof *d->buf);
+	d->sparse = calloc(n + 1, sizeof *d->sparse);
+	d->dense = calloc(n + 1, sizeof *d->dense);
+	if (!d->buckets || !d->stack || !d->buf || !d->sparse || !d->dense)
+		return false;
+	dfa_flush(d);
+	return true;
+}
+
+static bool sparse_add(Dfa *d, int pc) {
+	int i = d->sparse[pc];
+	if (i >= 0 && i < d->ndense && d->dense[i] == pc)
+		return false;
+	d->sparse[pc] = d->ndense;
+	d->dense[d->ndense++] = pc;
+	return true;
+}
+
+static bool word(int ctx) {
+	return ctx == CTX_WORD;
+}
+
+static bool assertion(int kind, int before, int after) {
+	switch (kind) {
+	case ASSERT_BOL:
+		return before == CTX_BEGIN || before == CTX_NEWLINE;
+	case ASSERT_EOL:
+		return after == CTX_END || after == CTX_NEWLINE;
+	case ASSERT_BEGIN:
+		return before == CTX_BEGIN || before == CTX_BEGIN_NOTBOL;
+	case ASSERT_END:
+		return after == CTX_END || after == CTX_END_NOTEOL;
+	case ASSERT_WORD_BEGIN:
+		return !word(before) && word(after);
+	case ASSERT_WORD_END:
+		return word(before) && !word(after);
+	case ASSERT_WORD:
+		return word(before) != word(after);
+	case ASSERT_NOT_WORD:
+		return word(before) == word(after);
+	}
+	return false;
+}
+
+static int byte_context(const Regex *r, unsigned char c) {
+	if (c == '\n' && (r->cflags & REG_NEWLINE))
+		return CTX_NEWLINE;
+	if (isalnum(c) || c == '_' || c >= 0x80)
+		return CTX_WORD;
+	return CTX_OTHER;
+}
+
+/* Follow all empty transitions from pc, appending the reached instructions to
+ * out. Assertions are evaluated if resolve is set, otherwise kept as is. */
+static void closure(Dfa *d, int pc, bool resolve, int before, int after, int *out, int *len) {
+	const Inst *inst = d->prog->inst;
+	int top = 0;
+	d->stack[top++] = pc;
+	while (top > 0) {
+		pc = d->stack[--top];
+		if (!sparse_add(d, pc))
+			continue;
+		switch (inst[pc].op) {
+		case OP_JMP:
+			d->stack[top++] = inst[pc].x;
+			break;
+		case OP_SPLIT:
+			d->stack[top++] = inst[pc].y;
+			d->stack[top++] = inst[pc].x;
+			break;
+		case OP_SAVE:
+			d->stack[top++] = pc + 1;
+			break;
+		case OP_ASSERT:
+			if (!resolve)
+				out[(*len)++] = pc;
+			else if (assertion(inst[pc].lo, before, after))
+				d->stack[top++] = pc + 1;
+			break;
+		default:
+			out[(*len)++] = pc;
+			break;
+		}
+	}
+}
+
+static unsigned dfa_hash(int ctx, bool matched, const int *insts, int len) {
+	unsigned h = 2166136261u ^ (ctx << 1) ^ matched;
+	for (int i = 0; i < len; i++)
+		h = (h ^ (unsigned)insts[i]) * 16777619u;
+	return h;
+}
+
+/* look up or create the state with the given instructions */
+static int dfa_state(Dfa *d, int ctx, bool matched, const int *insts, int len) {
+	unsigned hash = dfa_hash(ctx, matched, insts, len);
+	for (int i = d->buckets[hash & (d->nbuckets - 1)]; i != -1; i = d->states[i].chain) {
+		DState *s = &d->states[i];
+		if (s->hash == hash && s->ctx == ctx && s->matched == matched && s->len == len &&
+		    !memcmp(s->insts, insts, len * sizeof *insts))
+			return i;
+	}
+	int nclasses = d->regex->nclasses;
+	size_t size = sizeof(DState) + (len + nclasses) * sizeof(int);
+	if (d->mem + size > DFA_CACHE_SIZE || d->nocache) {
+		if (++d->flushes > DFA_FLUSH_MAX)
+			d->nocache = true;
+		dfa_flush(d);
+	}
+	if (d->nstates == d->cap) {
+		int cap = d->cap ? 2*d->cap : 64;
+		DState *states = realloc(d->states, cap * sizeof *states);
+		if (!states)
+			return -1;
+		d->states = states;
+		int *table = realloc(d->table, cap * nclasses * sizeof *table);
+		if (!table)
+			return -1;
+		d->table = table;
+		d->cap = cap;
+	}
+	if (d->nstates >= d->nbuckets) {
+		int *buckets = realloc(d->buckets, 2 * d->nbuckets * sizeof *buckets);
+		if (!buckets)
+			return -1;
+		d->buckets = buckets;
+		d->nbuckets *= 2;
+		for (int i = 0; i < d->nbuckets; i++)
+			d->buckets[i] = -1;
+		for (int i = 0; i < d->nstates; i++) {
+			int b = d->states[i].hash & (d->nbuckets - 1);
+			d->states[i].chain = d->buckets[b];
+			d->buckets[b] = i;
+		}
+	}
+	DState *s = &d->states[d->nstates];
+	s->insts = malloc(len * sizeof *insts + 1);
+	if (!s->insts)
+		return -1;
+	memcpy(s->insts, insts, len * sizeof *insts);
+	for (int i = 0; i < nclasses; i++)
+		d->table[d->nstates * nclasses + i] = -1;
+	s->ctx = ctx;
+	s->matched = matched;
+	s->len = len;
+	s->hash = hash;
+	s->chain = d->buckets[hash & (d->nbuckets - 1)];
+	d->buckets[hash & (d->nbuckets - 1)] = d->nstates;
+	d->mem += size;
+	return d->nstates++;
+}
+
+static int dfa_start(Dfa *d, int ctx) {
+	int len = 0;
+	d->ndense = 0;
+	closure(d, 0, false, 0, 0, d->buf, &len);
+	return dfa_state(d, ctx, false, d->buf, len);
+}
+
+/* Evaluate pending assertions of state s given the context on the other side.
+ * Resolved groups are stored in d->buf, returns the index of the first group
+ * containing a match or -1. The resolved instructions end at *len. */
+static int dfa_resolve(Dfa *d, int s, int ctx, int *len) {
+	const DState *state = &d->states[s];
+	int before = d->reverse ? ctx : state->ctx;
+	int after = d->reverse ? state->ctx : ctx;
+	int group = 0, match = -1;
+	*len = 0;
+	d->ndense = 0;
+	for (int i = 0; i < state->len && match == -1; i++) {
+		int start = *len;
+		for (; i < state->len && state->insts[i] != -1; i++)
+			closure(d, state->insts[i], true, before, after, d->buf, len);
+		for (int j = start; j < *len; j++) {
+			if (d->prog->inst[d->buf[j]].op == OP_MATCH)
+				match = group;
+		}
+		if (*len > start) {
+			d->buf[(*len)++] = -1;
+			group++;
+		}
+	}
+	return match;
+}
+
+/* compute the transition of state s on a byte of class cls */
+static int dfa_transition(Dfa *d, int s, int cls) {
+	Regex *r = d->regex;
+	unsigned char c = r->sample[cls];
+	int ctx = byte_context(r, c), len, flushes = d->flushes;
+	bool match = dfa_resolve(d, s, ctx, &len) != -1;
+	bool matched = match || d->states[s].matched;
+	int *resolved = d->buf, *next = d->buf + len, n = 0;
+	d->ndense = 0;
+	for (int i = 0; i < len; i++) {
+		int start = n;
+		for (; resolved[i] != -1; i++) {
+			const Inst *inst = &d->prog->inst[resolved[i]];
+			if (inst->op == OP_BYTE && inst->lo <= c && c <= inst->hi)
+				closure(d, resolved[i] + 1, false, 0, 0, next, &n);
+		}
+		if (n > start)
+			next[n++] = -1;
+	}
+	if (!d->anchored && !matched) {
+		int start = n;
+		closure(d, 0, false, 0, 0, next, &n);
+		if (n > start)
+			next[n++] = -1;
+	}
+	if (n > 0)
+		n--; /* drop trailing separator */
+	int t = dfa_state(d, ctx, matched, next, n);
+	if (t == -1)
+		return -1;
+	t = (t * r->nclasses) << TRANS_SHIFT | (match ? TRANS_MATCH : 0) |
+	    (n ? 0 : TRANS_DEAD) | (matched ? TRANS_MATCHED : 0);
+	/* s is gone if the cache was flushed in the meantime */
+	if (d->flushes == flushes)
+		d->table[s * r->nclasses + cls] = t;
+	return t;
+}
+
+/* whether state s matches at the boundary of the input with context ctx */
+static bool dfa_final(Dfa *d, int s, int ctx) {
+	int len;
+	return dfa_resolve(d, s, ctx, &len) != -1;
+}
+
+typedef struct {
+	Dfa *dfa;
+	int state;
+	size_t pos;   /* position of the next byte */
+	size_t match; /* position of the last match, EPOS if none */
+	bool first;   /* whether to stop at the first match */
+	bool done;
+	Memo *memo;   /* states of earlier scans with the same end, or NULL */
+	size_t start;
+	unsigned run;
+} Scan;
+
+static bool scan_init(Scan *scan, Dfa *d, size_t pos, int ctx, bool first) {
+	d->flushes = 0;
+	d->nocache = false;
+	scan->dfa = d;
+	scan->pos = pos;
+	scan->match = EPOS;
+	scan->first = first;
+	scan->done = false;
+	scan->memo = NULL;
+	scan->start = pos;
+	scan->state = dfa_start(d, ctx);
+	return scan->state != -1;
+}
+
+/* Look up the state reached at pos by an earlier scan. If it is the same,
+ * both continue identically and the scan can stop. Returns true in that case,
+ * otherwise remembers the state for later scans. */
+static bool scan_memo(Scan *scan, size_t pos, int row) {
+	Memo *m = scan->memo;
+	Dfa *d = scan->dfa;
+	if (m->generation != d->generation) {
+		m->generation = d->generation;
+		m->epoch++;
+	}
+	MemoEntry *e = &m->entries[pos % MEMO_SIZE];
+	if (e->epoch == m->epoch && e->pos == pos && e->row == row) {
+		size_t match = m->runs[e->run];
+		if (match != EPOS && match >= pos)
+			scan->match = match;
+		return true;
+	}
+	/* entries before the start of the scan will not be encountered again */
+	if (e->epoch != m->epoch || e->pos < scan->start)
+		*e = (MemoEntry){ .pos = pos, .row = row, .epoch = m->epoch, .run = scan->run };
+	return false;
+}
+
+/* feed the next chunk of input, backward scans consume data from its end */
+static bool scan_feed(Scan *scan, const char *data, size_t len) {
+	Dfa *d = scan->dfa;
+	const unsigned char *classes = d->regex->classes;
+	const unsigned char *p = (const unsigned char*)data;
+	const int *table = d->table;
+	int nclasses = d->regex->nclasses, step = d->reverse ? -1 : 1;
+	int flags = TRANS_MATCH|TRANS_DEAD|(scan->memo ? TRANS_MATCHED : 0);
+	int s = scan->state * nclasses; /* row of the current state */
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = d->reverse ? p[len - 1 - i] : p[i];
+		int cls = classes[c];
+		int t = table[s + cls];
+		if (t == -1) {
+			if ((t = dfa_transition(d, s / nclasses, cls)) == -1)
+				goto done;
+			table = d->table;
+		}
+		s = t >> TRANS_SHIFT;
+		if (t & flags) {
+			if (t & TRANS_MATCH)
+				scan->match = scan->pos + i * step;
+			if ((t & TRANS_DEAD) || ((t & TRANS_MATCH) && scan->first) ||
+			    ((flags & t & TRANS_MATCHED) && scan_memo(scan, scan->pos + (i + 1) * step, s))) {
+				scan->pos += (i + 1) * step;
+				goto done;
+			}
+		}
+	}
+	scan->pos += len * step;
+	scan->state = s / nclasses;
+	return true;
+done:
+	scan->done = true;
+	return false;
+}
+
+static void scan_finish(Scan *scan, int ctx) {
+	if (!scan->done && dfa_final(scan->dfa, scan->state, ctx))
+		scan->match = scan->pos;
+}
+
+static int context_before(Text *txt, Regex *r, size_t pos, size_t start, int eflags) {
+	char c;
+	if (pos == start)
+		return (eflags & REG_NOTBOL) ? CTX_BEGIN_NOTBOL : CTX_BEGIN;
+	return text_byte_get(txt, pos - 1, &c) ? byte_context(r, c) : CTX_OTHER;
+}
+
+static int context_after(Text *txt, Regex *r, size_t pos, size_t end, int eflags) {
+	char c;
+	if (pos == end)
+		return (eflags & REG_NOTEOL) ? CTX_END_NOTEOL : CTX_END;
+	return text_byte_get(txt, pos, &c) ? byte_context(r, c) : CTX_OTHER;
+}
+
+/* end of the leftmost-longest match in [pos, end), or EPOS */
+static size_t match_end(Text *txt, Regex *r, size_t pos, size_t end, int eflags, Memo *memo) {
+	Scan scan;
+	if (!scan_init(&scan, &r->dfa, pos, context_before(txt, r, pos, pos, eflags), false))
+		return EPOS;
+	if (memo) {
+		if (memo->nruns == MEMO_RUNS) {
+			memo->nruns = 0;
+			memo->epoch++;
+		}
+		scan.memo = memo;
+		scan.run = memo->nruns++;
+	}
+	TextChunk c;
+	for (bool ok = text_chunk_init(txt, &c, pos, end - pos); ok; ok = text_chunk_next(&c)) {
+		if (!scan_feed(&scan, c.data, c.len))
+			break;
+	}
+	scan_finish(&scan, context_after(txt, r, end, end, eflags));
+	if (memo)
+		memo->runs[scan.run] = scan.match;
+	return scan.match;
+}
+
+/* start of the leftmost match ending at end, not before start */
+static size_t match_start(Text *txt, Regex *r, size_t start, size_t end, size_t range_end, int eflags) {
+	Scan scan;
+	if (!scan_init(&scan, &r->rdfa, end, context_after(txt, r, end, range_end, eflags), false))
+		return EPOS;
+	Iterator it = text_iterator_get(txt, end);
+	while (scan.pos > start && !scan.done) {
+		size_t len = MIN((size_t)(it.text - it.start), scan.pos - start);
+		if (len > 0) {
+			it.text -= len;
+			it.pos -= len;
+			if (!scan_feed(&scan, it.text, len))
+				break;
+		} else if (!text_iterator_prev(&it)) {
+			break;
+		}
+	}
+	if (scan.pos == start)
+		scan_finish(&scan, context_before(txt, r, start, start, eflags));
+	return scan.match;
+}
+
+typedef struct {
+	int pc;
+	size_t *cap;
+} Thread;
+
+typedef struct {
+	Thread *threads;
+	size_t *caps;
+	int len;
+} ThreadList;
+
+typedef struct {
+	Regex *regex;
+	Dfa *dfa; /* provides the sparse set */
+	int ncap;
+	int before, after;
+} Pike;
+
+static void thread_add(Pike *vm, ThreadList *list, int pc, size_t *cap, size_t pos, bool resolve) {
+	Dfa *d = vm->dfa;
+	const Inst *inst = &vm->regex->forward.inst[pc];
+	if (!sparse_add(d, pc))
+		return;
+	switch (inst->op) {
+	case OP_JMP:
+		thread_add(vm, list, inst->x, cap, pos, resolve);
+		break;
+	case OP_SPLIT:
+		thread_add(vm, list, inst->x, cap, pos, resolve);
+		thread_add(vm, list, inst->y, cap, pos, resolve);
+		break;
+	case OP_SAVE:
+		if (inst->x < vm->ncap) {
+			size_t old = cap[inst->x];
+			cap[inst->x] = pos;
+			thread_add(vm, list, pc + 1, cap, pos, resolve);
+			cap[inst->x] = old;
+		} else {
+			thread_add(vm, list, pc + 1, cap, pos, resolve);
+		}
+		break;
+	case OP_ASSERT:
+		if (resolve) {
+			if (assertion(inst->lo, vm->before, vm->after))
+				thread_add(vm, list, pc + 1, cap, pos, resolve);
+			break;
+		}
+		/* fall through */
+	default: {
+		Thread *t = &list->threads[list->len];
+		t->pc = pc;
+		t->cap = list->caps + list->len * vm->ncap;
+		memcpy(t->cap, cap, vm->ncap * sizeof *cap);
+		list->len++;
+		break;
+	}
+	}
+}
+
+/* determine submatches of the match [start, end) by simulating the NFA, the
+ * thread with the highest priority ending there wins */
+static void match_groups(Text *txt, Regex *r, size_t pos, size_t start, size_t end, size_t range_end, int eflags, size_t nmatch, RegexMatch pmatch[]) {
+	int n = r->forward.len;
+	Pike vm = { .regex = r, .dfa = &r->dfa, .ncap = 2*MIN(nmatch, r->nsub + 1) };
+	ThreadList lists[3];
+	size_t *cap = malloc(vm.ncap * sizeof *cap);
+	bool ok = cap != NULL;
+	for (int i = 0; i < 3; i++) {
+		lists[i].threads = malloc(n * sizeof(Thread));
+		lists[i].caps = malloc(n * vm.ncap * sizeof(size_t));
+		lists[i].len = 0;
+		ok = ok && lists[i].threads && lists[i].caps;
+	}
+	for (size_t i = 1; i < nmatch; i++)
+		pmatch[i].start = pmatch[i].end = EPOS;
+	if (!ok)
+		goto out;
+	for (int i = 0; i < vm.ncap; i++)
+		cap[i] = EPOS;
+
+	ThreadList *clist = &lists[0], *rlist = &lists[1], *nlist = &lists[2];
+	vm.dfa->ndense = 0;
+	thread_add(&vm, clist, 0, cap, start, false);
+	Iterator it = text_iterator_get(txt, start);
+	for (size_t p = start;; p++) {
+		char c = 0;
+		vm.before = context_before(txt, r, p, pos, eflags);
+		vm.after = context_after(txt, r, p, range_end, eflags);
+		rlist->len = 0;
+		vm.dfa->ndense = 0;
+		for (int i = 0; i < clist->len; i++)
+			thread_add(&vm, rlist, clist->threads[i].pc, clist->threads[i].cap, p, true);
+		if (p == end) {
+			for (int i = 0; i < rlist->len; i++) {
+				Thread *t = &rlist->threads[i];
+				if (r->forward.inst[t->pc].op != OP_MATCH)
+					continue;
+				for (size_t j = 1; 2*j + 1 < (size_t)vm.ncap; j++) {
+					if (t->cap[2*j] != EPOS && t->cap[2*j+1] != EPOS) {
+						pmatch[j].start = t->cap[2*j];
+						pmatch[j].end = t->cap[2*j+1];
+					}
+				}
+				break;
+			}
+			break;
+		}
+		text_iterator_byte_get(&it, &c);
+		text_iterator_byte_next(&it, NULL);
+		unsigned char b = c;
+		nlist->len = 0;
+		vm.dfa->ndense = 0;
+		for (int i = 0; i < rlist->len; i++) {
+			Thread *t = &rlist->threads[i];
+			const Inst *inst = &r->forward.inst[t->pc];
+			if (inst->op == OP_BYTE && inst->lo <= b && b <= inst->hi)
+				thread_add(&vm, nlist, t->pc + 1, t->cap, p + 1, false);
+		}
+		ThreadList *tmp = clist;
+		clist = nlist;
+		nlist = tmp;
+	}
+out:
+	free(cap);
+	for (int i = 0; i < 3; i++) {
+		free(lists[i].threads);
+		free(lists[i].caps);
+	}
+}
+
+/* find the leftmost-longest match in [pos, pos+len) */
+static int search_match(Text *txt, Regex *r, size_t pos, size_t len, Filerange *match, int eflags, Memo *memo) {
+	if (!r->forward.len || !len)
+		return REG_NOMATCH;
+	size_t end = pos + len;
+	size_t match_stop = match_end(txt, r, pos, end, eflags, memo);
+	if (match_stop == EPOS)
+		return REG_NOMATCH;
+	size_t match_begin = match_start(txt, r, pos, match_stop, end, eflags);
+	if (match_begin == EPOS)
+		return REG_NOMATCH;
+	*match = text_range_new(match_begin, match_stop);
+	return 0;
+}
+
+static int search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	Filerange match;
+	int ret = search_match(txt, r, pos, len, &match, eflags, NULL);
+	if (ret || !nmatch)
+		return ret;
+	pmatch[0] = match;
+	if (nmatch > 1)
+		match_groups(txt, r, pos, match.start, match.end, pos + len, eflags, MIN(nmatch, MAX_REGEX_SUB), pmatch);
+	return 0;
+}
+
+/* Start of the line aligned search window ending at end, not before start */
+static size_t search_window_start(Text *txt, size_t start, size_t end) {
+	if (end - start <= SEARCH_WINDOW_SIZE)
+		return start;
+	size_t pos = end - SEARCH_WINDOW_SIZE;
+	size_t begin = text_line_begin(txt, pos);
+	if (begin < pos) {
+		size_t next = text_line_next(txt, pos);
+		if (next < end)
+			begin = next;
+	}
+	return MAX(begin, start);
+}
+
+/* Last match in [pos, end) found by repeatedly matching forward. Finding
+ * the end of a match might require looking far ahead, which the following
+ * search would repeat. Instead the DFA states of earlier scans are memoized,
+ * a scan stops once it reaches the same state at the same position. */
+static int search_last(Text *txt, Regex *r, size_t pos, size_t end, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	Filerange match, last;
+	size_t last_pos = pos;
+	int last_flags = eflags, ret = REG_NOMATCH;
+	Memo *memo = &r->memo;
+	if (!memo->entries) {
+		memo->entries = calloc(MEMO_SIZE, sizeof *memo->entries);
+		memo->runs = malloc(MEMO_RUNS * sizeof *memo->runs);
+	}
+	if (!memo->entries || !memo->runs) {
+		memo = NULL;
+	} else {
+		memo->epoch++;
+		memo->nruns = 0;
+	}
+	for (size_t cur = pos; cur < end;) {
+		if (search_match(txt, r, cur, end - cur, &match, eflags, memo))
+			break;
+		ret = 0;
+		last = match;
+		last_pos = cur;
+		last_flags = eflags;
+		size_t next = match.end;
+		if (match.start == cur && match.end == cur) {
+			/* empty match at the beginning, advance to next line */
+			next = text_line_next(txt, cur);
+			if (next == cur || next > end)
+				break;
+		}
+		cur = next;
+		char c;
+		if (text_byte_get(txt, cur - 1, &c) && c == '\n')
+			eflags &= ~REG_NOTBOL;
+		else
+			eflags |= REG_NOTBOL;
+	}
+	if (!ret && nmatch > 0) {
+		pmatch[0] = last;
+		if (nmatch > 1)
+			match_groups(txt, r, last_pos, last.start, last.end, end, last_flags, MIN(nmatch, MAX_REGEX_SUB), pmatch);
+	}
+	return ret;
+}
+
+static int search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	size_t end = pos + len;
+	/* windows are searched from the end, the last match of the first
+	 * window containing one is the last match of the range */
+	for (size_t stop = end, start; stop > pos; stop = start) {
+		start = r->multiline ? pos : search_window_start(txt, pos, stop);
+		int flags = eflags;
+		if (start != pos)
+			flags &= ~REG_NOTBOL;
+		if (stop != end)
+			flags |= REG_NOTEOL;
+		if (!search_last(txt, r, start, stop, nmatch, pmatch, flags))
+			return 0;
+	}
+	return REG_NOMATCH;
+}
+
+/* partition bytes into classes which behave identically */
+static void byte_classes(Regex *r) {
+	bool boundary[257] = { false };
+	Prog *progs[] = { &r->forward, &r->backward };
+	for (size_t i = 0; i < LENGTH(progs); i++) {
+		for (int pc = 0; pc < progs[i]->len; pc++) {
+			const Inst *inst = &progs[i]->inst[pc];
+			if (inst->op == OP_BYTE && inst->lo <= inst->hi) {
+				boundary[inst->lo] = true;
+				boundary[inst->hi + 1] = true;
+			}
+		}
+	}
+	for (int c = 1; c < 256; c++) {
+		if (byte_context(r, c) != byte_context(r, c - 1))
+			boundary[c] = true;
+	}
+	int cls = 0;
+	for (int c = 0; c < 256; c++) {
+		if (c > 0 && boundary[c])
+			cls++;
+		if (c == 0 || boundary[c])
+			r->sample[cls] = c;
+		r->classes[c] = cls;
+	}
+	r->nclasses = cls + 1;
+}
+
+static void regex_reset(Regex *r) {
+	int refcount = r->refcount;
+	dfa_free(&r->dfa);
+	dfa_free(&r->rdfa);
+	free(r->memo.entries);
+	free(r->memo.runs);
+	free(r->forward.inst);
+	free(r->backward.inst);
+	memset(r, 0, sizeof *r);
+	r->refcount = refcount;
+}
+
+Regex *text_regex_new(void) {
+	/* without a program nothing is matched */
+	Regex *r = calloc(1, sizeof(Regex));
+	if (r)
+		r->refcount = 1;
+	return r;
+}
+
+int text_regex_compile(Regex *regex, const char *string, int cflags) {
+	regex_reset(regex);
+	Parser p = {
+		.s = string,
+		.cflags = cflags,
+		.utf8 = MB_CUR_MAX > 1,
+	};
+	Node *n = parse_alternation(&p, 0);
+	int err = p.err;
+	regex->cflags = cflags;
+	regex->nsub = p.nsub;
+	if (!err) {
+		bool ok = true;
+		for (int i = 0; i < 2 && ok; i++) {
+			Prog *prog = i ? &regex->backward : &regex->forward;
+			ok = (i || emit(prog, OP_SAVE, 0, 0, 0, 0) != -1) &&
+			     compile(prog, n, p.utf8, i) &&
+			     (i || emit(prog, OP_SAVE, 0, 0, 1, 0) != -1) &&
+			     emit(prog, OP_MATCH, 0, 0, 0, 0) != -1;
+		}
+		if (ok) {
+			byte_classes(regex);
+			ok = dfa_init(&regex->dfa, regex, &regex->forward, false, false) &&
+			     dfa_init(&regex->rdfa, regex, &regex->backward, true, true);
+		}
+		if (!ok)
+			err = REG_ESPACE;
+	}
+	nodes_free(p.nodes);
+	if (err) {
+		regex_reset(regex);
+		return err;
+	}
+	regex->multiline = text_regex_multiline(string, cflags);
+	text_regex_literal(&regex->literal, string, cflags);
+	return 0;
+}
+
+size_t text_regex_nsub(Regex *r) {
+	if (!r)
+		return 0;
+	return r->nsub;
+}
+
+Regex *text_regex_ref(Regex *r) {
+	if (r)
+		r->refcount++;
+	return r;
+}
+
+void text_regex_free(Regex *r) {
+	if (!r || --r->refcount > 0)
+		return;
+	regex_reset(r);
+	free(r);
+}
+
+int text_regex_match(Regex *r, const char *data, int eflags) {
+	if (!r->forward.len)
+		return REG_NOMATCH;
+	Scan scan;
+	size_t len = strlen(data);
+	int begin = (eflags & REG_NOTBOL) ? CTX_BEGIN_NOTBOL : CTX_BEGIN;
+	int end = (eflags & REG_NOTEOL) ? CTX_END_NOTEOL : CTX_END;
+	if (!scan_init(&scan, &r->dfa, 0, begin, true))
+		return REG_NOMATCH;
+	if (scan_feed(&scan, data, len))
+		scan_finish(&scan, end);
+	return scan.match == EPOS ? REG_NOMATCH : 0;
+}
+
+int text_search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	return text_regex_literal_forward(&r->literal, search_range_forward, txt, pos, len, r, nmatch, pmatch, eflags);
+}
+
+int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	return text_regex_literal_backward(&r->literal, search_range_backward, txt, pos, len, r, nmatch, pmatch, eflags);
+}
@@ -0,0 +1,329 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "text-regex-literal.h"
+#include "text-motions.h"
+#include "util.h"
+
+/* Candidate lines are verified together with the following ones up to about
+ * this many bytes, amortizing the per call overhead of the regex engine. */
+#define LITERAL_VERIFY_SIZE (1 << 12)
+/* Size of the blocks examined when looking for the last occurrence */
+#define LITERAL_BLOCK_SIZE (1 << 14)
+
+#define lower(c) ((c) >= 'A' && (c) <= 'Z' ? (c) - 'A' + 'a' : (c))
+
+/* Whether a match of the pattern might contain a newline. With REG_NEWLINE
+ * neither . nor non-matching lists do, leaving literal newlines, some GNU
+ * escapes and character classes as well as ranges including one. Errs on the
+ * safe side for anything unusual. */
+bool text_regex_multiline(const char *s, int cflags) {
+	if (!(cflags & REG_NEWLINE) || strchr(s, '\n'))
+		return true;
+	for (; *s; s++) {
+		if (*s == '\\') {
+			if (!*++s)
+				return false;
+			/* \n might be a newline, \s and \W match one, \` and \' anchor to the data */
+			if (strchr("nsW`'", *s))
+				return true;
+		} else if (*s == '[') {
+			bool negated = *++s == '^';
+			if (negated)
+				s++;
+			if (*s == ']')
+				s++;
+			for (; *s && *s != ']'; s++) {
+				if (*s == '[' && (s[1] == ':' || s[1] == '.' || s[1] == '=')) {
+					const char *name = s + 2, *close = strchr(name, s[1]);
+					if (!close || close[1] != ']')
+						return true;
+					size_t len = close - name;
+					if (!negated && s[1] == ':' && len == 5 &&
+					    (!memcmp(name, "space", len) || !memcmp(name, "cntrl", len)))
+						return true;
+					s = close + 1;
+					if (s[1] == '-' && s[2] != ']')
+						return true;
+				} else if (!negated && s[1] == '-' && s[2] && s[2] != ']') {
+					if (s[2] == '[' || ((unsigned char)s[0] <= '\n' && (unsigned char)s[2] >= '\n'))
+						return true;
+					s += 2;
+				}
+			}
+			if (!*s)
+				return true;
+		}
+	}
+	return false;
+}
+
+/* skip bracket expression starting at s, returns its closing ] */
+static const char *skip_bracket(const char *s) {
+	if (*++s == '^')
+		s++;
+	if (*s == ']')
+		s++;
+	for (; *s && *s != ']'; s++) {
+		if (*s == '[' && (s[1] == ':' || s[1] == '.' || s[1] == '=')) {
+			const char *close = strchr(s + 2, s[1]);
+			if (!close || close[1] != ']')
+				return NULL;
+			s = close + 1;
+		}
+	}
+	return *s ? s : NULL;
+}
+
+/* skip parenthesized group starting at s, returns its closing ) */
+static const char *skip_group(const char *s) {
+	for (int depth = 0; *s; s++) {
+		if (*s == '\\') {
+			if (!*++s)
+				return NULL;
+		} else if (*s == '[') {
+			if (!(s = skip_bracket(s)))
+				return NULL;
+		} else if (*s == '(') {
+			depth++;
+		} else if (*s == ')' && --depth == 0) {
+			return s;
+		}
+	}
+	return NULL;
+}
+
+/* skip an optional quantifier, min is set to the minimal number of repetitions */
+static const char *skip_quantifier(const char *s, unsigned long *min) {
+	*min = 1;
+	switch (*s) {
+	case '*':
+	case '?':
+		*min = 0;
+		/* fall through */
+	case '+':
+		return s + 1;
+	case '{': {
+		char *end;
+		*min = strtoul(s + 1, &end, 10);
+		if (end == s + 1 || !(s = strchr(end, '}')))
+			return NULL;
+		return s + 1;
+	}
+	default:
+		return s;
+	}
+}
+
+static void literal_run(RegexLiteral *lit, const char *run, size_t len) {
+	if (len <= lit->len)
+		return;
+	for (size_t i = 0; i < len; i++)
+		lit->data[i] = lit->icase ? lower(run[i]) : run[i];
+	lit->len = len;
+}
+
+/* Find the longest sequence of literal characters at the top level of an
+ * extended regular expression which are neither optional nor repeated. */
+bool text_regex_literal(RegexLiteral *lit, const char *pattern, int cflags) {
+	lit->len = 0;
+	lit->icase = cflags & REG_ICASE;
+	if (!(cflags & REG_EXTENDED) || text_regex_multiline(pattern, cflags))
+		return false;
+	char run[REGEX_LITERAL_MAX];
+	size_t len = 0;
+	for (const char *s = pattern; *s;) {
+		const char *atom = s, *next = s + 1;
+		bool literal = false;
+		switch (*s) {
+		case '|':
+		case ')':
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			goto fail;
+		case '(':
+			if (!(next = skip_group(s)))
+				goto fail;
+			next++;
+			break;
+		case '[':
+			if (!(next = skip_bracket(s)))
+				goto fail;
+			next++;
+			break;
+		case '.':
+		case '^':
+		case '$':
+			break;
+		case '\\':
+			if (!s[1])
+				goto fail;
+			/* character classes, anchors and back references */
+			literal = !isalnum((unsigned char)s[1]) && !strchr("<>`'", s[1]);
+			atom = s + 1;
+			next = s + 2;
+			break;
+		default:
+			/* a multibyte character is quantified as a whole */
+			while ((*next & 0xC0) == 0x80)
+				next++;
+			/* case insensitive matching is only supported for ASCII */
+			literal = !(lit->icase && (unsigned char)*s >= 0x80);
+			break;
+		}
+		unsigned long min;
+		const char *quantifier = skip_quantifier(next, &min);
+		if (!quantifier)
+			goto fail;
+		if (literal && min > 0) {
+			size_t n = next - atom;
+			if (len + n > sizeof run) {
+				literal_run(lit, run, len);
+				len = 0;
+			}
+			if (n <= sizeof run) {
+				memcpy(run + len, atom, n);
+				len += n;
+			}
+		}
+		if (!literal || quantifier != next) {
+			literal_run(lit, run, len);
+			len = 0;
+		}
+		s = quantifier;
+	}
+	literal_run(lit, run, len);
+	return lit->len > 0;
+fail:
+	lit->len = 0;
+	return false;
+}
+
+static bool literal_equal(const RegexLiteral *lit, const char *data) {
+	if (!lit->icase)
+		return !memcmp(data, lit->data, lit->len);
+	for (size_t i = 0; i < lit->len; i++) {
+		if (lower(data[i]) != lit->data[i])
+			return false;
+	}
+	return true;
+}
+
+/* First occurrence of the literal in data[0, len). Candidates are located
+ * based on the first byte using memchr(3), in both cases if needed. */
+static const char *literal_find(const RegexLiteral *lit, const char *data, size_t len) {
+	if (len < lit->len)
+		return NULL;
+	const char *end = data + len - lit->len + 1;
+	char c = lit->data[0], C = c;
+	if (lit->icase && c >= 'a' && c <= 'z')
+		C = c - 'a' + 'A';
+	const char *lc = memchr(data, c, end - data);
+	const char *uc = C == c ? NULL : memchr(data, C, end - data);
+	while (lc || uc) {
+		const char *s = !uc || (lc && lc < uc) ? lc : uc;
+		if (literal_equal(lit, s))
+			return s;
+		if (s == lc)
+			lc = memchr(s + 1, c, end - s - 1);
+		else
+			uc = memchr(s + 1, C, end - s - 1);
+	}
+	return NULL;
+}
+
+/* Last occurrence of the literal in data[0, len) */
+static const char *literal_find_prev(const RegexLiteral *lit, const char *data, size_t len) {
+	char c = lit->data[0];
+	for (size_t i = len - lit->len + 1; len >= lit->len && i-- > 0;) {
+		if ((data[i] == c || (lit->icase && lower(data[i]) == c)) && literal_equal(lit, data + i))
+			return data + i;
+	}
+	return NULL;
+}
+
+/* Position of the first occurrence of the literal in the text range [pos, end) */
+static size_t text_literal_find(Text *txt, const RegexLiteral *lit, size_t pos, size_t end) {
+	TextChunk c;
+	for (bool ok = text_chunk_init(txt, &c, pos, end - pos); ok; ok = text_chunk_next(&c)) {
+		const char *match = literal_find(lit, c.data, c.len);
+		if (match)
+			return c.pos + (match - c.data);
+		/* occurrences crossing the end of the chunk */
+		size_t chunk_end = c.pos + c.len;
+		if (chunk_end < end && lit->len > 1) {
+			char buf[2*REGEX_LITERAL_MAX];
+			size_t from = chunk_end - MIN(c.len, lit->len - 1);
+			size_t len = text_bytes_get(txt, from, MIN(end - from, 2*(lit->len - 1)), buf);
+			if ((match = literal_find(lit, buf, len)))
+				return from + (match - buf);
+		}
+	}
+	return EPOS;
+}
+
+/* Position of the last occurrence of the literal in the text range [pos, end) */
+static size_t text_literal_find_prev(Text *txt, const RegexLiteral *lit, size_t pos, size_t end) {
+	char buf[LITERAL_BLOCK_SIZE];
+	while (end - pos >= lit->len) {
+		size_t start = end - MIN(end - pos, sizeof buf);
+		size_t len = end - start;
+		const char *data = text_bytes_contiguous(txt, start, &len, buf);
+		const char *match = literal_find_prev(lit, data, len);
+		if (match)
+			return start + (match - data);
+		if (start == pos || len != end - start)
+			break;
+		/* blocks overlap to find occurrences crossing their boundary */
+		end = start + lit->len - 1;
+	}
+	return EPOS;
+}
+
+int text_regex_literal_forward(const RegexLiteral *lit, RegexSearch *search, Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	if (!lit->len)
+		return search(txt, pos, len, r, nmatch, pmatch, eflags);
+	/* each match contains the literal and is contained in a line */
+	for (size_t cur = pos, end = pos + len; cur < end;) {
+		size_t match = text_literal_find(txt, lit, cur, end);
+		if (match == EPOS)
+			break;
+		size_t start = MAX(text_line_begin(txt, match), cur);
+		size_t stop = MIN(start + LITERAL_VERIFY_SIZE, end);
+		stop = MIN(text_line_next(txt, MAX(match + lit->len - 1, stop)), end);
+		int flags = eflags;
+		if (start != pos)
+			flags &= ~REG_NOTBOL;
+		if (stop != end)
+			flags |= REG_NOTEOL;
+		if (!search(txt, start, stop - start, r, nmatch, pmatch, flags))
+			return 0;
+		cur = stop;
+	}
+	return REG_NOMATCH;
+}
+
+int text_regex_literal_backward(const RegexLiteral *lit, RegexSearch *search, Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	if (!lit->len)
+		return search(txt, pos, len, r, nmatch, pmatch, eflags);
+	for (size_t cur = pos + len, end = cur; cur > pos;) {
+		size_t match = text_literal_find_prev(txt, lit, pos, cur);
+		if (match == EPOS)
+			break;
+		size_t stop = MIN(text_line_next(txt, match + lit->len - 1), cur);
+		size_t from = stop - MIN(stop - pos, LITERAL_VERIFY_SIZE);
+		size_t start = MAX(text_line_begin(txt, MIN(match, from)), pos);
+		int flags = eflags;
+		if (start != pos)
+			flags &= ~REG_NOTBOL;
+		if (stop != end)
+			flags |= REG_NOTEOL;
+		if (!search(txt, start, stop - start, r, nmatch, pmatch, flags))
+			return 0;
+		cur = start;
+	}
+	return REG_NOMATCH;
+}
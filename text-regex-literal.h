@@ -0,0 +1,32 @@
+#ifndef TEXT_REGEX_LITERAL_H
+#define TEXT_REGEX_LITERAL_H
+
+/* Pattern analysis shared by the regex backends. A literal every match has
+ * to contain is used to quickly skip over text which can not match. Only the
+ * lines containing it are handed to the regex engine for verification. */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "text.h"
+#include "text-regex.h"
+
+#define REGEX_LITERAL_MAX 64
+
+typedef struct {
+	char data[REGEX_LITERAL_MAX]; /* required literal, lower case if icase */
+	size_t len;                   /* its length, zero if there is none */
+	bool icase;                   /* whether ASCII letters match case insensitively */
+} RegexLiteral;
+
+/* search function of a regex backend, used to verify candidate ranges */
+typedef int RegexSearch(Text*, size_t pos, size_t len, Regex*, size_t nmatch, RegexMatch pmatch[], int eflags);
+
+/* whether a match of the pattern might contain a newline */
+bool text_regex_multiline(const char *pattern, int cflags);
+/* find a literal every match of a single line pattern contains */
+bool text_regex_literal(RegexLiteral*, const char *pattern, int cflags);
+/* search only the lines containing the literal using the backend search function */
+int text_regex_literal_forward(const RegexLiteral*, RegexSearch*, Text*, size_t pos, size_t len, Regex*, size_t nmatch, RegexMatch pmatch[], int eflags);
+int text_regex_literal_backward(const RegexLiteral*, RegexSearch*, Text*, size_t pos, size_t len, Regex*, size_t nmatch, RegexMatch pmatch[], int eflags);
+
+#endif
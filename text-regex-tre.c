@@ -4,6 +4,7 @@
 #include <errno.h>
 
 #include "text-regex.h"
+#include "text-regex-literal.h"
 #include "text-motions.h"
 
 struct Regex {
@@ -12,6 +13,8 @@ struct Regex {
 	Text *text;
 	Iterator it;
 	size_t end;
+	RegexLiteral literal;
+	int refcount;
 };
 
 size_t text_regex_nsub(Regex *r) {
@@ -110,11 +113,18 @@ Regex *text_regex_new(void) {
 		.compare = str_compare,
 		.context = r,
 	};
+	r->refcount = 1;
+	return r;
+}
+
+Regex *text_regex_ref(Regex *r) {
+	if (r)
+		r->refcount++;
 	return r;
 }
 
 void text_regex_free(Regex *r) {
-	if (!r)
+	if (!r || --r->refcount > 0)
 		return;
 	tre_regfree(&r->regex);
 	free(r);
@@ -124,6 +134,9 @@ int text_regex_compile(Regex *regex, const char *string, int cflags) {
 	int r = tre_regcomp(&regex->regex, string, cflags);
 	if (r)
 		tre_regcomp(&regex->regex, "\0\0", 0);
+	regex->literal.len = 0;
+	if (!r)
+		text_regex_literal(&regex->literal, string, cflags);
 	return r;
 }
 
@@ -131,7 +144,9 @@ int text_regex_match(Regex *r, const char *data, int eflags) {
 	return tre_regexec(&r->regex, data, 0, NULL, eflags);
 }
 
-int text_search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+static int search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	if (len > TEXT_WINDOW_SIZE)
+		text_advise(txt, pos, len, TEXT_ADVICE_SEQUENTIAL);
 	r->text = txt;
 	r->it = text_iterator_get(txt, pos);
 	r->end = pos+len;
@@ -147,11 +162,11 @@ int text_search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_
 	return ret;
 }
 
-int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+static int search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
 	int ret = REG_NOMATCH;
 	size_t end = pos + len;
 
-	while (pos < end && !text_search_range_forward(txt, pos, len, r, nmatch, pmatch, eflags)) {
+	while (pos < end && !search_range_forward(txt, pos, len, r, nmatch, pmatch, eflags)) {
 		ret = 0;
 		// FIXME: assumes nmatch >= 1
 		size_t next = pmatch[0].end;
@@ -172,3 +187,11 @@ int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size
 
 	return ret;
 }
+
+int text_search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	return text_regex_literal_forward(&r->literal, search_range_forward, txt, pos, len, r, nmatch, pmatch, eflags);
+}
+
+int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	return text_regex_literal_backward(&r->literal, search_range_backward, txt, pos, len, r, nmatch, pmatch, eflags);
+}
@@ -2,9 +2,19 @@
 #include <string.h>
 
 #include "text-regex.h"
+#include "text-regex-literal.h"
+#include "text-motions.h"
+#include "util.h"
+
+/* Forward searches are performed on line aligned windows of about this size,
+ * the memory needed is thus independent of the length of the searched range. */
+#define SEARCH_WINDOW_SIZE (1 << 20)
 
 struct Regex {
 	regex_t regex;
+	bool multiline; /* whether a match might span multiple lines */
+	RegexLiteral literal; /* required literal to quickly find candidate lines */
+	int refcount;
 };
 
 Regex *text_regex_new(void) {
@@ -12,6 +22,7 @@ Regex *text_regex_new(void) {
 	if (!r)
 		return NULL;
 	regcomp(&r->regex, "\0\0", 0); /* this should not match anything */
+	r->refcount = 1;
 	return r;
 }
 
@@ -19,6 +30,10 @@ int text_regex_compile(Regex *regex, const char *string, int cflags) {
 	int r = regcomp(&regex->regex, string, cflags);
 	if (r)
 		regcomp(&regex->regex, "\0\0", 0);
+	regex->multiline = !r && text_regex_multiline(string, cflags);
+	regex->literal.len = 0;
+	if (!r)
+		text_regex_literal(&regex->literal, string, cflags);
 	return r;
 }
 
@@ -28,8 +43,14 @@ size_t text_regex_nsub(Regex *r) {
 	return r->regex.re_nsub;
 }
 
+Regex *text_regex_ref(Regex *r) {
+	if (r)
+		r->refcount++;
+	return r;
+}
+
 void text_regex_free(Regex *r) {
-	if (!r)
+	if (!r || --r->refcount > 0)
 		return;
 	regfree(&r->regex);
 	free(r);
@@ -39,44 +60,142 @@ int text_regex_match(Regex *r, const char *data, int eflags) {
 	return regexec(&r->regex, data, 0, NULL, eflags);
 }
 
-int text_search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
-	char *buf = text_bytes_alloc0(txt, pos, len);
-	if (!buf)
-		return REG_NOMATCH;
-	char *cur = buf, *end = buf + len;
-	int ret = REG_NOMATCH;
+/* match against data[0, len), without REG_STARTEND the data must be NUL terminated at len */
+static int search_exec(Regex *r, const char *data, size_t len, size_t nmatch, regmatch_t match[], int eflags) {
+#ifdef REG_STARTEND
+	match[0].rm_so = 0;
+	match[0].rm_eo = len;
+	eflags |= REG_STARTEND;
+#else
+	(void)len;
+#endif
+	return regexec(&r->regex, data, nmatch, match, eflags);
+}
+
+/* end of the data regexec(3) considers when starting at cur */
+static const char *search_string_end(const char *cur, const char *end) {
+#ifdef REG_STARTEND
+	/* the whole range is matched at once, including any NUL bytes */
+	return end;
+#else
+	const char *nul = memchr(cur, 0, end - cur);
+	return nul ? nul : end;
+#endif
+}
+
+/* Get text[pos, pos+len) for matching, without a copy if it is stored contiguously
+ * and the regex implementation supports matching data which is not NUL terminated.
+ * Otherwise a NUL terminated copy is stored in *buf of *size, which is grown as
+ * needed and reused across calls. */
+static const char *search_window(Text *txt, size_t pos, size_t len, char **buf, size_t *size) {
+#ifdef REG_STARTEND
+	size_t avail = len;
+	const char *data = text_bytes_contiguous(txt, pos, &avail, NULL);
+	if (data && avail == len)
+		return data;
+#endif
+	if (*size <= len) {
+		char *tmp = realloc(*buf, len+1);
+		if (!tmp)
+			return NULL;
+		*buf = tmp;
+		*size = len+1;
+	}
+	if (text_bytes_get(txt, pos, len, *buf) != len)
+		return NULL;
+	(*buf)[len] = '\0';
+	return *buf;
+}
+
+/* End of the line aligned search window starting at pos. A line is never split,
+ * thus a window might exceed the window size if it is longer. */
+static size_t search_window_end(Text *txt, size_t pos, size_t end) {
+	if (end - pos <= SEARCH_WINDOW_SIZE)
+		return end;
+	size_t stop = text_line_begin(txt, pos + SEARCH_WINDOW_SIZE);
+	if (stop <= pos)
+		stop = text_line_next(txt, pos + SEARCH_WINDOW_SIZE);
+	return MIN(stop, end);
+}
+
+/* Match against data[0, len) which is located at pos, the first match is stored in pmatch */
+static int search_forward(Regex *r, const char *cur, size_t pos, size_t len, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	const char *end = cur + len;
 	regmatch_t match[MAX_REGEX_SUB];
 	for (size_t junk = len; len > 0; len -= junk, pos += junk) {
-		ret = regexec(&r->regex, cur, nmatch, match, eflags);
-		if (!ret) {
+		const char *next = search_string_end(cur, end);
+		if (!search_exec(r, cur, next - cur, nmatch, match, eflags)) {
 			for (size_t i = 0; i < nmatch; i++) {
 				pmatch[i].start = match[i].rm_so == -1 ? EPOS : pos + match[i].rm_so;
 				pmatch[i].end = match[i].rm_eo == -1 ? EPOS : pos + match[i].rm_eo;
 			}
-			break;
+			return 0;
 		}
-		char *next = memchr(cur, 0, len);
-		if (!next)
+		if (next == end)
 			break;
 		while (!*next && next != end)
 			next++;
 		junk = next - cur;
 		cur = next;
 	}
+	return REG_NOMATCH;
+}
+
+static int search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	char *buf = NULL;
+	size_t size = 0, end = pos + len;
+	int ret = REG_NOMATCH;
+	RegexMatch match[MAX_REGEX_SUB];
+	if (nmatch > MAX_REGEX_SUB)
+		nmatch = MAX_REGEX_SUB;
+	if (len > TEXT_WINDOW_SIZE)
+		text_advise(txt, pos, len, TEXT_ADVICE_SEQUENTIAL);
+	for (size_t start = pos, stop; start < end; start = stop) {
+		/* unless a match can span lines, each one is contained in a window */
+		stop = r->multiline ? end : search_window_end(txt, start, end);
+		int flags = eflags;
+		if (start != pos)
+			flags &= ~REG_NOTBOL;
+		if (stop != end)
+			flags |= REG_NOTEOL;
+		const char *data = search_window(txt, start, stop - start, &buf, &size);
+		if (!data)
+			break;
+		/* an empty match at the end of a window is found again in the next one,
+		 * where it might be extended */
+		if (!search_forward(r, data, start, stop - start, MAX(nmatch, 1), match, flags) &&
+		    (stop == end || match[0].start < stop)) {
+			memcpy(pmatch, match, nmatch * sizeof *pmatch);
+			ret = 0;
+			break;
+		}
+	}
 	free(buf);
 	return ret;
 }
 
-int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
-	char *buf = text_bytes_alloc0(txt, pos, len);
-	if (!buf)
-		return REG_NOMATCH;
-	char *cur = buf, *end = buf + len;
+/* Start of the line aligned search window ending at end, not before start */
+static size_t search_window_start(Text *txt, size_t start, size_t end) {
+	if (end - start <= SEARCH_WINDOW_SIZE)
+		return start;
+	size_t pos = end - SEARCH_WINDOW_SIZE;
+	size_t begin = text_line_begin(txt, pos);
+	if (begin < pos) {
+		size_t next = text_line_next(txt, pos);
+		if (next < end)
+			begin = next;
+	}
+	return MAX(begin, start);
+}
+
+/* Find the last match in data[0, len) which is located at pos, by repeatedly matching forward */
+static int search_backward(Regex *r, const char *cur, size_t pos, size_t len, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	const char *end = cur + len;
 	int ret = REG_NOMATCH;
 	regmatch_t match[MAX_REGEX_SUB];
 	for (size_t junk = len; len > 0; len -= junk, pos += junk) {
-		char *next;
-		if (!regexec(&r->regex, cur, nmatch, match, eflags)) {
+		const char *next = search_string_end(cur, end);
+		if (!search_exec(r, cur, next - cur, nmatch, match, eflags)) {
 			ret = 0;
 			for (size_t i = 0; i < nmatch; i++) {
 				pmatch[i].start = match[i].rm_so == -1 ? EPOS : pos + match[i].rm_so;
@@ -85,7 +204,7 @@ int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size
 
 			if (match[0].rm_so == 0 && match[0].rm_eo == 0) {
 				/* empty match at the beginning of cur, advance to next line */
-				next = strchr(cur, '\n');
+				next = memchr(cur, '\n', next - cur);
 				if (!next)
 					break;
 				next++;
@@ -93,8 +212,7 @@ int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size
 				next = cur + match[0].rm_eo;
 			}
 		} else {
-			next = memchr(cur, 0, len);
-			if (!next)
+			if (next == end)
 				break;
 			while (!*next && next != end)
 				next++;
@@ -106,6 +224,44 @@ int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size
 		else
 			eflags |= REG_NOTBOL;
 	}
+	return ret;
+}
+
+static int search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	char *buf = NULL;
+	size_t size = 0, end = pos + len;
+	int ret = REG_NOMATCH;
+	RegexMatch match[MAX_REGEX_SUB];
+	if (nmatch > MAX_REGEX_SUB)
+		nmatch = MAX_REGEX_SUB;
+	if (r->multiline && len > TEXT_WINDOW_SIZE)
+		text_advise(txt, pos, len, TEXT_ADVICE_SEQUENTIAL);
+	/* windows are searched from the end, the last match of the first
+	 * window containing one is the last match of the range */
+	for (size_t stop = end, start; stop > pos; stop = start) {
+		start = r->multiline ? pos : search_window_start(txt, pos, stop);
+		int flags = eflags;
+		if (start != pos)
+			flags &= ~REG_NOTBOL;
+		if (stop != end)
+			flags |= REG_NOTEOL;
+		const char *data = search_window(txt, start, stop - start, &buf, &size);
+		if (!data)
+			break;
+		if (!search_backward(r, data, start, stop - start, MAX(nmatch, 1), match, flags)) {
+			memcpy(pmatch, match, nmatch * sizeof *pmatch);
+			ret = 0;
+			break;
+		}
+	}
 	free(buf);
 	return ret;
 }
+
+int text_search_range_forward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	return text_regex_literal_forward(&r->literal, search_range_forward, txt, pos, len, r, nmatch, pmatch, eflags);
+}
+
+int text_search_range_backward(Text *txt, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags) {
+	return text_regex_literal_backward(&r->literal, search_range_backward, txt, pos, len, r, nmatch, pmatch, eflags);
+}
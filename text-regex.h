@@ -17,6 +17,9 @@ typedef Filerange RegexMatch;
 Regex *text_regex_new(void);
 int text_regex_compile(Regex*, const char *pattern, int cflags);
 size_t text_regex_nsub(Regex*);
+/* acquire another reference, a shared regex must not be recompiled */
+Regex *text_regex_ref(Regex*);
+/* release a reference, the regex is freed once the last one is gone */
 void text_regex_free(Regex*);
 int text_regex_match(Regex*, const char *data, int eflags);
 int text_search_range_forward(Text*, size_t pos, size_t len, Regex *r, size_t nmatch, RegexMatch pmatch[], int eflags);
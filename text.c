@@ -22,20 +22,57 @@
 
 /* A piece holds a reference (but doesn't itself store) a certain amount of data.
  * All active pieces chained together form the whole content of the document.
- * At the beginning there exists only one piece, spanning the whole document.
+ * At the beginning the whole document is spanned by pieces referencing the
+ * original file content.
  * Upon insertion/deletion new pieces will be created to represent the changes.
  * Generally pieces are never destroyed, but kept around to perform undo/redo
- * operations.
+ * operations. Only once the undo history is pruned, pieces which are no longer
+ * reachable are released.
  */
 struct Piece {
-	Text *text;             /* text to which this piece belongs */
 	Piece *prev, *next;     /* pointers to the logical predecessor/successor */
-	Piece *global_prev;     /* double linked list in order of allocation, */
-	Piece *global_next;     /* used to free individual pieces */
+	Piece *parent;          /* links of the index tree, only meaningful while */
+	Piece *left, *right;    /* the piece is part of the document */
 	const char *data;       /* pointer into a Block holding the data */
 	size_t len;             /* the length in number of bytes of the data */
+	size_t lines;           /* number of newlines in this piece or LINES_UNKNOWN */
+	size_t size;            /* sum of all piece lengths in this subtree */
+	size_t subtree_lines;   /* sum of all known newline counts in this subtree */
+	uint32_t count;         /* number of pieces in this subtree */
+	uint32_t unknown;       /* number of pieces in this subtree with unknown newline count */
+	uint32_t priority;      /* random heap priority which keeps the tree balanced */
+	uint32_t block;         /* index + 1 of the Block holding the data, 0 if none */
 };
 
+/* Newline counts of pieces referencing the original file content are only
+ * computed on demand, to keep loading of large files independent of their size. */
+#define LINES_UNKNOWN ((size_t)-1)
+
+/* Initial file content is split into pieces of at most this size, bounding
+ * the cost of counting newlines within a single piece. */
+#ifndef PIECE_SIZE
+#define PIECE_SIZE (1 << 20)
+#endif
+
+/* All pieces currently forming the document are additionally indexed by a
+ * treap, i.e. a binary tree ordered by document position whose shape is
+ * determined by random piece priorities. Every node is augmented with the
+ * total length of its subtree, turning the translation of an absolute
+ * position into a Location into an (expected) O(log n) tree descent instead
+ * of a walk along the whole piece chain.
+ *
+ * The linked list remains the authoritative representation, the index is
+ * updated whenever a span is swapped in or out.
+ */
+
+/* used to transform a global position (byte offset starting from the beginning
+ * of the text) into an offset relative to a piece.
+ */
+typedef struct {
+	Piece *piece;           /* piece holding the location */
+	size_t off;             /* offset into the piece in bytes */
+} Location;
+
 /* A Span holds a certain range of pieces. Changes to the document are always
  * performed by swapping out an existing span with a new one.
  */
@@ -50,6 +87,7 @@ struct Change {
 	Span old;               /* all pieces which are being modified/swapped out by the change */
 	Span new;               /* all pieces which are introduced/swapped in by the change */
 	size_t pos;             /* absolute position at which the change occurred */
+	bool compacted;         /* whether the change merely merged pieces, leaving the content as is */
 	Change *next;           /* next change which is part of the same revision */
 	Change *prev;           /* previous change which is part of the same revision */
 };
@@ -57,6 +95,7 @@ struct Change {
 /* A Revision is a list of Changes which are used to undo/redo all modifications
  * since the last snapshot operation. Revisions are stored in a directed graph structure.
  */
+typedef struct Revision Revision;
 struct Revision {
 	Change *change;         /* the most recent change */
 	Revision *next;         /* the next (child) revision in the undo tree */
@@ -65,47 +104,212 @@ struct Revision {
 	Revision *later;        /* the next Revision, chronologically */
 	time_t time;            /* when the first change of this revision was performed */
 	size_t seq;             /* a unique, strictly increasing identifier */
+	size_t size;            /* approximate memory in bytes only needed to undo this revision */
+	size_t children;        /* number of child revisions in the undo tree */
+};
+
+/* Marks are plain values storing a position together with the number of
+ * modifications the text had undergone at the time the position was valid.
+ * Every insertion, deletion, undo and redo operation records how it shifts
+ * positions. Looking up a mark replays the shifts recorded since then.
+ * Updating a mark in place after the lookup keeps further lookups O(1)
+ * until the next modification. The log is only discarded once the owner,
+ * after updating all marks it keeps, raises the generation floor. Marks
+ * from before the floor become invalid.
+ */
+typedef struct {
+	size_t pos;             /* position at which the modification occurred */
+	size_t del;             /* number of bytes removed at pos */
+	size_t ins;             /* number of bytes inserted at pos */
+} Shift;
+
+/* Pieces shorter than this are merged with adjacent ones by text_compact.
+ * The content is thereby copied to a new piece of at most PIECE_SIZE bytes,
+ * unless it is already stored contiguously in the same block. Compaction
+ * is recorded as an additional change of the current revision, undoing
+ * it restores the original pieces before any other change is reverted. */
+#ifndef COMPACT_PIECE_SIZE
+#define COMPACT_PIECE_SIZE (1 << 12)
+#endif
+
+/* Data arriving later, the remainder of a progressively loaded file or the
+ * output of a stream, is appended below the undo history. New pieces are
+ * linked in after the current last piece, all pieces of the undo history
+ * which used to precede the end sentinel are redirected to the first of
+ * them. Hence the appended content remains at the end of the document
+ * whatever revision is restored. As long as no modification happened in
+ * the meantime, the most recently appended piece is extended in place.
+ *
+ * A progressive load only reads the beginning of the file up front. */
+#ifndef LOAD_INITIAL_SIZE
+#define LOAD_INITIAL_SIZE (1 << 16)
+#endif
+
+/* Appended file ranges are memory mapped in windows of at least this size.
+ * The part beyond the current end of file is never accessed, but allows
+ * further growth to be appended to the same mapping. */
+#ifndef APPEND_MMAP_SIZE
+#define APPEND_MMAP_SIZE (1 << 20)
+#endif
+
+/* Pieces, Changes and Revisions are carved out of per text pools of fixed
+ * size objects. Compared to individual heap allocations this avoids the per
+ * object overhead, keeps related objects close together in memory and allows
+ * to release all of them at once. Released objects are kept in a free list.
+ */
+typedef struct Slab Slab;
+struct Slab {
+	Slab *next;             /* previously allocated slab */
+	void *data[];           /* storage for POOL_SLAB_SIZE objects */
 };
 
+typedef struct {
+	size_t size;            /* size of an individual object in bytes */
+	size_t used;            /* number of objects handed out from the most recent slab */
+	Slab *slabs;            /* all slabs of this pool, most recent first */
+	void *free;             /* released objects, linked through their first word */
+} Pool;
+
+/* Number of objects allocated at once: */
+#define POOL_SLAB_SIZE 256
+
 /* The main struct holding all information of a given file */
 struct Text {
 	Array blocks;           /* blocks which hold text content */
-	Piece *pieces;          /* all pieces which have been allocated, used to free them */
+	Pool pieces;            /* storage of all pieces */
+	Pool changes;           /* storage of all changes */
+	Pool revisions;         /* storage of all revisions */
 	Piece begin, end;       /* sentinel nodes which always exists but don't hold any data */
+	Piece *index;           /* root of the tree indexing all pieces of the document */
+	Piece *cache;           /* most recently modified piece */
+	uint32_t seed;          /* state of the pseudo random generator for piece priorities */
+	Array shifts;           /* position shifts used to look up marks */
+	size_t shifts_base;     /* generation floor, number of shifts discarded */
 	Revision *history;        /* undo tree */
 	Revision *current_revision; /* revision holding all file changes until a snapshot is performed */
 	Revision *last_revision;    /* the last revision added to the tree, chronologically */
 	Revision *saved_revision;   /* the last revision at the time of the save operation */
+	Revision *first_revision;   /* the oldest retained revision, root of the undo tree */
+	size_t seq;                 /* sequence number of the next revision */
+	size_t revision_count;      /* number of retained revisions */
+	size_t history_size;        /* approximate memory in bytes only needed for undo/redo */
+	size_t limit_revisions;     /* maximal number of retained revisions, 0 for unlimited */
+	size_t limit_size;          /* maximal history size in bytes, 0 for unlimited */
+	time_t limit_age;           /* maximal age of retained revisions in seconds, 0 for unlimited */
+	size_t compact_pos;         /* position at which compaction resumes */
+	size_t compact_seq;         /* sequence number of the revision fully compacted, or EPOS */
+	Piece *append;              /* last piece, if appended and unmodified since */
+	Block *follow;              /* holds the descriptor shared by the mappings of appended file ranges */
+	uint32_t append_block;      /* block (index + 1) of the most recent mapping of an appended range */
+	Block *loading;             /* block of a progressively loaded file which is still being read */
+	size_t loaded;              /* number of bytes of the loading block referenced by pieces */
 	size_t size;            /* current file content size in bytes */
 	struct stat info;       /* stat as probed at load time */
+	size_t origin;          /* for snapshots the sequence number of the revision they capture, or EPOS */
+	Recovery *recovery;     /* crash recovery journal of all changes, or NULL */
 };
 
+/* object pool management */
+static void pool_init(Pool *pool, size_t size);
+static void *pool_alloc(Pool *pool);
+static void pool_free(Pool *pool, void *obj);
+static void pool_release(Pool *pool);
 /* block management */
+static Block *block_reserve(Text*, size_t len);
 static const char *block_store(Text*, const char *data, size_t len);
+static void block_unref(Block *blk);
+/* cache layer */
+static void marks_shift(Text *txt, size_t pos, size_t del, size_t ins);
+static void text_changed(Text *txt, size_t pos, size_t del, size_t ins);
+static void change_swapped(Text *txt, Change *c, Span *removed, Span *inserted);
+static bool cache_contains(Text *txt, Piece *p);
+static bool cache_insert(Text *txt, Piece *p, size_t off, const char *data, size_t len);
+static bool cache_delete(Text *txt, Piece *p, size_t off, size_t len);
+/* appending and progressive loading */
+static size_t append_data(Text *txt, const char *data, size_t len, uint32_t block);
+static void load_check(Text *txt, size_t max, size_t len);
 /* piece management */
 static Piece *piece_alloc(Text *txt);
-static void piece_free(Piece *p);
+static void piece_free(Text *txt, Piece *p);
+static void piece_block(Text *txt, Piece *p, uint32_t block);
 static void piece_init(Piece *p, Piece *prev, Piece *next, const char *data, size_t len);
 static Location piece_get_intern(Text *txt, size_t pos);
 static Location piece_get_extern(const Text *txt, size_t pos);
+/* piece index management */
+static void index_update(Piece *p);
+static Piece *index_merge(Piece *left, Piece *right);
+static void index_split(Piece *root, size_t count, Piece **left, Piece **right);
+static void index_refresh(Piece *p);
+static size_t index_rank(Piece *p);
+static size_t index_pos(Piece *p);
+static void index_swap(Text *txt, Span *old, Span *new);
 /* span management */
 static void span_init(Span *span, Piece *start, Piece *end);
 static void span_swap(Text *txt, Span *old, Span *new);
 /* change management */
 static Change *change_alloc(Text *txt, size_t pos);
-static void change_free(Change *c);
 /* revision management */
 static Revision *revision_alloc(Text *txt);
-static void revision_free(Revision *rev);
+static void history_prune(Text *txt);
 /* logical line counting cache */
-static size_t lines_skip_forward(Text *txt, size_t pos, size_t lines, size_t *lines_skipped);
-static size_t lines_count(Text *txt, size_t pos, size_t len);
+static void piece_lines(Piece *p);
+static void piece_lines_sub(Piece *p, const Piece *orig);
+static size_t lines_count(Piece *p, size_t pos);
+static bool lines_skip(Piece *p, size_t *lines, size_t *pos);
 
-/* stores the given data in a block, allocates a new one if necessary. Returns
- * a pointer to the storage location or NULL if allocation failed. */
-static const char *block_store(Text *txt, const char *data, size_t len) {
-	Block *blk = array_get_ptr(&txt->blocks, array_length(&txt->blocks)-1);
-	if (!blk || !block_capacity(blk, len)) {
+/* count the number of newlines '\n' in data[0, len) */
+static size_t lines_memcount(const char *data, size_t len) {
+	size_t lines = 0;
+	for (const char *end = data + len; (data = memchr(data, '\n', end - data)); data++)
+		lines++;
+	return lines;
+}
+
+static void pool_init(Pool *pool, size_t size) {
+	*pool = (Pool){ .size = size };
+}
+
+/* allocate a zero initialized object, reusing a released one if available */
+static void *pool_alloc(Pool *pool) {
+	void *obj = pool->free;
+	if (obj) {
+		pool->free = *(void**)obj;
+	} else {
+		if (!pool->slabs || pool->used == POOL_SLAB_SIZE) {
+			Slab *slab = malloc(sizeof *slab + POOL_SLAB_SIZE * pool->size);
+			if (!slab)
+				return NULL;
+			slab->next = pool->slabs;
+			pool->slabs = slab;
+			pool->used = 0;
+		}
+		obj = (char*)pool->slabs->data + pool->used++ * pool->size;
+	}
+	return memset(obj, 0, pool->size);
+}
+
+/* put an object back into the free list of the pool */
+static void pool_free(Pool *pool, void *obj) {
+	*(void**)obj = pool->free;
+	pool->free = obj;
+}
+
+/* release all objects ever allocated from the pool */
+static void pool_release(Pool *pool) {
+	for (Slab *next, *slab = pool->slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+	pool_init(pool, pool->size);
+}
+
+/* returns the most recent block if it has enough free space to store len
+ * bytes, allocates a new one otherwise. Returns NULL if allocation failed. */
+static Block *block_reserve(Text *txt, size_t len) {
+	size_t last = array_length(&txt->blocks)-1;
+	Block *blk = array_get_ptr(&txt->blocks, last);
+	if (!blk || blk == txt->loading || !block_capacity(blk, len)) {
+		Block *prev = blk;
 		blk = block_alloc(len);
 		if (!blk)
 			return NULL;
@@ -113,10 +317,188 @@ static const char *block_store(Text *txt, const char *data, size_t len) {
 			block_free(blk);
 			return NULL;
 		}
+		/* the previous block might have become unreferenced by history pruning */
+		if (prev && prev->pieces == 0 && prev != txt->loading) {
+			block_unref(prev);
+			array_set_ptr(&txt->blocks, last, NULL);
+		}
 	}
+	return blk;
+}
+
+/* stores the given data in a block, allocates a new one if necessary. Returns
+ * a pointer to the storage location or NULL if allocation failed. */
+static const char *block_store(Text *txt, const char *data, size_t len) {
+	Block *blk = block_reserve(txt, len);
+	if (!blk)
+		return NULL;
 	return block_append(blk, data, len);
 }
 
+/* drop a reference to a block, it is freed once no text or snapshot uses it */
+static void block_unref(Block *blk) {
+	if (blk && --blk->refs == 0)
+		block_free(blk);
+}
+
+/* record how a modification shifts subsequent positions */
+static void marks_shift(Text *txt, size_t pos, size_t del, size_t ins) {
+	Shift shift = { .pos = pos, .del = del, .ins = ins };
+	if (!array_add(&txt->shifts, &shift)) {
+		/* invalidate all existing marks */
+		txt->shifts_base += array_length(&txt->shifts) + 1;
+		array_clear(&txt->shifts);
+	}
+}
+
+/* account for del bytes at pos having been replaced by ins bytes */
+static void text_changed(Text *txt, size_t pos, size_t del, size_t ins) {
+	marks_shift(txt, pos, del, ins);
+	if (txt->recovery)
+		recovery_change(txt->recovery, txt, pos, del, ins);
+}
+
+/* number of leading bytes two spans share, i.e. referring to the same
+ * storage location. Spans might contain empty pieces. */
+static size_t span_prefix(Span *a, Span *b) {
+	size_t max = MIN(a->len, b->len), len = 0, aoff = 0, boff = 0;
+	Piece *p = a->start, *q = b->start;
+	while (len < max && p->data + aoff == q->data + boff) {
+		size_t n = MIN(p->len - aoff, q->len - boff);
+		len += n;
+		aoff += n;
+		boff += n;
+		if (aoff == p->len) {
+			if (p == a->end)
+				break;
+			p = p->next;
+			aoff = 0;
+		}
+		if (boff == q->len) {
+			if (q == b->end)
+				break;
+			q = q->next;
+			boff = 0;
+		}
+	}
+	return MIN(len, max);
+}
+
+/* number of trailing bytes two spans share, at most max */
+static size_t span_suffix(Span *a, Span *b, size_t max) {
+	size_t len = 0, aoff = 0, boff = 0;
+	Piece *p = a->end, *q = b->end;
+	while (len < max && p->data + p->len - aoff == q->data + q->len - boff) {
+		size_t n = MIN(p->len - aoff, q->len - boff);
+		len += n;
+		aoff += n;
+		boff += n;
+		if (aoff == p->len) {
+			if (p == a->start)
+				break;
+			p = p->prev;
+			aoff = 0;
+		}
+		if (boff == q->len) {
+			if (q == b->start)
+				break;
+			q = q->prev;
+			boff = 0;
+		}
+	}
+	return MIN(len, max);
+}
+
+/* account for a change being undone or redone, i.e. its removed span having
+ * been replaced by the inserted one. Spans consist of whole pieces, possibly
+ * starting before c->pos. The bytes both of them share are left out to obtain
+ * the exact range which was modified. Compaction does not alter the content
+ * and hence shifts no positions. */
+static void change_swapped(Text *txt, Change *c, Span *removed, Span *inserted) {
+	if (c->compacted)
+		return;
+	size_t del = removed->len, ins = inserted->len;
+	size_t pos = ins ? index_pos(inserted->start) : c->pos;
+	if (del && ins) {
+		size_t prefix = span_prefix(removed, inserted);
+		size_t suffix = span_suffix(removed, inserted, MIN(del, ins) - prefix);
+		pos += prefix;
+		del -= prefix + suffix;
+		ins -= prefix + suffix;
+	}
+	marks_shift(txt, pos, del, ins);
+	if (txt->recovery)
+		recovery_change(txt->recovery, txt, pos, del, ins);
+}
+
+/* As a performance optimization we keep track of the most recently modified
+ * piece. If its data is located at the end of the most recent block and it
+ * was introduced by the most recent change of the current revision, further
+ * insertions/deletions (e.g. consecutive key strokes in insert mode) are
+ * performed in place instead of allocating new changes and pieces.
+ */
+
+/* check whether the given piece was the most recently modified one */
+static bool cache_contains(Text *txt, Piece *p) {
+	Block *blk = array_get_ptr(&txt->blocks, array_length(&txt->blocks)-1);
+	Revision *rev = txt->current_revision;
+	if (!blk || !txt->cache || txt->cache != p || !rev || !rev->change)
+		return false;
+
+	Piece *start = rev->change->new.start;
+	Piece *end = rev->change->new.end;
+	bool found = false;
+	for (Piece *cur = start; cur && !found; cur = cur->next) {
+		if (cur == p)
+			found = true;
+		if (cur == end)
+			break;
+	}
+
+	return found && p->data + p->len == blk->data + blk->len;
+}
+
+/* try to insert a chunk of data at a given piece offset. The insertion is only
+ * performed if the piece is the most recently changed one. The length of the
+ * piece, the span containing it and the whole text is adjusted accordingly */
+static bool cache_insert(Text *txt, Piece *p, size_t off, const char *data, size_t len) {
+	if (!cache_contains(txt, p))
+		return false;
+	Block *blk = array_get_ptr(&txt->blocks, array_length(&txt->blocks)-1);
+	size_t bufpos = p->data + off - blk->data;
+	if (!block_insert(blk, bufpos, data, len))
+		return false;
+	p->len += len;
+	p->lines += lines_memcount(data, len);
+	index_refresh(p);
+	txt->current_revision->change->new.len += len;
+	txt->size += len;
+	return true;
+}
+
+/* try to delete a chunk of data at a given piece offset. The deletion is only
+ * performed if the piece is the most recently changed one and the whole
+ * affected range lies within it. The length of the piece, the span containing
+ * it and the whole text is adjusted accordingly */
+static bool cache_delete(Text *txt, Piece *p, size_t off, size_t len) {
+	if (!cache_contains(txt, p))
+		return false;
+	Block *blk = array_get_ptr(&txt->blocks, array_length(&txt->blocks)-1);
+	size_t end;
+	size_t bufpos = p->data + off - blk->data;
+	if (!addu(off, len, &end) || end > p->len)
+		return false;
+	size_t lines = lines_memcount(p->data + off, len);
+	if (!block_delete(blk, bufpos, len))
+		return false;
+	p->len -= len;
+	p->lines -= lines;
+	index_refresh(p);
+	txt->current_revision->change->new.len -= len;
+	txt->size -= len;
+	return true;
+}
+
 /* initialize a span and calculate its length */
 static void span_init(Span *span, Piece *start, Piece *end) {
 	size_t len = 0;
@@ -138,9 +520,11 @@ static void span_init(Span *span, Piece *start, Piece *end) {
  * adjusts the document size accordingly.
  */
 static void span_swap(Text *txt, Span *old, Span *new) {
-	if (old->len == 0 && new->len == 0) {
+	if (old->len == 0 && new->len == 0)
 		return;
-	} else if (old->len == 0) {
+	txt->append = NULL;
+	index_swap(txt, old, new);
+	if (old->len == 0) {
 		/* insert new span */
 		new->start->prev->next = new->start;
 		new->end->next->prev = new->end;
@@ -160,17 +544,13 @@ static void span_swap(Text *txt, Span *old, Span *new) {
 /* Allocate a new revision and place it in the revision graph.
  * All further changes will be associated with this revision. */
 static Revision *revision_alloc(Text *txt) {
-	Revision *rev = calloc(1, sizeof *rev);
+	Revision *rev = pool_alloc(&txt->revisions);
 	if (!rev)
 		return NULL;
 	rev->time = time(NULL);
+	rev->seq = txt->seq++;
 	txt->current_revision = rev;
-
-	/* set sequence number */
-	if (!txt->last_revision)
-		rev->seq = 0;
-	else
-		rev->seq = txt->last_revision->seq + 1;
+	txt->revision_count++;
 
 	/* set earlier, later pointers */
 	if (txt->last_revision)
@@ -179,48 +559,451 @@ static Revision *revision_alloc(Text *txt) {
 
 	if (!txt->history) {
 		txt->history = rev;
+		txt->first_revision = rev;
 		return rev;
 	}
 
 	/* set prev, next pointers */
 	rev->prev = txt->history;
 	txt->history->next = rev;
+	txt->history->children++;
 	txt->history = rev;
 	return rev;
 }
 
-static void revision_free(Revision *rev) {
-	if (!rev)
-		return;
+/* approximate the memory which is only kept alive to undo the revision:
+ * the change records as well as all swapped out pieces and their data */
+static size_t revision_size(Revision *rev) {
+	size_t size = sizeof(*rev);
+	for (Change *c = rev->change; c; c = c->next) {
+		size += sizeof(*c) + c->old.len;
+		for (Piece *p = c->old.start; p; p = p->next) {
+			size += sizeof(*p);
+			if (p == c->old.end)
+				break;
+		}
+	}
+	return size;
+}
+
+/* Once the undo history exceeds one of its limits, it is pruned from the
+ * root of the undo tree. The child of the root along the main branch (the
+ * one leading to the current state) becomes the new root, all other branches
+ * leaving the former root are discarded.
+ *
+ * A root revision can no longer be undone, hence all its changes together
+ * with the pieces they swapped out are freed. Pieces are only ever part of
+ * one such old span along a path through the undo tree, whereas pieces of
+ * discarded branches are exclusively referenced by the new span of the
+ * change introducing them. Blocks are released as soon as no piece refers
+ * to them anymore.
+ */
+
+/* release all changes of a revision together with the pieces of their old
+ * or new spans */
+static void revision_changes_free(Text *txt, Revision *rev, bool old) {
 	for (Change *next, *c = rev->change; c; c = next) {
 		next = c->next;
-		change_free(c);
+		Span *span = old ? &c->old : &c->new;
+		for (Piece *p = span->start, *n; p; p = n) {
+			n = p == span->end ? NULL : p->next;
+			piece_free(txt, p);
+		}
+		pool_free(&txt->changes, c);
+	}
+	rev->change = NULL;
+}
+
+/* remove a revision from the chronological list and release it */
+static void revision_free(Text *txt, Revision *rev) {
+	if (rev->earlier)
+		rev->earlier->later = rev->later;
+	if (rev->later)
+		rev->later->earlier = rev->earlier;
+	if (txt->last_revision == rev)
+		txt->last_revision = rev->earlier;
+	if (txt->saved_revision == rev)
+		txt->saved_revision = NULL;
+	txt->history_size -= rev->size;
+	txt->revision_count--;
+	pool_free(&txt->revisions, rev);
+}
+
+static void history_prune_root(Text *txt) {
+	Revision *root = txt->first_revision, *child = root->next;
+
+	if (root->children > 1) {
+		/* parents are created before their children, hence a chronological
+		 * walk encounters them first and can propagate the invalidation */
+		for (Revision *rev = root->later; rev; rev = rev->later) {
+			if (rev != child && (rev->prev == root || rev->prev->seq == EPOS))
+				rev->seq = EPOS;
+		}
+		for (Revision *next, *rev = root->later; rev; rev = next) {
+			next = rev->later;
+			if (rev->seq == EPOS) {
+				revision_changes_free(txt, rev, false);
+				revision_free(txt, rev);
+			}
+		}
 	}
-	free(rev);
+
+	revision_changes_free(txt, root, true);
+	revision_free(txt, root);
+	revision_changes_free(txt, child, true);
+	txt->history_size -= child->size;
+	child->size = 0;
+	child->prev = NULL;
+	txt->first_revision = child;
+	txt->cache = NULL;
+}
+
+static bool history_exceeded(Text *txt, time_t now) {
+	Revision *root = txt->first_revision;
+	if (!root || root == txt->history)
+		return false;
+	if (txt->limit_revisions && txt->revision_count > txt->limit_revisions)
+		return true;
+	if (txt->limit_size && txt->history_size > txt->limit_size)
+		return true;
+	/* the state of the root was left when its child was created */
+	return txt->limit_age && now - root->next->time > txt->limit_age;
+}
+
+static void history_prune(Text *txt) {
+	time_t now = txt->limit_age ? time(NULL) : 0;
+	while (history_exceeded(txt, now))
+		history_prune_root(txt);
+}
+
+void text_history_limit(Text *txt, size_t revisions, time_t age, size_t size) {
+	txt->limit_revisions = revisions;
+	txt->limit_age = age;
+	txt->limit_size = size;
+	if (!txt->current_revision)
+		history_prune(txt);
+}
+
+/* replace the run of pieces [start, end] at pos by a single one */
+static Piece *compact_run(Text *txt, Revision *rev, Piece *start, Piece *end, size_t pos) {
+	size_t len = 0, lines = 0, count = 0;
+	bool adjacent = start->block != 0;
+	for (Piece *p = start; ; p = p->next) {
+		len += p->len;
+		lines = lines == LINES_UNKNOWN || p->lines == LINES_UNKNOWN ? LINES_UNKNOWN : lines + p->lines;
+		count++;
+		if (p == end)
+			break;
+		adjacent &= p->next->block == start->block && p->data + p->len == p->next->data;
+	}
+
+	Piece *new = piece_alloc(txt);
+	Change *c = pool_alloc(&txt->changes);
+	if (!new || !c)
+		goto err;
+	const char *data = start->data;
+	uint32_t block = start->block;
+	if (!adjacent) {
+		Block *blk = block_reserve(txt, len);
+		if (!blk)
+			goto err;
+		data = blk->data + blk->len;
+		for (Piece *p = start; ; p = p->next) {
+			block_append(blk, p->data, p->len);
+			if (p == end)
+				break;
+		}
+		block = array_length(&txt->blocks);
+	}
+
+	piece_init(new, start->prev, end->next, data, len);
+	piece_block(txt, new, block);
+	new->lines = lines;
+	c->pos = pos;
+	c->compacted = true;
+	span_init(&c->old, start, end);
+	span_init(&c->new, new, new);
+	span_swap(txt, &c->old, &c->new);
+	/* the most recent change is undone first */
+	c->next = rev->change;
+	if (rev->change)
+		rev->change->prev = c;
+	rev->change = c;
+
+	size_t size = sizeof(*c) + count * sizeof(Piece) + (adjacent ? 0 : len);
+	rev->size += size;
+	txt->history_size += size;
+	return new;
+err:
+	if (new)
+		pool_free(&txt->pieces, new);
+	if (c)
+		pool_free(&txt->changes, c);
+	return NULL;
+}
+
+bool text_compact(Text *txt, size_t max) {
+	Revision *rev = txt->history;
+	/* the state the children of a revision are based on must not change */
+	if (txt->current_revision || !rev || rev->children > 0)
+		return false;
+	if (rev->seq == txt->compact_seq)
+		return false;
+	if (txt->compact_pos > txt->size)
+		txt->compact_pos = 0;
+
+	txt->cache = NULL;
+	Location loc = piece_get_extern(txt, txt->compact_pos);
+	Piece *p = loc.piece;
+	size_t pos = txt->compact_pos - loc.off;
+	if (p == &txt->begin)
+		p = p->next;
+	for (size_t work = 0; p != &txt->end && work < max; p = p->next) {
+		Piece *end = p;
+		size_t len = p->len;
+		if (len < COMPACT_PIECE_SIZE) {
+			while (work < max && end->next != &txt->end && end->next->len < COMPACT_PIECE_SIZE &&
+			       len + end->next->len <= PIECE_SIZE) {
+				end = end->next;
+				len += end->len;
+				work += sizeof(Piece);
+			}
+		}
+		if (end != p) {
+			if (!(p = compact_run(txt, rev, p, end, pos)))
+				break;
+			work += len;
+		}
+		work += sizeof(Piece);
+		pos += len;
+	}
+
+	history_prune(txt);
+	if (p && p != &txt->end) {
+		txt->compact_pos = pos;
+		return true;
+	}
+	txt->compact_pos = 0;
+	if (p)
+		txt->compact_seq = rev->seq;
+	return false;
+}
+
+/* append data already stored in the given block (index + 1) to the end of
+ * the document, returns the number of bytes appended */
+static size_t append_data(Text *txt, const char *data, size_t len, uint32_t block) {
+	Piece *first = NULL;
+	size_t rem = len;
+	while (rem > 0) {
+		Piece *p = txt->append;
+		size_t n;
+		if (p && p->block == block && p->data + p->len == data && p->len < PIECE_SIZE) {
+			n = MIN(rem, PIECE_SIZE - p->len);
+			p->len += n;
+			if (p->lines != LINES_UNKNOWN)
+				p->lines += lines_memcount(data, n);
+			index_refresh(p);
+		} else {
+			if (!(p = piece_alloc(txt)))
+				break;
+			n = MIN(rem, PIECE_SIZE);
+			piece_init(p, txt->end.prev, &txt->end, data, n);
+			piece_block(txt, p, block);
+			p->lines = lines_memcount(data, n);
+			index_update(p);
+			txt->index = index_merge(txt->index, p);
+			txt->index->parent = NULL;
+			txt->end.prev->next = p;
+			txt->end.prev = p;
+			txt->append = p;
+			if (!first)
+				first = p;
+		}
+		data += n;
+		rem -= n;
+		txt->size += n;
+	}
+
+	if (first) {
+		for (Revision *rev = txt->first_revision; rev; rev = rev->later) {
+			for (Change *c = rev->change; c; c = c->next) {
+				if (c->old.end && c->old.end->next == &txt->end)
+					c->old.end->next = first;
+				if (c->new.end && c->new.end->next == &txt->end)
+					c->new.end->next = first;
+			}
+		}
+		txt->compact_seq = EPOS;
+	}
+	return len - rem;
+}
+
+/* finish a progressive load once the file is exhausted, len is the number
+ * of bytes returned by the most recent request of max bytes */
+static void load_check(Text *txt, size_t max, size_t len) {
+	Block *blk = txt->loading;
+	if (len < max || blk->len >= (size_t)txt->info.st_size) {
+		close(blk->fd);
+		blk->fd = -1;
+		txt->loading = NULL;
+	}
+}
+
+bool text_load_continue(Text *txt, size_t max) {
+	Block *blk = txt->loading;
+	if (!blk)
+		return true;
+	if (max > (size_t)txt->info.st_size - blk->len)
+		max = txt->info.st_size - blk->len;
+	ssize_t len = block_read_more(blk, max);
+	if (len == -1)
+		return false;
+	txt->loaded += append_data(txt, blk->data + txt->loaded, blk->len - txt->loaded, 1);
+	if (txt->loaded < blk->len)
+		return false;
+	load_check(txt, max, len);
+	return true;
+}
+
+ssize_t text_append_fd(Text *txt, int fd, size_t max) {
+	if (txt->loading) {
+		errno = EBUSY;
+		return -1;
+	}
+	Block *blk = block_reserve(txt, max);
+	if (!blk)
+		return -1;
+	char *data = blk->data + blk->len;
+	ssize_t len;
+	while ((len = read(fd, data, max)) == -1 && errno == EINTR);
+	if (len <= 0)
+		return len;
+	blk->len += len;
+	size_t appended = append_data(txt, data, len, array_length(&txt->blocks));
+	if (appended < (size_t)len) {
+		blk->len -= len - appended;
+		errno = ENOMEM;
+		return -1;
+	}
+	return len;
+}
+
+bool text_append_file(Text *txt, int fd, off_t offset, size_t len) {
+	if (txt->loading) {
+		errno = EBUSY;
+		return false;
+	}
+	if (len == 0)
+		return true;
+	/* all mappings of the same file share one duplicated descriptor */
+	struct stat prev, cur;
+	if (fstat(fd, &cur) == -1)
+		return false;
+	if (txt->follow && (fstat(txt->follow->fd, &prev) == -1 ||
+	    prev.st_dev != cur.st_dev || prev.st_ino != cur.st_ino)) {
+		block_unref(txt->follow);
+		txt->follow = NULL;
+	}
+	/* extend the previous mapping if it covers the range, independent of
+	 * any modifications since it was last appended to */
+	uint32_t block = txt->append_block;
+	Block *blk = block ? array_get_ptr(&txt->blocks, block - 1) : NULL;
+	const char *data = NULL;
+	if (blk && txt->follow && blk->owner == txt->follow && blk->type == BLOCK_TYPE_MMAP_ORIG &&
+	    blk->offset <= offset && (size_t)(offset - blk->offset) <= blk->size &&
+	    len <= blk->size - (offset - blk->offset))
+		data = blk->data + (offset - blk->offset);
+	if (!data) {
+		if (!txt->follow) {
+			int mapfd = dup(fd);
+			if (mapfd == -1)
+				return false;
+			if (!(txt->follow = block_mmap(0, mapfd, 0))) {
+				close(mapfd);
+				return false;
+			}
+		}
+		off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+		size_t size = MAX(len + (offset - start), APPEND_MMAP_SIZE);
+		if (!(blk = block_mmap(size, txt->follow->fd, start)))
+			return false;
+		blk->owner = txt->follow;
+		txt->follow->refs++;
+		if (!array_add_ptr(&txt->blocks, blk)) {
+			block_free(blk);
+			return false;
+		}
+		block = txt->append_block = array_length(&txt->blocks);
+		data = blk->data + (offset - start);
+	}
+	size_t appended = append_data(txt, data, len, block);
+	if (txt->recovery && appended)
+		recovery_change(txt->recovery, txt, txt->size - appended, 0, appended);
+	if ((off_t)(offset + appended) > txt->info.st_size)
+		txt->info.st_size = offset + appended;
+	if (appended < len) {
+		errno = ENOMEM;
+		return false;
+	}
+	return true;
+}
+
+bool text_trim(Text *txt, size_t len) {
+	if (len == 0)
+		return true;
+	bool modified = text_modified(txt);
+	text_snapshot(txt);
+	if (!text_delete(txt, 0, len))
+		return false;
+	text_snapshot(txt);
+	while (txt->first_revision != txt->history)
+		history_prune_root(txt);
+	if (!modified)
+		txt->saved_revision = txt->history;
+	return true;
+}
+
+size_t text_loading(const Text *txt) {
+	return txt->loading ? txt->info.st_size - txt->loaded : 0;
 }
 
 static Piece *piece_alloc(Text *txt) {
-	Piece *p = calloc(1, sizeof *p);
+	Piece *p = pool_alloc(&txt->pieces);
 	if (!p)
 		return NULL;
-	p->text = txt;
-	p->global_next = txt->pieces;
-	if (txt->pieces)
-		txt->pieces->global_prev = p;
-	txt->pieces = p;
+	/* xorshift32 */
+	txt->seed ^= txt->seed << 13;
+	txt->seed ^= txt->seed >> 17;
+	txt->seed ^= txt->seed << 5;
+	p->priority = txt->seed;
 	return p;
 }
 
-static void piece_free(Piece *p) {
-	if (!p)
-		return;
-	if (p->global_prev)
-		p->global_prev->global_next = p->global_next;
-	if (p->global_next)
-		p->global_next->global_prev = p->global_prev;
-	if (p->text->pieces == p)
-		p->text->pieces = p->global_next;
-	free(p);
+/* release a piece, and its block if it was the last one referring to it */
+static void piece_free(Text *txt, Piece *p) {
+	if (p->block) {
+		size_t idx = p->block - 1;
+		Block *blk = array_get_ptr(&txt->blocks, idx);
+		/* the most recent block is still used to store new data */
+		if (--blk->pieces == 0 && idx + 1 < array_length(&txt->blocks) && blk != txt->loading) {
+			block_unref(blk);
+			array_set_ptr(&txt->blocks, idx, NULL);
+		}
+	}
+	if (txt->cache == p)
+		txt->cache = NULL;
+	if (txt->append == p)
+		txt->append = NULL;
+	pool_free(&txt->pieces, p);
+}
+
+/* record that the piece data is stored in the given block (index + 1) */
+static void piece_block(Text *txt, Piece *p, uint32_t block) {
+	p->block = block;
+	if (block) {
+		Block *blk = array_get_ptr(&txt->blocks, block - 1);
+		blk->pieces++;
+	}
 }
 
 static void piece_init(Piece *p, Piece *prev, Piece *next, const char *data, size_t len) {
@@ -230,6 +1013,133 @@ static void piece_init(Piece *p, Piece *prev, Piece *next, const char *data, siz
 	p->len = len;
 }
 
+static size_t index_size(const Piece *p) {
+	return p ? p->size : 0;
+}
+
+static size_t index_count(const Piece *p) {
+	return p ? p->count : 0;
+}
+
+static size_t index_lines(const Piece *p) {
+	return p ? p->subtree_lines : 0;
+}
+
+static size_t index_unknown(const Piece *p) {
+	return p ? p->unknown : 0;
+}
+
+/* recalculate the augmented subtree information after the children of p changed */
+static void index_update(Piece *p) {
+	bool unknown = p->lines == LINES_UNKNOWN;
+	p->size = index_size(p->left) + p->len + index_size(p->right);
+	p->count = index_count(p->left) + 1 + index_count(p->right);
+	p->subtree_lines = index_lines(p->left) + (unknown ? 0 : p->lines) + index_lines(p->right);
+	p->unknown = index_unknown(p->left) + unknown + index_unknown(p->right);
+	if (p->left)
+		p->left->parent = p;
+	if (p->right)
+		p->right->parent = p;
+}
+
+/* join two trees, all pieces of left precede those of right */
+static Piece *index_merge(Piece *left, Piece *right) {
+	if (!left)
+		return right;
+	if (!right)
+		return left;
+	if (left->priority > right->priority) {
+		left->right = index_merge(left->right, right);
+		index_update(left);
+		return left;
+	} else {
+		right->left = index_merge(left, right->left);
+		index_update(right);
+		return right;
+	}
+}
+
+/* split tree such that left contains the first count pieces, right the rest */
+static void index_split(Piece *root, size_t count, Piece **left, Piece **right) {
+	if (!root) {
+		*left = *right = NULL;
+		return;
+	}
+	if (index_count(root->left) < count) {
+		index_split(root->right, count - index_count(root->left) - 1, &root->right, right);
+		*left = root;
+	} else {
+		index_split(root->left, count, left, &root->left);
+		*right = root;
+	}
+	index_update(root);
+}
+
+/* propagate a length change of p to all its ancestors */
+static void index_refresh(Piece *p) {
+	for (; p; p = p->parent)
+		index_update(p);
+}
+
+/* number of pieces preceding p in the document */
+static size_t index_rank(Piece *p) {
+	size_t rank = index_count(p->left);
+	for (; p->parent; p = p->parent) {
+		if (p->parent->right == p)
+			rank += index_count(p->parent->left) + 1;
+	}
+	return rank;
+}
+
+/* absolute position of the first byte of p in the document */
+static size_t index_pos(Piece *p) {
+	size_t pos = index_size(p->left);
+	for (; p->parent; p = p->parent) {
+		if (p->parent->right == p)
+			pos += index_size(p->parent->left) + p->parent->len;
+	}
+	return pos;
+}
+
+/* replace the pieces of the old span by those of the new one in the index */
+static void index_swap(Text *txt, Span *old, Span *new) {
+	Piece *left, *mid, *right;
+	size_t rank;
+	if (old->start)
+		rank = index_rank(old->start);
+	else if (new->start->prev == &txt->begin)
+		rank = 0;
+	else
+		rank = index_rank(new->start->prev) + 1;
+
+	index_split(txt->index, rank, &left, &right);
+	if (old->start) {
+		size_t count = 1;
+		for (Piece *p = old->start; p != old->end; p = p->next)
+			count++;
+		index_split(right, count, &mid, &right);
+	}
+
+	mid = NULL;
+	for (Piece *p = new->start; p; p = p->next) {
+		p->left = p->right = p->parent = NULL;
+		index_update(p);
+		mid = index_merge(mid, p);
+		if (p == new->end)
+			break;
+	}
+
+	if (left)
+		left->parent = NULL;
+	if (mid)
+		mid->parent = NULL;
+	if (right)
+		right->parent = NULL;
+	txt->index = index_merge(index_merge(left, mid), right);
+	if (txt->index)
+		txt->index->parent = NULL;
+}
+
 /* returns the piece holding the text at byte offset pos. If pos happens to
  * be at a piece boundary i.e. the first byte of a piece then the previous piece
  * to the left is returned with an offset of piece->len. This is convenient for
@@ -239,11 +1149,21 @@ static void piece_init(Piece *p, Piece *prev, Piece *next, const char *data, siz
  * in particular if pos is zero, the begin sentinel piece is returned.
  */
 static Location piece_get_intern(Text *txt, size_t pos) {
-	size_t cur = 0;
-	for (Piece *p = &txt->begin; p->next; p = p->next) {
-		if (cur <= pos && pos <= cur + p->len)
-			return (Location){ .piece = p, .off = pos - cur };
-		cur += p->len;
+	if (pos == 0)
+		return (Location){ .piece = &txt->begin, .off = 0 };
+	if (pos > txt->size)
+		return (Location){ 0 };
+
+	for (Piece *p = txt->index; p; ) {
+		size_t left = index_size(p->left);
+		if (pos <= left) {
+			p = p->left;
+		} else if (pos <= left + p->len) {
+			return (Location){ .piece = p, .off = pos - left };
+		} else {
+			pos -= left + p->len;
+			p = p->right;
+		}
 	}
 
 	return (Location){ 0 };
@@ -255,17 +1175,24 @@ static Location piece_get_intern(Text *txt, size_t pos) {
  * the last piece holding data is returned.
  */
 static Location piece_get_extern(const Text *txt, size_t pos) {
-	size_t cur = 0;
-	Piece *p;
-
-	for (p = txt->begin.next; p->next; p = p->next) {
-		if (cur <= pos && pos < cur + p->len)
-			return (Location){ .piece = p, .off = pos - cur };
-		cur += p->len;
+	if (pos > txt->size)
+		return (Location){ 0 };
+	if (pos == txt->size) {
+		Piece *p = txt->end.prev;
+		return (Location){ .piece = p, .off = p->len };
 	}
 
-	if (cur == pos)
-		return (Location){ .piece = p->prev, .off = p->prev->len };
+	for (Piece *p = txt->index; p; ) {
+		size_t left = index_size(p->left);
+		if (pos < left) {
+			p = p->left;
+		} else if (pos < left + p->len) {
+			return (Location){ .piece = p, .off = pos - left };
+		} else {
+			pos -= left + p->len;
+			p = p->right;
+		}
+	}
 
 	return (Location){ 0 };
 }
@@ -279,10 +1206,11 @@ static Change *change_alloc(Text *txt, size_t pos) {
 		if (!rev)
 			return NULL;
 	}
-	Change *c = calloc(1, sizeof *c);
+	Change *c = pool_alloc(&txt->changes);
 	if (!c)
 		return NULL;
 	c->pos = pos;
+	c->compacted = false;
 	c->next = rev->change;
 	if (rev->change)
 		rev->change->prev = c;
@@ -290,16 +1218,6 @@ static Change *change_alloc(Text *txt, size_t pos) {
 	return c;
 }
 
-static void change_free(Change *c) {
-	if (!c)
-		return;
-	/* only free the new part of the span, the old one is still in use */
-	if (c->new.start != c->new.end)
-		piece_free(c->new.end);
-	piece_free(c->new.start);
-	free(c);
-}
-
 /* When inserting new data there are 2 cases to consider.
  *
  *  - in the first the insertion point falls into the middle of an existing
@@ -338,6 +1256,10 @@ bool text_insert(Text *txt, size_t pos, const char *data, size_t len) {
 	if (!p)
 		return false;
 	size_t off = loc.off;
+	if (cache_insert(txt, p, off, data, len)) {
+		text_changed(txt, pos, 0, len);
+		return true;
+	}
 
 	Change *c = change_alloc(txt, pos);
 	if (!c)
@@ -354,6 +1276,8 @@ bool text_insert(Text *txt, size_t pos, const char *data, size_t len) {
 		if (!(new = piece_alloc(txt)))
 			return false;
 		piece_init(new, p, p->next, data, len);
+		piece_block(txt, new, array_length(&txt->blocks));
+		new->lines = lines_memcount(data, len);
 		span_init(&c->new, new, new);
 		span_init(&c->old, NULL, NULL);
 	} else {
@@ -370,12 +1294,20 @@ bool text_insert(Text *txt, size_t pos, const char *data, size_t len) {
 		piece_init(before, p->prev, new, p->data, off);
 		piece_init(new, before, after, data, len);
 		piece_init(after, new, p->next, p->data + off, p->len - off);
+		piece_block(txt, before, p->block);
+		piece_block(txt, new, array_length(&txt->blocks));
+		piece_block(txt, after, p->block);
+		piece_lines_sub(before, p);
+		new->lines = lines_memcount(data, len);
+		piece_lines_sub(after, p);
 
 		span_init(&c->new, before, after);
 		span_init(&c->old, p, p);
 	}
 
+	txt->cache = new;
 	span_swap(txt, &c->old, &c->new);
+	text_changed(txt, pos, 0, len);
 	return true;
 }
 
@@ -383,6 +1315,7 @@ static size_t revision_undo(Text *txt, Revision *rev) {
 	size_t pos = EPOS;
 	for (Change *c = rev->change; c; c = c->next) {
 		span_swap(txt, &c->new, &c->old);
+		change_swapped(txt, c, &c->new, &c->old);
 		pos = c->pos;
 	}
 	return pos;
@@ -395,6 +1328,7 @@ static size_t revision_redo(Text *txt, Revision *rev) {
 		c = c->next;
 	for ( ; c; c = c->prev) {
 		span_swap(txt, &c->old, &c->new);
+		change_swapped(txt, c, &c->old, &c->new);
 		pos = c->pos;
 		if (c->new.len > c->old.len)
 			pos += c->new.len - c->old.len;
@@ -445,7 +1379,7 @@ static size_t history_traverse_to(Text *txt, Revision *rev) {
 	bool changed = history_change_branch(rev);
 	if (!changed) {
 		if (rev->seq == txt->history->seq) {
-			return rev->change->pos;
+			return rev->change ? rev->change->pos : EPOS;
 		} else if (rev->seq > txt->history->seq) {
 			while (txt->history != rev)
 				pos = text_redo(txt);
@@ -466,15 +1400,20 @@ static size_t history_traverse_to(Text *txt, Revision *rev) {
 	return pos;
 }
 
+/* the snapshot is taken before determining the target revision, which could
+ * otherwise be discarded by the history pruning it triggers */
 size_t text_earlier(Text *txt) {
+	text_snapshot(txt);
 	return history_traverse_to(txt, txt->history->earlier);
 }
 
 size_t text_later(Text *txt) {
+	text_snapshot(txt);
 	return history_traverse_to(txt, txt->history->later);
 }
 
 size_t text_restore(Text *txt, time_t time) {
+	text_snapshot(txt);
 	Revision *rev = txt->history;
 	while (time < rev->time && rev->earlier)
 		rev = rev->earlier;
@@ -496,34 +1435,74 @@ Text *text_loadat_method(int dirfd, const char *filename, enum TextLoadMethod me
 	Text *txt = calloc(1, sizeof *txt);
 	if (!txt)
 		return NULL;
+	txt->seed = 2463534242;
+	txt->compact_seq = EPOS;
+	pool_init(&txt->pieces, sizeof(Piece));
+	pool_init(&txt->changes, sizeof(Change));
+	pool_init(&txt->revisions, sizeof(Revision));
 	Piece *p = piece_alloc(txt);
 	if (!p)
 		goto out;
 	Block *block = NULL;
+	bool restored = false;
 	array_init(&txt->blocks);
+	array_init_sized(&txt->shifts, sizeof(Shift));
 	if (filename) {
 		errno = 0;
-		block = block_load(dirfd, filename, method, &txt->info);
+		if ((block = journal_load(dirfd, filename, &txt->info)))
+			restored = true; /* the file content differs, it has to be saved again */
+		else
+			block = block_load(dirfd, filename, method, &txt->info);
 		if (!block && errno)
 			goto out;
 		if (block && !array_add_ptr(&txt->blocks, block)) {
 			block_free(block);
 			goto out;
 		}
+		if (block && block->type == BLOCK_TYPE_MALLOC && block->fd != -1) {
+			size_t max = MIN(LOAD_INITIAL_SIZE, (size_t)txt->info.st_size);
+			ssize_t len = block_read_more(block, max);
+			if (len == -1)
+				goto out;
+			txt->loading = block;
+			load_check(txt, max, len);
+		}
 	}
 
-	if (!block)
+	piece_init(&txt->begin, NULL, p, NULL, 0);
+	piece_init(&txt->end, p, NULL, NULL, 0);
+	if (!block) {
 		piece_init(p, &txt->begin, &txt->end, "\0", 0);
-	else
-		piece_init(p, &txt->begin, &txt->end, block->data, block->len);
+		p->lines = 0;
+	} else {
+		piece_init(p, &txt->begin, &txt->end, block->data, MIN(block->len, PIECE_SIZE));
+		piece_block(txt, p, 1);
+		p->lines = LINES_UNKNOWN;
+		for (size_t off = p->len; off < block->len; off += p->len) {
+			Piece *next = piece_alloc(txt);
+			if (!next)
+				goto out;
+			piece_init(next, p, &txt->end, block->data + off, MIN(block->len - off, PIECE_SIZE));
+			piece_block(txt, next, 1);
+			next->lines = LINES_UNKNOWN;
+			p->next = next;
+			txt->end.prev = next;
+			p = next;
+		}
+	}
 
-	piece_init(&txt->begin, NULL, p, NULL, 0);
-	piece_init(&txt->end, p, NULL, NULL, 0);
-	txt->size = p->len;
+	for (p = txt->begin.next; p != &txt->end; p = p->next) {
+		index_update(p);
+		txt->index = index_merge(txt->index, p);
+		txt->size += p->len;
+	}
+	txt->index->parent = NULL;
+	txt->append = txt->end.prev;
+	txt->loaded = txt->size;
 	/* write an empty revision */
 	change_alloc(txt, EPOS);
 	text_snapshot(txt);
-	txt->saved_revision = txt->history;
+	txt->saved_revision = restored ? NULL : txt->history;
 
 	return txt;
 out:
@@ -542,10 +1521,53 @@ void text_saved(Text *txt, struct stat *meta) {
 	text_snapshot(txt);
 }
 
-Block *text_block_mmaped(Text *txt) {
-	Block *block = array_get_ptr(&txt->blocks, 0);
-	if (block && block->type == BLOCK_TYPE_MMAP_ORIG && block->size)
-		return block;
+void text_advise(const Text *txt, size_t pos, size_t len, enum TextAdvice advice) {
+	TextChunk c;
+	for (bool ok = text_chunk_init(txt, &c, pos, len); ok; ok = text_chunk_next(&c)) {
+		Block *blk = text_block_mapped(txt, c.data);
+		if (blk)
+			block_advise(blk, c.data - blk->data, c.len, advice);
+	}
+}
+
+Block *text_block_mapped(const Text *txt, const char *data) {
+	for (size_t i = 0, n = array_length(&txt->blocks); i < n; i++) {
+		Block *blk = array_get_ptr(&txt->blocks, i);
+		if (blk && blk->type != BLOCK_TYPE_MALLOC &&
+		    blk->data <= data && data < blk->data + blk->size)
+			return blk;
+	}
+	return NULL;
+}
+
+static bool span_find(const Span *span, bool (*func)(void *context, const char *data, size_t len), void *context) {
+	for (Piece *p = span->start; p; p = p == span->end ? NULL : p->next) {
+		if (p->len && func(context, p->data, p->len))
+			return true;
+	}
+	return false;
+}
+
+bool text_pieces_find(const Text *txt, bool (*func)(void *context, const char *data, size_t len), void *context) {
+	for (Piece *p = txt->begin.next; p != &txt->end; p = p->next) {
+		if (func(context, p->data, p->len))
+			return true;
+	}
+	for (Revision *rev = txt->last_revision; rev; rev = rev->earlier) {
+		for (Change *c = rev->change; c; c = c->next) {
+			if (span_find(&c->old, func, context) || span_find(&c->new, func, context))
+				return true;
+		}
+	}
+	return false;
+}
+
+Block *text_block_mmaped(Text *txt, size_t *index) {
+	for (size_t len = array_length(&txt->blocks); *index < len; ) {
+		Block *block = array_get_ptr(&txt->blocks, (*index)++);
+		if (block && block->type == BLOCK_TYPE_MMAP_ORIG && block->size)
+			return block;
+	}
 	return NULL;
 }
 
@@ -563,9 +1585,12 @@ Block *text_block_mmaped(Text *txt) {
  *      | |     | exi|     |t |     | |
  *      \-+ <-- +----+ <-- +--+ <-- +-/
  */
-bool text_delete(Text *txt, size_t pos, size_t len) {
-	if (len == 0)
-		return true;
+/* Replace len > 0 bytes at pos by the given data, i.e. a deletion as described
+ * above immediately followed by an insertion, recorded as a single change.
+ * The new piece holding the inserted data (if any) is placed between the
+ * pieces before and after the deletion range.
+ */
+static bool text_replace(Text *txt, size_t pos, size_t len, const char *data, size_t size) {
 	size_t pos_end;
 	if (!addu(pos, len, &pos_end) || pos_end > txt->size)
 		return false;
@@ -575,10 +1600,20 @@ bool text_delete(Text *txt, size_t pos, size_t len) {
 	if (!p)
 		return false;
 	size_t off = loc.off;
+	if (size == 0 && cache_delete(txt, p, off, len)) {
+		text_changed(txt, pos, len, 0);
+		return true;
+	}
 	Change *c = change_alloc(txt, pos);
 	if (!c)
 		return false;
 
+	Piece *new = NULL;     /* piece holding the inserted data */
+	if (size > 0) {
+		if (!(data = block_store(txt, data, size)) || !(new = piece_alloc(txt)))
+			return false;
+	}
+
 	bool midway_start = false, midway_end = false; /* split pieces? */
 	Piece *before, *after; /* unmodified pieces before/after deletion point */
 	Piece *start, *end;    /* span which is removed */
@@ -616,22 +1651,35 @@ bool text_delete(Text *txt, size_t pos, size_t len) {
 		after = piece_alloc(txt);
 		if (!after)
 			return false;
-		piece_init(after, before, p->next, p->data + p->len - (cur - len), cur - len);
+		piece_init(after, new ? new : before, p->next, p->data + p->len - (cur - len), cur - len);
+		piece_block(txt, after, p->block);
+		piece_lines_sub(after, p);
 	}
 
 	if (midway_start) {
 		/* we finally know which piece follows our newly allocated before piece */
-		piece_init(before, start->prev, after, start->data, off);
+		piece_init(before, start->prev, new ? new : after, start->data, off);
+		piece_block(txt, before, start->block);
+		piece_lines_sub(before, start);
+	}
+
+	if (new) {
+		piece_init(new, before, after, data, size);
+		piece_block(txt, new, array_length(&txt->blocks));
+		new->lines = lines_memcount(data, size);
+		txt->cache = new;
 	}
 
 	Piece *new_start = NULL, *new_end = NULL;
-	if (midway_start) {
-		new_start = before;
-		if (!midway_end)
-			new_end = before;
+	if (midway_start)
+		new_start = new_end = before;
+	if (new) {
+		if (!new_start)
+			new_start = new;
+		new_end = new;
 	}
 	if (midway_end) {
-		if (!midway_start)
+		if (!new_start)
 			new_start = after;
 		new_end = after;
 	}
@@ -639,6 +1687,38 @@ bool text_delete(Text *txt, size_t pos, size_t len) {
 	span_init(&c->new, new_start, new_end);
 	span_init(&c->old, start, end);
 	span_swap(txt, &c->old, &c->new);
+	text_changed(txt, pos, len, size);
+	return true;
+}
+
+bool text_delete(Text *txt, size_t pos, size_t len) {
+	if (len == 0)
+		return true;
+	return text_replace(txt, pos, len, NULL, 0);
+}
+
+bool text_edit(Text *txt, const TextEdit *edits, size_t count, ptrdiff_t *deltas) {
+	size_t end = 0;
+	for (const TextEdit *e = edits; e < edits + count; e++) {
+		if (e->pos < end || !addu(e->pos, e->len, &end))
+			return false;
+	}
+	if (end > txt->size)
+		return false;
+
+	ptrdiff_t delta = 0;
+	for (size_t i = 0; i < count; i++) {
+		const TextEdit *e = &edits[i];
+		size_t pos = e->pos + delta;
+		bool ret = e->len == 0 ?
+			text_insert(txt, pos, e->data, e->size) :
+			text_replace(txt, pos, e->len, e->data, e->size);
+		if (!ret)
+			return false;
+		delta += (ptrdiff_t)e->size - (ptrdiff_t)e->len;
+		if (deltas)
+			deltas[i] = delta;
+	}
 	return true;
 }
 
@@ -651,9 +1731,16 @@ bool text_delete_range(Text *txt, const Filerange *r) {
 /* preserve the current text content such that it can be restored by
  * means of undo/redo operations */
 bool text_snapshot(Text *txt) {
-	if (txt->current_revision)
-		txt->last_revision = txt->current_revision;
+	Revision *rev = txt->current_revision;
 	txt->current_revision = NULL;
+	if (rev) {
+		txt->last_revision = rev;
+		rev->size = revision_size(rev);
+		txt->history_size += rev->size;
+		history_prune(txt);
+		if (txt->recovery)
+			recovery_snapshot(txt->recovery);
+	}
 	return true;
 }
 
@@ -662,28 +1749,677 @@ void text_free(Text *txt) {
 	if (!txt)
 		return;
 
-	// free history
-	Revision *hist = txt->history;
-	while (hist && hist->prev)
-		hist = hist->prev;
-	while (hist) {
-		Revision *later = hist->later;
-		revision_free(hist);
-		hist = later;
-	}
-
-	for (Piece *next, *p = txt->pieces; p; p = next) {
-		next = p->global_next;
-		piece_free(p);
-	}
+	recovery_close(txt->recovery, true);
+	pool_release(&txt->revisions);
+	pool_release(&txt->changes);
+	pool_release(&txt->pieces);
 
 	for (size_t i = 0, len = array_length(&txt->blocks); i < len; i++)
-		block_free(array_get_ptr(&txt->blocks, i));
+		block_unref(array_get_ptr(&txt->blocks, i));
 	array_release(&txt->blocks);
+	block_unref(txt->follow);
+	array_release(&txt->shifts);
 
 	free(txt);
 }
 
+/* A snapshot is a separate read only text instance with its own copy of the
+ * current piece chain. The pieces refer to the same (reference counted) blocks
+ * as the original text. Data is never modified once it is referenced by
+ * a piece, with the exception of the cache which coalesces consecutive
+ * modifications in place. It is hence disabled for all existing pieces.
+ */
+const Text *text_snapshot_acquire(Text *txt) {
+	Text *snap = calloc(1, sizeof *snap);
+	if (!snap)
+		return NULL;
+	snap->seed = txt->seed;
+	snap->info = txt->info;
+	snap->origin = txt->current_revision || !txt->history ? EPOS : txt->history->seq;
+	pool_init(&snap->pieces, sizeof(Piece));
+	pool_init(&snap->changes, sizeof(Change));
+	pool_init(&snap->revisions, sizeof(Revision));
+	array_init(&snap->blocks);
+	array_init_sized(&snap->shifts, sizeof(Shift));
+
+	for (size_t i = 0, len = array_length(&txt->blocks); i < len; i++) {
+		Block *blk = array_get_ptr(&txt->blocks, i);
+		if (!blk)
+			continue;
+		if (!array_add_ptr(&snap->blocks, blk))
+			goto err;
+		blk->refs++;
+	}
+
+	Piece *prev = &snap->begin;
+	piece_init(&snap->begin, NULL, &snap->end, NULL, 0);
+	piece_init(&snap->end, &snap->begin, NULL, NULL, 0);
+	for (Piece *p = txt->begin.next; p != &txt->end; p = p->next) {
+		Piece *copy = piece_alloc(snap);
+		if (!copy)
+			goto err;
+		piece_init(copy, prev, &snap->end, p->data, p->len);
+		copy->lines = p->lines;
+		prev->next = copy;
+		snap->end.prev = copy;
+		prev = copy;
+		index_update(copy);
+		snap->index = index_merge(snap->index, copy);
+		snap->size += copy->len;
+	}
+	if (snap->index)
+		snap->index->parent = NULL;
+	/* an empty revision, for the sake of the history related queries */
+	if (!change_alloc(snap, EPOS))
+		goto err;
+	text_snapshot(snap);
+	snap->saved_revision = snap->history;
+	txt->cache = NULL;
+	return snap;
+err:
+	text_free(snap);
+	return NULL;
+}
+
+void text_snapshot_release(const Text *snap) {
+	text_free((Text*)snap);
+}
+
+void text_snapshot_saved(Text *txt, const Text *snap) {
+	txt->info = snap->info;
+	txt->saved_revision = NULL;
+	for (Revision *rev = txt->last_revision; rev && snap->origin != EPOS && rev->seq >= snap->origin; rev = rev->earlier) {
+		if (rev->seq == snap->origin)
+			txt->saved_revision = rev;
+	}
+}
+
+bool text_recovery_start(Text *txt, const char *filename) {
+	if (txt->recovery)
+		return true;
+	if (txt->loading) {
+		errno = EBUSY;
+		return false;
+	}
+	struct stat meta;
+	if (stat(filename, &meta) == -1)
+		return false;
+	if (!(txt->recovery = recovery_create(filename, &meta)))
+		return false;
+	/* the journal is relative to the file on disk */
+	bool same = meta.st_ino == txt->info.st_ino && meta.st_size == txt->info.st_size &&
+	            meta.st_mtime == txt->info.st_mtime;
+	if (!same || text_modified(txt) || txt->current_revision)
+		recovery_change(txt->recovery, txt, 0, meta.st_size, txt->size);
+	return text_recovery_sync(txt);
+}
+
+bool text_recovery_reset(Text *txt) {
+	if (!txt->recovery)
+		return true;
+	if (!recovery_reset(txt->recovery, &txt->info))
+		return false;
+	/* changes performed while the file was being saved */
+	if (text_modified(txt) || txt->current_revision)
+		recovery_change(txt->recovery, txt, 0, txt->info.st_size, txt->size);
+	return text_recovery_sync(txt);
+}
+
+bool text_recovery_sync(Text *txt) {
+	return !txt->recovery || recovery_sync(txt->recovery);
+}
+
+void text_recovery_stop(Text *txt) {
+	recovery_close(txt->recovery, true);
+	txt->recovery = NULL;
+}
+
+bool text_recover(Text *txt, const char *filename, bool force) {
+	if (txt->recovery || txt->loading || text_modified(txt)) {
+		errno = EBUSY;
+		return false;
+	}
+	txt->recovery = recovery_replay(txt, filename, force);
+	return txt->recovery != NULL;
+}
+
+/* A session file `.filename.vis.session` preserves a text together with its
+ * undo history. Following a header identifying the file, it holds arrays of
+ * fixed size records for all blocks, pieces, changes and revisions in which
+ * pointers are replaced by references: 0 stands for NULL, otherwise index + 1
+ * into the respective array. Piece references additionally reserve 1 and 2
+ * for the begin and end sentinels, hence piece i is referred to as i + 3.
+ *
+ * Block data still present in the file on disk is referenced by its offset,
+ * all other data is stored in the session itself, aligned such that it can
+ * be mmap(2)-ed in place. Restoring a session thus only translates the
+ * records in a linear pass, its cost is independent of the amount of data.
+ */
+typedef struct {
+	char magic[8];             /* SESSION_MAGIC, written last */
+	uint32_t layout[4];        /* record sizes, guarding against format changes */
+	uint64_t dev, ino, size;   /* identity of the file */
+	int64_t mtime;
+	uint64_t blocks, pieces, changes, revisions; /* number of records */
+	uint64_t first, last;      /* pieces linked to the begin and end sentinels */
+	uint64_t history, saved, first_revision, last_revision;
+	uint64_t seq, history_size;
+	uint64_t compact_pos, compact_seq;
+} SessionHeader;
+
+typedef struct {
+	uint64_t offset;           /* of the data within the file or session */
+	uint64_t len;              /* number of bytes referenced by pieces */
+	uint64_t type;             /* SESSION_BLOCK_* */
+} SessionBlock;
+
+typedef struct {
+	uint64_t prev, next;
+	uint64_t block;            /* index + 1 of the block holding the data, 0 if none */
+	uint64_t off, len;         /* location of the data within the block */
+	uint64_t lines;
+} SessionPiece;
+
+typedef struct {
+	uint64_t old_start, old_end, old_len;
+	uint64_t new_start, new_end, new_len;
+	uint64_t pos, next, prev;
+	uint64_t compacted;
+} SessionChange;
+
+typedef struct {
+	uint64_t change, next, prev, earlier, later;
+	int64_t time;
+	uint64_t seq, size, children;
+} SessionRevision;
+
+enum {
+	SESSION_BLOCK_NONE,        /* released block */
+	SESSION_BLOCK_FILE,        /* data at offset within the file */
+	SESSION_BLOCK_DATA,        /* data at offset within the session */
+};
+
+#define SESSION_MAGIC "vissess1"
+#define SESSION_SUFFIX ".vis.session"
+/* Block data offsets are a multiple of the largest common page size */
+#define SESSION_ALIGN (1 << 16)
+#define SESSION_PIECE_BEGIN 1
+#define SESSION_PIECE_END 2
+
+static const uint32_t session_layout[4] = {
+	sizeof(SessionBlock), sizeof(SessionPiece), sizeof(SessionChange), sizeof(SessionRevision),
+};
+
+static int session_cmp(const void *a, const void *b) {
+	uintptr_t x = (uintptr_t)*(void* const*)a, y = (uintptr_t)*(void* const*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* reference to an object of the sorted pointer array, 0 if it is not part of it */
+static uint64_t session_ref(const Array *objs, const void *obj) {
+	size_t len = array_length(objs);
+	if (!obj || !len)
+		return 0;
+	void **base = array_get(objs, 0);
+	void **found = bsearch(&obj, base, len, sizeof obj, session_cmp);
+	return found ? (uint64_t)(found - base) + 1 : 0;
+}
+
+/* Pointers of pieces which are no longer reachable by any undo/redo operation
+ * might be stale, they are never followed and stored as NULL. */
+static uint64_t session_piece_ref(const Text *txt, const Array *pieces, const Piece *p) {
+	if (p == &txt->begin)
+		return SESSION_PIECE_BEGIN;
+	if (p == &txt->end)
+		return SESSION_PIECE_END;
+	uint64_t ref = session_ref(pieces, p);
+	return ref ? ref + SESSION_PIECE_END : 0;
+}
+
+static bool session_span_add(Array *pieces, const Span *span) {
+	for (Piece *p = span->start; p; p = p == span->end ? NULL : p->next) {
+		if (!array_add_ptr(pieces, p))
+			return false;
+	}
+	return true;
+}
+
+static size_t session_align(size_t offset) {
+	return (offset + SESSION_ALIGN - 1) & ~(size_t)(SESSION_ALIGN - 1);
+}
+
+bool text_session_save(Text *txt, const char *filename) {
+	if (txt->loading) {
+		errno = EBUSY;
+		return false;
+	}
+	text_snapshot(txt);
+
+	bool success = false;
+	int fd = -1;
+	char *name = NULL, *tmpname = NULL, *records = NULL;
+	size_t *used = NULL;
+	Array pieces, changes, revisions;
+	array_init(&pieces);
+	array_init(&changes);
+	array_init(&revisions);
+
+	struct stat meta;
+	if (stat(filename, &meta) == -1)
+		goto out;
+
+	/* collect all pieces of the document and the undo history */
+	for (Piece *p = txt->begin.next; p != &txt->end; p = p->next) {
+		if (!array_add_ptr(&pieces, p))
+			goto out;
+	}
+	for (Revision *rev = txt->last_revision; rev; rev = rev->earlier) {
+		if (!array_add_ptr(&revisions, rev))
+			goto out;
+		for (Change *c = rev->change; c; c = c->next) {
+			if (!array_add_ptr(&changes, c) ||
+			    !session_span_add(&pieces, &c->old) || !session_span_add(&pieces, &c->new))
+				goto out;
+		}
+	}
+	array_sort(&pieces, session_cmp);
+	array_sort(&changes, session_cmp);
+	array_sort(&revisions, session_cmp);
+	size_t npieces = 0;
+	for (size_t i = 0, len = array_length(&pieces); i < len; i++) {
+		Piece *p = array_get_ptr(&pieces, i);
+		if (npieces == 0 || array_get_ptr(&pieces, npieces-1) != p)
+			array_set_ptr(&pieces, npieces++, p);
+	}
+	array_truncate(&pieces, npieces);
+
+	size_t nblocks = array_length(&txt->blocks);
+	size_t nchanges = array_length(&changes);
+	size_t nrevisions = array_length(&revisions);
+	if (!(used = calloc(nblocks + 1, sizeof *used)))
+		goto out;
+	for (size_t i = 0; i < npieces; i++) {
+		Piece *p = array_get_ptr(&pieces, i);
+		if (!p->block) {
+			if (p->len) {
+				errno = EINVAL;
+				goto out;
+			}
+			continue;
+		}
+		Block *blk = array_get_ptr(&txt->blocks, p->block - 1);
+		used[p->block - 1] = MAX(used[p->block - 1], (size_t)(p->data + p->len - blk->data));
+	}
+
+	size_t size = sizeof(SessionHeader) + nblocks * sizeof(SessionBlock) +
+	              npieces * sizeof(SessionPiece) + nchanges * sizeof(SessionChange) +
+	              nrevisions * sizeof(SessionRevision);
+	if (!(records = calloc(1, size)))
+		goto out;
+	SessionHeader *header = (SessionHeader*)records;
+	SessionBlock *sblocks = (SessionBlock*)(header + 1);
+	SessionPiece *spieces = (SessionPiece*)(sblocks + nblocks);
+	SessionChange *schanges = (SessionChange*)(spieces + npieces);
+	SessionRevision *srevisions = (SessionRevision*)(schanges + nchanges);
+
+	size_t offset = session_align(size);
+	for (size_t i = 0; i < nblocks; i++) {
+		Block *blk = array_get_ptr(&txt->blocks, i);
+		SessionBlock *sb = &sblocks[i];
+		struct stat info;
+		if (!blk || !used[i]) {
+			sb->type = SESSION_BLOCK_NONE;
+		} else if (blk->type == BLOCK_TYPE_MMAP_ORIG && blk->fd != -1 && fstat(blk->fd, &info) == 0 &&
+		           info.st_dev == meta.st_dev && info.st_ino == meta.st_ino &&
+		           blk->offset + used[i] <= (size_t)meta.st_size) {
+			sb->type = SESSION_BLOCK_FILE;
+			sb->offset = blk->offset;
+			sb->len = used[i];
+		} else {
+			sb->type = SESSION_BLOCK_DATA;
+			sb->offset = offset;
+			sb->len = used[i];
+			offset = session_align(offset + used[i]);
+		}
+	}
+
+	for (size_t i = 0; i < npieces; i++) {
+		Piece *p = array_get_ptr(&pieces, i);
+		SessionPiece *sp = &spieces[i];
+		sp->prev = session_piece_ref(txt, &pieces, p->prev);
+		sp->next = session_piece_ref(txt, &pieces, p->next);
+		sp->block = p->block;
+		if (p->block) {
+			Block *blk = array_get_ptr(&txt->blocks, p->block - 1);
+			sp->off = p->data - blk->data;
+		}
+		sp->len = p->len;
+		sp->lines = p->lines;
+	}
+
+	for (size_t i = 0; i < nchanges; i++) {
+		Change *c = array_get_ptr(&changes, i);
+		schanges[i] = (SessionChange){
+			.old_start = session_piece_ref(txt, &pieces, c->old.start),
+			.old_end = session_piece_ref(txt, &pieces, c->old.end),
+			.old_len = c->old.len,
+			.new_start = session_piece_ref(txt, &pieces, c->new.start),
+			.new_end = session_piece_ref(txt, &pieces, c->new.end),
+			.new_len = c->new.len,
+			.pos = c->pos,
+			.compacted = c->compacted,
+			.next = session_ref(&changes, c->next),
+			.prev = session_ref(&changes, c->prev),
+		};
+	}
+
+	for (size_t i = 0; i < nrevisions; i++) {
+		Revision *rev = array_get_ptr(&revisions, i);
+		srevisions[i] = (SessionRevision){
+			.change = session_ref(&changes, rev->change),
+			.next = session_ref(&revisions, rev->next),
+			.prev = session_ref(&revisions, rev->prev),
+			.earlier = session_ref(&revisions, rev->earlier),
+			.later = session_ref(&revisions, rev->later),
+			.time = rev->time,
+			.seq = rev->seq,
+			.size = rev->size,
+			.children = rev->children,
+		};
+	}
+
+	*header = (SessionHeader){
+		.dev = meta.st_dev,
+		.ino = meta.st_ino,
+		.size = meta.st_size,
+		.mtime = meta.st_mtime,
+		.blocks = nblocks,
+		.pieces = npieces,
+		.changes = nchanges,
+		.revisions = nrevisions,
+		.first = session_piece_ref(txt, &pieces, txt->begin.next),
+		.last = session_piece_ref(txt, &pieces, txt->end.prev),
+		.history = session_ref(&revisions, txt->history),
+		.saved = session_ref(&revisions, txt->saved_revision),
+		.first_revision = session_ref(&revisions, txt->first_revision),
+		.last_revision = session_ref(&revisions, txt->last_revision),
+		.seq = txt->seq,
+		.history_size = txt->history_size,
+		.compact_pos = txt->compact_pos,
+		.compact_seq = txt->compact_seq,
+	};
+	memcpy(header->layout, session_layout, sizeof header->layout);
+
+	/* the new session replaces the old one which might still be mapped */
+	if (!(name = sidecar_name(filename, SESSION_SUFFIX)))
+		goto out;
+	size_t len = strlen(name) + sizeof(".tmp");
+	if (!(tmpname = malloc(len)))
+		goto out;
+	snprintf(tmpname, len, "%s.tmp", name);
+	if ((fd = open(tmpname, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC, 0600)) == -1)
+		goto out;
+	for (size_t i = 0; i < nblocks; i++) {
+		Block *blk = array_get_ptr(&txt->blocks, i);
+		SessionBlock *sb = &sblocks[i];
+		if (sb->type == SESSION_BLOCK_DATA && (lseek(fd, sb->offset, SEEK_SET) == -1 ||
+		    write_all(fd, blk->data, sb->len) != (ssize_t)sb->len))
+			goto out;
+	}
+	memcpy(header->magic, SESSION_MAGIC, sizeof header->magic);
+	if (pwrite(fd, records, size, 0) != (ssize_t)size || fsync(fd) == -1)
+		goto out;
+	success = close(fd) == 0 && rename(tmpname, name) == 0;
+	fd = -1;
+out:;
+	int saved_errno = errno;
+	if (fd != -1)
+		close(fd);
+	if (!success && tmpname)
+		unlink(tmpname);
+	free(tmpname);
+	free(name);
+	free(records);
+	free(used);
+	array_release(&pieces);
+	array_release(&changes);
+	array_release(&revisions);
+	errno = saved_errno;
+	return success;
+}
+
+/* resolve a reference to one of count objects */
+static bool session_deref(void **objs, uint64_t count, uint64_t ref, void **obj) {
+	if (ref > count)
+		return false;
+	*obj = ref ? objs[ref-1] : NULL;
+	return true;
+}
+
+static bool session_piece(Text *txt, void **pieces, uint64_t count, uint64_t ref, Piece **p) {
+	void *obj;
+	if (ref == SESSION_PIECE_BEGIN)
+		obj = &txt->begin;
+	else if (ref == SESSION_PIECE_END)
+		obj = &txt->end;
+	else if (!session_deref(pieces, count, ref ? ref - SESSION_PIECE_END : 0, &obj))
+		return false;
+	*p = obj;
+	return true;
+}
+
+Text *text_session_load(const char *filename) {
+	Text *txt = NULL;
+	void **objs = NULL;
+	char *data = MAP_FAILED;
+	size_t size = 0;
+	int fd = -1, filefd = -1;
+	char *name = sidecar_name(filename, SESSION_SUFFIX);
+	if (!name)
+		goto err;
+	struct stat meta, info;
+	if ((fd = open(name, O_RDONLY|O_CLOEXEC)) == -1 || fstat(fd, &meta) == -1)
+		goto err;
+	size = meta.st_size;
+	if (size < sizeof(SessionHeader)) {
+		errno = EINVAL;
+		goto err;
+	}
+	if ((data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		goto err;
+
+	const SessionHeader *header = (const SessionHeader*)data;
+	size_t rem = size - sizeof *header;
+	uint64_t counts[] = { header->blocks, header->pieces, header->changes, header->revisions };
+	errno = EINVAL;
+	if (memcmp(header->magic, SESSION_MAGIC, sizeof header->magic) ||
+	    memcmp(header->layout, session_layout, sizeof header->layout))
+		goto err;
+	for (int i = 0; i < LENGTH(counts); i++) {
+		if (counts[i] > rem / session_layout[i])
+			goto err;
+		rem -= counts[i] * session_layout[i];
+	}
+	const SessionBlock *sblocks = (const SessionBlock*)(header + 1);
+	const SessionPiece *spieces = (const SessionPiece*)(sblocks + header->blocks);
+	const SessionChange *schanges = (const SessionChange*)(spieces + header->pieces);
+	const SessionRevision *srevisions = (const SessionRevision*)(schanges + header->changes);
+
+	if ((filefd = open(filename, O_RDONLY|O_CLOEXEC)) == -1 || fstat(filefd, &info) == -1)
+		goto err;
+	if (header->dev != (uint64_t)info.st_dev || header->ino != (uint64_t)info.st_ino ||
+	    header->size != (uint64_t)info.st_size || header->mtime != (int64_t)info.st_mtime) {
+		errno = ESTALE;
+		goto err;
+	}
+
+	if (!(txt = calloc(1, sizeof *txt)))
+		goto err;
+	txt->seed = 2463534242;
+	txt->compact_seq = EPOS;
+	txt->info = info;
+	pool_init(&txt->pieces, sizeof(Piece));
+	pool_init(&txt->changes, sizeof(Change));
+	pool_init(&txt->revisions, sizeof(Revision));
+	array_init(&txt->blocks);
+	array_init_sized(&txt->shifts, sizeof(Shift));
+	piece_init(&txt->begin, NULL, &txt->end, NULL, 0);
+	piece_init(&txt->end, &txt->begin, NULL, NULL, 0);
+
+	for (size_t i = 0; i < header->blocks; i++) {
+		const SessionBlock *sb = &sblocks[i];
+		Block *blk = NULL;
+		if (sb->type != SESSION_BLOCK_NONE) {
+			bool file = sb->type == SESSION_BLOCK_FILE;
+			size_t max = file ? (size_t)info.st_size : size;
+			errno = EINVAL;
+			if ((!file && sb->type != SESSION_BLOCK_DATA) || sb->offset > max || sb->len > max - sb->offset)
+				goto err;
+			int blkfd = dup(file ? filefd : fd);
+			if (blkfd == -1)
+				goto err;
+			if (!(blk = block_mmap(sb->len, blkfd, sb->offset))) {
+				close(blkfd);
+				goto err;
+			}
+			if (!file)
+				blk->type = BLOCK_TYPE_MMAP;
+		}
+		if (!array_add_ptr(&txt->blocks, blk)) {
+			block_free(blk);
+			goto err;
+		}
+	}
+
+	size_t npieces = header->pieces, nchanges = header->changes, nrevisions = header->revisions;
+	if (!(objs = calloc(npieces + nchanges + nrevisions + 1, sizeof *objs)))
+		goto err;
+	void **pieces = objs, **changes = objs + npieces, **revisions = changes + nchanges;
+	for (size_t i = 0; i < npieces; i++) {
+		if (!(pieces[i] = piece_alloc(txt)))
+			goto err;
+	}
+	for (size_t i = 0; i < nchanges; i++) {
+		if (!(changes[i] = pool_alloc(&txt->changes)))
+			goto err;
+	}
+	for (size_t i = 0; i < nrevisions; i++) {
+		if (!(revisions[i] = pool_alloc(&txt->revisions)))
+			goto err;
+	}
+
+	errno = EINVAL;
+	for (size_t i = 0; i < npieces; i++) {
+		const SessionPiece *sp = &spieces[i];
+		Piece *p = pieces[i];
+		Block *blk = sp->block && sp->block <= header->blocks ?
+		             array_get_ptr(&txt->blocks, sp->block - 1) : NULL;
+		if (!session_piece(txt, pieces, npieces, sp->prev, &p->prev) ||
+		    !session_piece(txt, pieces, npieces, sp->next, &p->next))
+			goto err;
+		if (blk && sp->off <= blk->len && sp->len <= blk->len - sp->off)
+			p->data = blk->data + sp->off;
+		else if (!sp->block && !sp->len)
+			p->data = "\0";
+		else
+			goto err;
+		p->len = sp->len;
+		p->lines = sp->lines;
+		piece_block(txt, p, sp->block);
+	}
+
+	for (size_t i = 0; i < nchanges; i++) {
+		const SessionChange *sc = &schanges[i];
+		Change *c = changes[i];
+		void *next, *prev;
+		if (!session_piece(txt, pieces, npieces, sc->old_start, &c->old.start) ||
+		    !session_piece(txt, pieces, npieces, sc->old_end, &c->old.end) ||
+		    !session_piece(txt, pieces, npieces, sc->new_start, &c->new.start) ||
+		    !session_piece(txt, pieces, npieces, sc->new_end, &c->new.end) ||
+		    !session_deref(changes, nchanges, sc->next, &next) ||
+		    !session_deref(changes, nchanges, sc->prev, &prev))
+			goto err;
+		c->old.len = sc->old_len;
+		c->new.len = sc->new_len;
+		c->pos = sc->pos;
+		c->compacted = sc->compacted;
+		c->next = next;
+		c->prev = prev;
+	}
+
+	for (size_t i = 0; i < nrevisions; i++) {
+		const SessionRevision *sr = &srevisions[i];
+		Revision *rev = revisions[i];
+		void *change, *next, *prev, *earlier, *later;
+		if (!session_deref(changes, nchanges, sr->change, &change) ||
+		    !session_deref(revisions, nrevisions, sr->next, &next) ||
+		    !session_deref(revisions, nrevisions, sr->prev, &prev) ||
+		    !session_deref(revisions, nrevisions, sr->earlier, &earlier) ||
+		    !session_deref(revisions, nrevisions, sr->later, &later))
+			goto err;
+		rev->change = change;
+		rev->next = next;
+		rev->prev = prev;
+		rev->earlier = earlier;
+		rev->later = later;
+		rev->time = sr->time;
+		rev->seq = sr->seq;
+		rev->size = sr->size;
+		rev->children = sr->children;
+	}
+
+	void *history, *saved, *first, *last;
+	if (!session_piece(txt, pieces, npieces, header->first, &txt->begin.next) ||
+	    !session_piece(txt, pieces, npieces, header->last, &txt->end.prev) ||
+	    !session_deref(revisions, nrevisions, header->history, &history) ||
+	    !session_deref(revisions, nrevisions, header->saved, &saved) ||
+	    !session_deref(revisions, nrevisions, header->first_revision, &first) ||
+	    !session_deref(revisions, nrevisions, header->last_revision, &last) ||
+	    !history || !first || !last)
+		goto err;
+	txt->history = history;
+	txt->saved_revision = saved;
+	txt->first_revision = first;
+	txt->last_revision = last;
+	txt->seq = header->seq;
+	txt->revision_count = nrevisions;
+	txt->history_size = header->history_size;
+	txt->compact_pos = header->compact_pos;
+	txt->compact_seq = header->compact_seq;
+
+	size_t count = 0;
+	for (Piece *p = txt->begin.next; p != &txt->end; p = p->next) {
+		if (!p || p == &txt->begin || count++ == npieces)
+			goto err;
+		index_update(p);
+		txt->index = index_merge(txt->index, p);
+		txt->size += p->len;
+	}
+	if (txt->index)
+		txt->index->parent = NULL;
+	txt->loaded = txt->size;
+
+	munmap(data, size);
+	close(fd);
+	close(filefd);
+	free(objs);
+	free(name);
+	return txt;
+err:;
+	int saved_errno = errno;
+	if (data != MAP_FAILED)
+		munmap(data, size);
+	if (fd != -1)
+		close(fd);
+	if (filefd != -1)
+		close(filefd);
+	free(objs);
+	free(name);
+	text_free(txt);
+	errno = saved_errno;
+	return NULL;
+}
+
 bool text_modified(const Text *txt) {
 	return txt->saved_revision != txt->history;
 }
@@ -692,15 +2428,16 @@ bool text_mmaped(const Text *txt, const char *ptr) {
 	uintptr_t addr = (uintptr_t)ptr;
 	for (size_t i = 0, len = array_length(&txt->blocks); i < len; i++) {
 		Block *blk = array_get_ptr(&txt->blocks, i);
-		if ((blk->type == BLOCK_TYPE_MMAP_ORIG || blk->type == BLOCK_TYPE_MMAP) &&
+		if (blk && (blk->type == BLOCK_TYPE_MMAP_ORIG || blk->type == BLOCK_TYPE_MMAP) &&
 		    (uintptr_t)(blk->data) <= addr && addr < (uintptr_t)(blk->data + blk->size))
 			return true;
 	}
 	return false;
 }
 
-static bool iterator_init(Iterator *it, size_t pos, Piece *p, size_t off) {
+static bool iterator_init(Iterator *it, const Text *txt, size_t pos, Piece *p, size_t off) {
 	*it = (Iterator){
+		.txt = txt,
 		.pos = pos,
 		.piece = p,
 		.start = p ? p->data : NULL,
@@ -712,7 +2449,7 @@ static bool iterator_init(Iterator *it, size_t pos, Piece *p, size_t off) {
 
 bool text_iterator_init(const Text *txt, Iterator *it, size_t pos) {
 	Location loc = piece_get_extern(txt, pos);
-	return iterator_init(it, pos, loc.piece, loc.off);
+	return iterator_init(it, txt, pos, loc.piece, loc.off);
 }
 
 Iterator text_iterator_get(const Text *txt, size_t pos) {
@@ -723,22 +2460,22 @@ Iterator text_iterator_get(const Text *txt, size_t pos) {
 
 bool text_iterator_next(Iterator *it) {
 	size_t rem = it->end - it->text;
-	return iterator_init(it, it->pos+rem, it->piece ? it->piece->next : NULL, 0);
+	return iterator_init(it, it->txt, it->pos+rem, it->piece ? it->piece->next : NULL, 0);
 }
 
 bool text_iterator_prev(Iterator *it) {
 	size_t off = it->text - it->start;
 	size_t len = it->piece && it->piece->prev ? it->piece->prev->len : 0;
-	return iterator_init(it, it->pos-off, it->piece ? it->piece->prev : NULL, len);
+	return iterator_init(it, it->txt, it->pos-off, it->piece ? it->piece->prev : NULL, len);
 }
 
 const Text *text_iterator_text(const Iterator *it) {
-	return it->piece ? it->piece->text : NULL;
+	return it->piece ? it->txt : NULL;
 }
 
 bool text_iterator_valid(const Iterator *it) {
 	/* filter out sentinel nodes */
-	return it->piece && it->piece->text;
+	return it->piece && it->piece->data;
 }
 
 bool text_iterator_has_next(const Iterator *it) {
@@ -753,213 +2490,137 @@ size_t text_size(const Text *txt) {
 	return txt->size;
 }
 
-/* count the number of new lines '\n' in range [pos, pos+len) */
-static size_t lines_count(Text *txt, size_t pos, size_t len) {
-	size_t lines = 0;
-	for (Iterator it = text_iterator_get(txt, pos);
-	     text_iterator_valid(&it);
-	     text_iterator_next(&it)) {
-		const char *start = it.text;
-		while (len > 0 && start < it.end) {
-			size_t n = MIN(len, (size_t)(it.end - start));
-			const char *end = memchr(start, '\n', n);
-			if (!end) {
-				len -= n;
-				break;
-			}
-			lines++;
-			len -= end - start + 1;
-			start = end + 1;
-		}
+size_t text_pieces(const Text *txt) {
+	return index_count(txt->index);
+}
 
-		if (len == 0)
-			break;
+/* compute the newline count of a piece, if it is not yet known */
+static void piece_lines(Piece *p) {
+	if (p->lines == LINES_UNKNOWN)
+		p->lines = lines_memcount(p->data, p->len);
+}
+
+/* derive the newline count of piece p referencing either a prefix or suffix
+ * of piece orig. Only the shorter of p and its complement is scanned. */
+static void piece_lines_sub(Piece *p, const Piece *orig) {
+	if (orig->lines == LINES_UNKNOWN) {
+		p->lines = LINES_UNKNOWN;
+	} else if (2 * p->len <= orig->len) {
+		p->lines = lines_memcount(p->data, p->len);
+	} else {
+		size_t len = orig->len - p->len;
+		const char *data = p->data == orig->data ? orig->data + p->len : orig->data;
+		p->lines = orig->lines - lines_memcount(data, len);
 	}
-	return lines;
 }
 
-/* skip n lines forward and return position afterwards */
-static size_t lines_skip_forward(Text *txt, size_t pos, size_t lines, size_t *lines_skipped) {
-	size_t lines_old = lines;
-	for (Iterator it = text_iterator_get(txt, pos);
-	     text_iterator_valid(&it);
-	     text_iterator_next(&it)) {
-		const char *start = it.text;
-		while (lines > 0 && start < it.end) {
-			size_t n = it.end - start;
-			const char *end = memchr(start, '\n', n);
-			if (!end) {
-				pos += n;
-				break;
-			}
-			pos += end - start + 1;
-			start = end + 1;
-			lines--;
+/* count the number of newlines in [0, pos) of the subtree rooted at p,
+ * pieces with so far unknown counts are resolved along the way */
+static size_t lines_count(Piece *p, size_t pos) {
+	if (!p || pos == 0)
+		return 0;
+	if (!p->unknown && pos >= p->size)
+		return p->subtree_lines;
+	size_t lines, left = index_size(p->left);
+	if (pos <= left) {
+		lines = lines_count(p->left, pos);
+	} else {
+		size_t off = pos - left;
+		lines = lines_count(p->left, left);
+		if (off >= p->len) {
+			piece_lines(p);
+			lines += p->lines + lines_count(p->right, off - p->len);
+		} else if (p->lines != LINES_UNKNOWN && 2 * off > p->len) {
+			lines += p->lines - lines_memcount(p->data + off, p->len - off);
+		} else {
+			lines += lines_memcount(p->data, off);
 		}
+	}
+	index_update(p);
+	return lines;
+}
 
-		if (lines == 0)
-			break;
+/* advance pos past the given number of newlines within the subtree rooted
+ * at p, returns whether the last of them was found */
+static bool lines_skip(Piece *p, size_t *lines, size_t *pos) {
+	if (!p)
+		return false;
+	if (!p->unknown && p->subtree_lines < *lines) {
+		*lines -= p->subtree_lines;
+		*pos += p->size;
+		return false;
 	}
-	if (lines_skipped)
-		*lines_skipped = lines_old - lines;
-	return pos;
+	bool found = lines_skip(p->left, lines, pos);
+	if (!found) {
+		piece_lines(p);
+		if (*lines <= p->lines) {
+			const char *cur = p->data;
+			for (; *lines > 0; (*lines)--)
+				cur = (const char*)memchr(cur, '\n', p->data + p->len - cur) + 1;
+			*pos += cur - p->data;
+			found = true;
+		} else {
+			*lines -= p->lines;
+			*pos += p->len;
+			found = lines_skip(p->right, lines, pos);
+		}
+	}
+	index_update(p);
+	return found;
 }
 
 size_t text_pos_by_lineno(Text *txt, size_t lineno) {
-	size_t lines_skipped;
+	size_t pos = 0, lines = lineno - 1;
 	if (lineno <= 1)
 		return 0;
-	return lines_skip_forward(txt, 0, lineno - 1, &lines_skipped);
+	lines_skip(txt->index, &lines, &pos);
+	return pos;
 }
 
 size_t text_lineno_by_pos(Text *txt, size_t pos) {
-	return lines_count(txt, 0, pos) + 1;
+	return lines_count(txt->index, MIN(pos, txt->size)) + 1;
 }
 
 Mark text_mark_set(Text *txt, size_t pos) {
-	Mark mark = ((Mark){
-		.loc = pos == txt->size ?
-			((Location) {
-				.piece = &txt->end,
-				.off = 0,
-			}) :
-			piece_get_extern(txt, pos),
-		.rev = txt->history,
-	});
-	if (!mark.loc.piece)
+	if (pos > txt->size)
 		return EMARK;
-	return mark;
+	return (Mark){
+		.pos = pos,
+		.gen = txt->shifts_base + array_length(&txt->shifts),
+	};
 }
 
 size_t text_mark_get(const Text *txt, Mark mark) {
-	size_t cur = 0;
-
-	if (IS_EMARK(mark))
+	if (IS_EMARK(mark) || mark.gen < txt->shifts_base)
 		return EPOS;
-	if (mark.loc.piece == &txt->end)
-		return txt->size;
-
-	Piece *mp = mark.loc.piece;
-	size_t off = mark.loc.off;
-
-	Revision *r = mark.rev, *tr = txt->history;
-	Change *c;
-
-	bool b = r->seq > tr->seq; // backwards
-	// if b is true
-	// mark is from the past
-	// following it forward through history
-
-	for (r = b ? mark.rev : mark.rev->next; r && tr && (b ^ (r->seq <= tr->seq)); r = b ? r->prev : r->next) {
-		if (!(c = r->change)) {
-			continue;
-		}
-		if (!b) {
-			while (c->next)
-				c = c->next;
-		}
-		for (; c; c = b ? c->next : c->prev) {
-			if (!c->old.start || !c->old.end || !c->new.start || !c->new.end) {
-				continue;
-			}
-			Span *old, *new;
-			if (!b) {
-				 old = &c->old;
-				 new = &c->new;
-			} else {
-				 old = &c->new;
-				 new = &c->old;
-			}
-
-			// text was added, but we're undoing it
-			if (mp != old->start && mp != old->end && !(mp == old->start->next && mp->next == old->end)) {
-				// irrelevant change
-				continue;
-			}
-			if (old->start == old->end) {
-				// 1-chunk to 1 chunk(though new.start & new.end may or may not be equal)
-				if (
-					(size_t)(new->start->data - old->start->data) == old->start->len - new->start->len
-				) {
-					//start-to-midway deletion
-
-					if (mp->data + off >= new->start->data && mp->data + off < new->start->data + new->start->len) {
-						mp = new->start;
-						off -= new->start->data - old->start->data;
-						continue;
-					} else if (new->start->data - old->start->data == 1) {
-						mp = new->start;
-						off = 0;
-					}
-
-				}
-				if (mp == old->start && old->start->data == new->start->data) {
-					// midway-to-end deletion
-					if (off < new->start->len) {
-						mp = new->start;
-						continue;
-					} else if (off == new->start->len) {
-						//mp = new->start->next;
-						mp = new->end;
-						off = 0;
-						continue;
-					}
-				}
-			}
-			if (mp == old->start->next && mp->next == old->end) {
-				// old is 3 chunks
-				if (new->start == new->end) {
-					// 3 chunks -> 1 chunk - undoing insert
-					if (off == 0 || off == mp->len-1) {
-						mp = new->start;
-						off = old->start->len;
-						continue;
-					}
-				} else { // 3 chunks -> 2 chunks - deleting between two spans
-					if (off == mp->len-1) {
-						mp = new->end;
-						off = 0;
-						continue;
-					} else if (off == 0) {
-						mp = new->start;
-						off = new->start->len-1;
-						continue;
-					}
-				}
-			}
-			if (off == new->start->len) { // 2 chunks -> 2 chunks
-				// mark was on the end of a piece & was deleted
-				// stick it on the start of the next piece
-				off = 0;
-				mp = new->end;
-				continue;
-
-				//  |1-----------
-				//  the cat purrs
-				//      ^
-				//      a
-				// x/cat/ c/lion/
-				//  the  purrs
-				//      ^
-				//      a
-				//  points at the space
-				//  |1--|2--|1+8--
-				//  the lion purrs
-				//
-				// mark should now point at 'l' instead
-			}
-		}
-
+	size_t pos = mark.pos;
+	size_t len = array_length(&txt->shifts);
+	size_t idx = mark.gen - txt->shifts_base;
+	if (idx >= len)
+		return pos;
+	for (const Shift *s = array_get(&txt->shifts, idx), *end = s + (len - idx); s < end; s++) {
+		if (pos >= s->pos + s->del)
+			pos = pos - s->del + s->ins;
+		else if (pos > s->pos)
+			pos = s->pos;
 	}
+	return pos;
+}
 
-	for (Piece *p = txt->begin.next; p->next; p = p->next) {
-		char *start = (char *)p->data;
-		char *end = start + p->len;
-		char *mark = (char *)mp->data + off;
-		if (start <= mark && mark < end)
-			return cur + (mark - start);
-		cur += p->len;
-	}
+size_t text_mark_update(const Text *txt, Mark *mark) {
+	size_t pos = text_mark_get(txt, *mark);
+	if (pos == EPOS)
+		*mark = EMARK;
+	else
+		*mark = (Mark){ .pos = pos, .gen = txt->shifts_base + array_length(&txt->shifts) };
+	return pos;
+}
+
+size_t text_mark_log(const Text *txt) {
+	return array_length(&txt->shifts);
+}
 
-	return EPOS;
+void text_mark_floor(Text *txt) {
+	txt->shifts_base += array_length(&txt->shifts);
+	array_release(&txt->shifts);
 }
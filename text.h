@@ -2,6 +2,7 @@
 #define TEXT_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 #include <unistd.h>
@@ -9,39 +10,23 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
-typedef struct Revision Revision;
 typedef struct Piece Piece;
-/* used to transform a global position (byte offset starting from the beginning
- * of the text) into an offset relative to a piece.
+
+/**
+ * A mark tracks a position across modifications of the text.
+ *
+ * It is a plain value holding the position and the number of modifications
+ * the text had undergone at the time the position was valid. Upon lookup,
+ * all modifications performed since then are taken into account.
  */
 typedef struct {
-	Piece *piece;           /* piece holding the location */
-	size_t off;             /* offset into the piece in bytes */
-} Location;
-
-/* A mark.
- * this tracks a position in text across modifications
- * "the cat says meow"
- *      ^   ^
- *      a   b
- * a & b are locations
- * delete "cat", insert "dog", delete "says meow", insert "roars"
- *
- * since the location of a particular word can change between revisions,
- * we will (lazily) evaluate where they would be now, given the revision
- * made between the mark's capture time, and now, which ideally, is:
- * "the lion roars"
- *      ^    ^
- *      a    b
- */
-typedef struct Mark {
-	Location loc;
-	Revision *rev;
+	size_t pos;             /* position at the time of the last update */
+	size_t gen;             /* number of modifications at the time of the last update */
 } Mark;
 
 /** An invalid mark, lookup of which will yield ``EPOS``. */
-#define EMARK ((Mark){0})
-#define IS_EMARK(m) ((m.loc.piece) == NULL)
+#define EMARK ((Mark){ .pos = EPOS })
+#define IS_EMARK(m) ((m).pos == EPOS)
 /** An invalid position. */
 #define EPOS ((size_t)-1)
 
@@ -78,9 +63,25 @@ typedef struct {
 	const char *end;    /**< End of piece data. Addressable range is ``[start, end)``. */
 	const char *text;   /**< Current position within piece. Invariant ``start <= text < end`` holds. */
 	const Piece *piece; /**< Internal state of current piece. */
+	const Text *txt;    /**< Text to which the current piece belongs. */
 	size_t pos;         /**< Absolute position in bytes from start of buffer. */
 } Iterator;
 
+/**
+ * Read only part of a text range which is stored contiguously in memory.
+ *
+ * @rst
+ * .. warning:: Any change to the Text will invalidate the chunk.
+ * @endrst
+ */
+typedef struct {
+	const char *data;   /**< Chunk content, not NUL-terminated. */
+	size_t len;         /**< Length of the chunk in bytes. */
+	size_t pos;         /**< Absolute position of the first byte. */
+	size_t end;         /**< Internal state, end of the requested range. */
+	Iterator it;        /**< Internal state, underlying iterator. */
+} TextChunk;
+
 /**
  * @defgroup load
  * @{
@@ -113,6 +114,16 @@ enum TextLoadMethod {
 	 * @endrst
 	 */
 	TEXT_LOAD_MMAP,
+	/**
+	 * Like ``TEXT_LOAD_AUTO`` but files which would be read are
+	 * only read up to a small initial size. The remaining content
+	 * is appended by subsequent ``text_load_continue`` calls.
+	 * @rst
+	 * .. note:: The text can be modified while it is still loading,
+	 *           but not saved.
+	 * @endrst
+	 */
+	TEXT_LOAD_PROGRESSIVE,
 };
 /**
  * Create a text instance populated with the given file content.
@@ -138,8 +149,95 @@ Text *text_loadat(int dirfd, const char *filename);
  */
 Text *text_load_method(const char *filename, enum TextLoadMethod);
 Text *text_loadat_method(int dirfd, const char *filename, enum TextLoadMethod);
+/**
+ * Read more content of a progressively loaded file.
+ *
+ * The data is appended to the end of the document, independent of any
+ * modifications performed so far. It does not create a new revision.
+ *
+ * @param max The maximal number of bytes to read.
+ * @return Whether the read succeeded, ``errno`` is set otherwise.
+ */
+bool text_load_continue(Text*, size_t max);
+/**
+ * Get the number of bytes still to be loaded.
+ * @return The remaining size of a progressive load, ``0`` once the file
+ *         is completely loaded.
+ */
+size_t text_loading(const Text*);
+/**
+ * Append data read from a file descriptor to the end of the document.
+ *
+ * Performs a single ``read(2)`` of at most ``max`` bytes directly into
+ * the text's storage. Like ``text_load_continue`` the data is added
+ * independent of any modifications and does not create a new revision.
+ *
+ * @return The number of bytes appended, ``0`` at end of file, ``-1`` on
+ *         error with ``errno`` set (e.g. ``EAGAIN`` for a non-blocking
+ *         file descriptor without pending data).
+ */
+ssize_t text_append_fd(Text*, int fd, size_t max);
+/**
+ * Append a range of a growing file to the end of the document.
+ *
+ * The range is memory mapped, consecutive ranges of the same file share
+ * a mapping where possible and all mappings share one duplicate of the
+ * file descriptor. Like ``text_load_continue`` the data is added
+ * independent of any modifications and does not create a new revision.
+ * The file size as reported by ``text_stat`` is updated accordingly.
+ *
+ * @param fd The file descriptor of the file, it is duplicated once per file.
+ * @param offset The file offset of the first byte to append.
+ * @param len The number of bytes to append.
+ * @rst
+ * .. warning:: Truncation of the file will raise ``SIGBUS`` when accessing
+ *              the appended range, like for ``TEXT_LOAD_MMAP``.
+ * @endrst
+ */
+bool text_append_file(Text*, int fd, off_t offset, size_t len);
+/**
+ * Remove data from the start of the text, to bound the memory used by
+ * endless streams.
+ *
+ * @param len The number of bytes to remove.
+ * @rst
+ * .. warning:: The complete undo history is discarded.
+ * @endrst
+ */
+bool text_trim(Text*, size_t len);
 /** Release all resources associated with this text instance. */
 void text_free(Text*);
+/**
+ * Create an immutable view of the current text content.
+ *
+ * The snapshot shares the underlying data blocks with the text instance
+ * but has its own piece chain, subsequent modifications of the text are
+ * therefore not visible. It can be used with all functions taking a
+ * ``const Text*``, including the iterator API, while the text itself
+ * continues to be edited.
+ *
+ * @rst
+ * .. note:: Acquiring and releasing a snapshot must happen in the thread
+ *           owning the text instance. Another thread may then read from
+ *           the snapshot without further synchronization. A snapshot must
+ *           not be read from multiple threads at the same time.
+ * .. note:: Creation time is linear in the number of pieces.
+ * @endrst
+ * @return The snapshot or ``NULL`` in case of an error.
+ */
+const Text *text_snapshot_acquire(Text*);
+/** Release a snapshot obtained by ``text_snapshot_acquire``. */
+void text_snapshot_release(const Text*);
+/**
+ * Mark the state captured by a snapshot as saved.
+ *
+ * To be used once the snapshot was written to disk, e.g. by another thread
+ * while the text was further modified. The file information is taken from
+ * the snapshot. If the text contained uncommitted changes when the snapshot
+ * was taken, or the corresponding revision was since discarded, the text
+ * is considered modified.
+ */
+void text_snapshot_saved(Text*, const Text *snapshot);
 /**
  * @}
  * @defgroup state
@@ -147,6 +245,13 @@ void text_free(Text*);
  */
 /** Return the size in bytes of the whole text. */
 size_t text_size(const Text*);
+/**
+ * Return the number of pieces the text currently consists of.
+ *
+ * Together with the text size this indicates how fragmented the
+ * text is after editing, see :c:func:`text_compact()`.
+ */
+size_t text_pieces(const Text*);
 /**
  * Get file information at time of load or last save, whichever happened more
  * recently.
@@ -183,6 +288,33 @@ bool text_insert(Text*, size_t pos, const char *data, size_t len);
  */
 bool text_delete(Text*, size_t pos, size_t len);
 bool text_delete_range(Text*, const Filerange*);
+/**
+ * Replace ``len`` bytes at ``pos`` by ``size`` bytes of ``data``.
+ * Used to apply a batch of modifications using ``text_edit``.
+ */
+typedef struct {
+	size_t pos;             /**< Absolute byte position in terms of the unmodified text. */
+	size_t len;             /**< Number of bytes to delete, starting from ``pos``. */
+	const char *data;       /**< Data to insert at ``pos``. */
+	size_t size;            /**< Number of bytes to insert. */
+} TextEdit;
+/**
+ * Apply a batch of modifications.
+ *
+ * All positions refer to the text before any of the modifications were
+ * performed. A replacement is recorded as a single change.
+ * @rst
+ * .. note:: The edits have to be sorted by position and must not overlap.
+ *           Insertions at the same position are performed in the given order.
+ * @endrst
+ * @param edits The modifications to perform.
+ * @param count The number of modifications.
+ * @param deltas If non-NULL, stores for every edit how much positions
+ *        following it are shifted by it and all preceding edits.
+ * @return Whether all modifications succeeded, nothing is modified if the
+ *         edits are not properly sorted or out of range.
+ */
+bool text_edit(Text*, const TextEdit *edits, size_t count, ptrdiff_t *deltas);
 bool text_printf(Text*, size_t pos, const char *format, ...) __attribute__((format(printf, 3, 4)));
 bool text_appendf(Text*, const char *format, ...) __attribute__((format(printf, 2, 3)));
 /**
@@ -225,6 +357,34 @@ size_t text_restore(Text*, time_t);
  * @endrst
  */
 time_t text_state(const Text*);
+/**
+ * Bound the resources used by the undo history.
+ *
+ * Whenever a snapshot is taken and one of the limits is exceeded, the oldest
+ * revisions are discarded until the history fits again. The current state is
+ * always retained. A limit of zero means unlimited.
+ * @param revisions The maximal number of revisions to keep.
+ * @param age The maximal age in seconds of a revision.
+ * @param size The approximate maximal memory in bytes used to store
+ *        undo information.
+ */
+void text_history_limit(Text*, size_t revisions, time_t age, size_t size);
+/**
+ * Merge runs of small adjacent pieces into contiguous memory.
+ *
+ * Improves locality of subsequent iterations after heavy editing, without
+ * changing the text content. The work is performed incrementally, each
+ * call resumes where the previous one stopped.
+ *
+ * @param max The approximate amount of work, in bytes of memory touched.
+ * @return Whether further calls might be able to compact more.
+ * @rst
+ * .. note:: Compaction only happens once all changes were committed using
+ *           :c:func:`text_snapshot()` and there is nothing to redo. It is
+ *           recorded as part of the current revision, undo works as before.
+ * @endrst
+ */
+bool text_compact(Text*, size_t max);
 /**
  * @}
  * @defgroup lines
@@ -271,6 +431,69 @@ size_t text_bytes_get(const Text*, size_t pos, size_t len, char *buf);
  * @endrst
  */
 char *text_bytes_alloc0(const Text*, size_t pos, size_t len);
+/**
+ * Get the first chunk of a text range.
+ *
+ * Together with :c:func:`text_chunk_next()` this provides access to the
+ * text content without copying it.
+ *
+ * @param pos The absolute starting position.
+ * @param len The length of the range in bytes.
+ * @return Whether a non-empty chunk is available.
+ */
+bool text_chunk_init(const Text*, TextChunk*, size_t pos, size_t len);
+/** Advance to the next chunk of the range, returns ``false`` at its end. */
+bool text_chunk_next(TextChunk*);
+/**
+ * Get a text range as contiguous memory region, only copying if necessary.
+ *
+ * If the range is stored in one piece a pointer into it is returned.
+ * Otherwise the content is copied to ``buf``.
+ *
+ * @param pos The absolute starting position.
+ * @param len The length in bytes, updated to the number of available bytes.
+ * @param buf The destination buffer of at least ``*len`` bytes, might be ``NULL``.
+ * @return A pointer to the requested range, or ``NULL`` if it is not contiguous
+ *         and no buffer was given.
+ * @rst
+ * .. warning:: The returned data is not NUL-terminated.
+ * @endrst
+ */
+const char *text_bytes_contiguous(const Text*, size_t pos, size_t *len, char *buf);
+/**
+ * Expected access pattern of a text range.
+ *
+ * Only relevant for content which is memory mapped from a file, see
+ * ``TEXT_LOAD_MMAP``.
+ */
+enum TextAdvice {
+	/** No specific access pattern, the default. */
+	TEXT_ADVICE_NORMAL,
+	/** Random access, no read ahead is performed, e.g. for display purposes. */
+	TEXT_ADVICE_RANDOM,
+	/** Sequential access, aggressive read ahead is performed. */
+	TEXT_ADVICE_SEQUENTIAL,
+	/** The range will be accessed soon, start reading it. */
+	TEXT_ADVICE_WILLNEED,
+	/** The range will not be accessed in the near future, release its memory. */
+	TEXT_ADVICE_DONTNEED,
+};
+/**
+ * Granularity in bytes in which large text ranges should be advised upon
+ * when streaming through them.
+ */
+#define TEXT_WINDOW_SIZE (1 << 24)
+/**
+ * Advise the operating system about the expected access pattern of a range.
+ *
+ * @param pos The absolute starting position.
+ * @param len The length of the range in bytes.
+ * @param advice How the range will be accessed.
+ * @rst
+ * .. note:: This is merely a hint, the text content is not affected.
+ * @endrst
+ */
+void text_advise(const Text*, size_t pos, size_t len, enum TextAdvice);
 /**
  * @}
  * @defgroup iterator
@@ -329,6 +552,31 @@ Mark text_mark_set(Text*, size_t pos);
  * @return The byte position or ``EPOS`` for an invalid mark.
  */
 size_t text_mark_get(const Text*, Mark);
+/**
+ * Lookup a mark and update it to the current state of the text.
+ *
+ * Subsequent lookups only need to consider modifications performed
+ * afterwards, hence long lived marks should be looked up using this
+ * function.
+ * @param mark The mark to look up and update.
+ * @return The byte position or ``EPOS`` for an invalid mark.
+ */
+size_t text_mark_update(const Text*, Mark*);
+/**
+ * Number of modifications recorded to look up marks.
+ *
+ * Every modification adds an entry, looking up a mark considers those
+ * recorded since it was set or last updated.
+ */
+size_t text_mark_log(const Text*);
+/**
+ * Raise the generation floor of marks to the current state of the text.
+ *
+ * The recorded modifications are discarded. Marks set or updated since
+ * the most recent modification remain valid, all older ones become
+ * invalid. Long lived marks hence have to be updated beforehand.
+ */
+void text_mark_floor(Text*);
 /**
  * @}
  * @defgroup save
@@ -363,6 +611,13 @@ enum TextSaveMethod {
 	TEXT_SAVE_ATOMIC,
 	/**
 	 * Overwrite file in place.
+	 *
+	 * If the whole text is written at once, only the part of the file
+	 * following the first modification is overwritten. Its original
+	 * content is first stored in a journal ``.filename.vis.journal``.
+	 * If the file is loaded again while still in the state an interrupted
+	 * save left it in, the original content is restored in memory. The
+	 * file itself is left untouched, the text is modified until saved.
 	 * @rst
 	 * .. warning:: I/O failure might cause data loss.
 	 * @endrst
@@ -402,6 +657,15 @@ TextSave *text_save_begin(Text*, int dirfd, const char *filename, enum TextSaveM
  * @return The number of bytes written or ``-1`` in case of an error.
  */
 ssize_t text_save_write_range(TextSave*, const Filerange*);
+/**
+ * Flush the data written for multiple saves to disk at once.
+ *
+ * File systems holding more than one of the files are synchronized as
+ * a whole using ``syncfs(2)``, if available. The subsequent calls to
+ * ``text_save_commit`` do not flush the files individually anymore.
+ * @return Whether all data was flushed.
+ */
+bool text_save_sync(TextSave *ctxs[], size_t count);
 /**
  * Commit changes to disk.
  * @return Whether changes have been saved.
@@ -420,6 +684,13 @@ bool text_save_commit(TextSave*);
  * @endrst
  */
 void text_save_cancel(TextSave*);
+/**
+ * Check for the journal of an interrupted in place save of a file.
+ *
+ * It is kept until the file is saved again, even if it does not match
+ * the file and was thus not applied upon load.
+ */
+bool text_journal_exists(const char *filename);
 /**
  * Write whole text content to file descriptor.
  * @return The number of bytes written or ``-1`` in case of an error.
@@ -430,6 +701,70 @@ ssize_t text_write(const Text*, int fd);
  * @return The number of bytes written or ``-1`` in case of an error.
  */
 ssize_t text_write_range(const Text*, const Filerange*, int fd);
+/**
+ * @}
+ * @defgroup recovery
+ * @{
+ */
+/**
+ * Record all subsequent changes in a crash recovery journal.
+ *
+ * The journal ``.filename.vis.recovery`` is stored next to the file and
+ * holds the changes relative to its current content on disk. Records are
+ * appended at each snapshot, they are only flushed to disk by
+ * ``text_recovery_sync``. The journal is removed once the text is freed.
+ * @param filename The file the text is associated with.
+ * @return Whether the journal was created, fails with ``EEXIST`` if a journal
+ *         holding changes of a previous session exists.
+ */
+bool text_recovery_start(Text*, const char *filename);
+/** Stop recording changes and remove the journal. */
+void text_recovery_stop(Text*);
+/**
+ * Restart the journal after the text was saved to its file.
+ *
+ * Changes performed since the saved state was captured are retained.
+ */
+bool text_recovery_reset(Text*);
+/** Write all pending records and flush them to disk using ``fdatasync(2)``. */
+bool text_recovery_sync(Text*);
+/**
+ * Replay the crash recovery journal of a file onto the unmodified text.
+ *
+ * Subsequent changes are appended to the journal. A partially written record
+ * at its end is discarded.
+ * @param force Whether to replay the changes even if the file was modified
+ *              since the journal was started.
+ * @return Whether the journal was replayed, fails with ``ESTALE`` if the
+ *         file was modified.
+ */
+bool text_recover(Text*, const char *filename, bool force);
+/**
+ * @}
+ * @defgroup session
+ * @{
+ */
+/**
+ * Store the text together with its complete undo history in a session file.
+ *
+ * The session ``.filename.vis.session`` is stored next to the file and is
+ * tied to its identity (device, inode, modification time and size) at the
+ * time of the call. Content which is still part of the file on disk is
+ * referenced, not copied. A pending revision is completed by a snapshot.
+ * @param filename The file the text is associated with.
+ * @return Whether the session was written, fails with ``EBUSY`` while the
+ *         file is still being loaded.
+ */
+bool text_session_save(Text*, const char *filename);
+/**
+ * Restore a text together with its undo history from the session of a file.
+ *
+ * The session is memory mapped, its block data is used in place.
+ * @param filename The file whose session should be restored.
+ * @return The restored text, ``NULL`` if there is no session (``ENOENT``)
+ *         or the file changed since it was written (``ESTALE``).
+ */
+Text *text_session_load(const char *filename);
 /**
  * @}
  * @defgroup misc
@@ -0,0 +1,99 @@
+const char *ui_terminal_keytab[][3] = {
+	 { "kDC",	"\x1b[3;2~",	"S-DeleteCharacter"	},	// key_sdc	*4	shifted delete-character key
+	 { "kEND",	"\x1b[1;2F",	"S-End"	},	// key_send	*7	shifted end key
+	 { "kHOM",	"\x1b[1;2H",	"S-Home"	},	// key_shome	#2	shifted home key
+	 { "kIC",	"\x1b[2;2~",	"S-Insert"	},	// key_sic	#3	shifted insert-character key
+	 { "kLFT",	"\x1b[1;2D",	"S-Left"	},	// key_sleft	#4	shifted left-arrow key
+	 { "kNXT",	"\x1b[6;2~",	"S-PageDown"	},	// key_snext	%c	shifted next key
+	 { "kPRV",	"\x1b[5;2~",	"S-PageUp"	},	// key_sprevious	%e	shifted previous key
+	 { "kRIT",	"\x1b[1;2C",	"S-Right"	},	// key_sright	%i	shifted right-arrow key
+	 { "ka1",	"\x1bOw",	"KPUpperLeft"	},	// key_a1	K1	upper left of key-pad
+	 { "ka3",	"\x1bOy",	"KPUpperRight"	},	// key_a3	K3	upper right of key‐pad
+	 { "kb2",	"\x1bOu",	"KPCenter"	},	// key_b2	K2	center of key-pad
+	 { "kbeg",	"\x1bOE",	"Begin"	},	// key_beg	@1	begin key
+	 { "kbs",	"^?",	"Backspace"	},	// key_backspace	kb	backspace key
+	 { "kc1",	"\x1bOq",	"KPLowerLeft"	},	// key_c1	K4	lower left of key-pad
+	 { "kc3",	"\x1bOs",	"KPLowerRight"	},	// key_c3	K5	lower right of key‐pad
+	 { "kcbt",	"\x1b[Z",	"S-Tab"	},	// key_btab	kB	back-tab key
+	 { "kcub1",	"\x1bOD",	"Left"	},	// key_left	kl	left-arrow key
+	 { "kcud1",	"\x1bOB",	"Down"	},	// key_down	kd	down-arrow key
+	 { "kcuf1",	"\x1bOC",	"Right"	},	// key_right	kr	right-arrow key
+	 { "kcuu1",	"\x1bOA",	"Up"	},	// key_up	ku	up-arrow key
+	 { "kdch1",	"\x1b[3~",	"Delete"	},	// key_dc	kD	delete-character key
+	 { "kend",	"\x1bOF",	"End"	},	// key_end	@7	end key
+	 { "kent",	"\x1bOM",	"Enter"	},	// key_enter	@8	enter/send key
+	 { "kf1",	"\x1bOP",	"F1"	},	// key_f1	k1	F1 function key
+	 { "kf10",	"\x1b[21~",	"F10"	},	// key_f10	k;	F10 function key
+	 { "kf11",	"\x1b[23~",	"F11"	},	// key_f11	F1	F11 function key
+	 { "kf12",	"\x1b[24~",	"F12"	},	// key_f12	F2	F12 function key
+	 { "kf13",	"\x1b[1;2P",	"F13"	},	// key_f13	F3	F13 function key
+	 { "kf14",	"\x1b[1;2Q",	"F14"	},	// key_f14	F4	F14 function key
+	 { "kf15",	"\x1b[1;2R",	"F15"	},	// key_f15	F5	F15 function key
+	 { "kf16",	"\x1b[1;2S",	"F16"	},	// key_f16	F6	F16 function key
+	 { "kf17",	"\x1b[15;2~",	"F17"	},	// key_f17	F7	F17 function key
+	 { "kf18",	"\x1b[17;2~",	"F18"	},	// key_f18	F8	F18 function key
+	 { "kf19",	"\x1b[18;2~",	"F19"	},	// key_f19	F9	F19 function key
+	 { "kf2",	"\x1bOQ",	"F2"	},	// key_f2	k2	F2 function key
+	 { "kf20",	"\x1b[19;2~",	"F20"	},	// key_f20	FA	F20 function key
+	 { "kf21",	"\x1b[20;2~",	"F21"	},	// key_f21	FB	F21 function key
+	 { "kf22",	"\x1b[21;2~",	"F22"	},	// key_f22	FC	F22 function key
+	 { "kf23",	"\x1b[23;2~",	"F23"	},	// key_f23	FD	F23 function key
+	 { "kf24",	"\x1b[24;2~",	"F24"	},	// key_f24	FE	F24 function key
+	 { "kf25",	"\x1b[1;5P",	"F25"	},	// key_f25	FF	F25 function key
+	 { "kf26",	"\x1b[1;5Q",	"F26"	},	// key_f26	FG	F26 function key
+	 { "kf27",	"\x1b[1;5R",	"F27"	},	// key_f27	FH	F27 function key
+	 { "kf28",	"\x1b[1;5S",	"F28"	},	// key_f28	FI	F28 function key
+	 { "kf29",	"\x1b[15;5~",	"F29"	},	// key_f29	FJ	F29 function key
+	 { "kf3",	"\x1bOR",	"F3"	},	// key_f3	k3	F3 function key
+	 { "kf30",	"\x1b[17;5~",	"F30"	},	// key_f30	FK	F30 function key
+	 { "kf31",	"\x1b[18;5~",	"F31"	},	// key_f31	FL	F31 function key
+	 { "kf32",	"\x1b[19;5~",	"F32"	},	// key_f32	FM	F32 function key
+	 { "kf33",	"\x1b[20;5~",	"F33"	},	// key_f33	FN	F33 function key
+	 { "kf34",	"\x1b[21;5~",	"F34"	},	// key_f34	FO	F34 function key
+	 { "kf35",	"\x1b[23;5~",	"F35"	},	// key_f35	FP	F35 function key
+	 { "kf36",	"\x1b[24;5~",	"F36"	},	// key_f36	FQ	F36 function key
+	 { "kf37",	"\x1b[1;6P",	"F37"	},	// key_f37	FR	F37 function key
+	 { "kf38",	"\x1b[1;6Q",	"F38"	},	// key_f38	FS	F38 function key
+	 { "kf39",	"\x1b[1;6R",	"F39"	},	// key_f39	FT	F39 function key
+	 { "kf4",	"\x1bOS",	"F4"	},	// key_f4	k4	F4 function key
+	 { "kf40",	"\x1b[1;6S",	"F40"	},	// key_f40	FU	F40 function key
+	 { "kf41",	"\x1b[15;6~",	"F41"	},	// key_f41	FV	F41 function key
+	 { "kf42",	"\x1b[17;6~",	"F42"	},	// key_f42	FW	F42 function key
+	 { "kf43",	"\x1b[18;6~",	"F43"	},	// key_f43	FX	F43 function key
+	 { "kf44",	"\x1b[19;6~",	"F44"	},	// key_f44	FY	F44 function key
+	 { "kf45",	"\x1b[20;6~",	"F45"	},	// key_f45	FZ	F45 function key
+	 { "kf46",	"\x1b[21;6~",	"F46"	},	// key_f46	Fa	F46 function key
+	 { "kf47",	"\x1b[23;6~",	"F47"	},	// key_f47	Fb	F47 function key
+	 { "kf48",	"\x1b[24;6~",	"F48"	},	// key_f48	Fc	F48 function key
+	 { "kf49",	"\x1b[1;3P",	"F49"	},	// key_f49	Fd	F49 function key
+	 { "kf5",	"\x1b[15~",	"F5"	},	// key_f5	k5	F5 function key
+	 { "kf50",	"\x1b[1;3Q",	"F50"	},	// key_f50	Fe	F50 function key
+	 { "kf51",	"\x1b[1;3R",	"F51"	},	// key_f51	Ff	F51 function key
+	 { "kf52",	"\x1b[1;3S",	"F52"	},	// key_f52	Fg	F52 function key
+	 { "kf53",	"\x1b[15;3~",	"F53"	},	// key_f53	Fh	F53 function key
+	 { "kf54",	"\x1b[17;3~",	"F54"	},	// key_f54	Fi	F54 function key
+	 { "kf55",	"\x1b[18;3~",	"F55"	},	// key_f55	Fj	F55 function key
+	 { "kf56",	"\x1b[19;3~",	"F56"	},	// key_f56	Fk	F56 function key
+	 { "kf57",	"\x1b[20;3~",	"F57"	},	// key_f57	Fl	F57 function key
+	 { "kf58",	"\x1b[21;3~",	"F58"	},	// key_f58	Fm	F58 function key
+	 { "kf59",	"\x1b[23;3~",	"F59"	},	// key_f59	Fn	F59 function key
+	 { "kf6",	"\x1b[17~",	"F6"	},	// key_f6	k6	F6 function key
+	 { "kf60",	"\x1b[24;3~",	"F60"	},	// key_f60	Fo	F60 function key
+	 { "kf61",	"\x1b[1;4P",	"F61"	},	// key_f61	Fp	F61 function key
+	 { "kf62",	"\x1b[1;4Q",	"F62"	},	// key_f62	Fq	F62 function key
+	 { "kf63",	"\x1b[1;4R",	"F63"	},	// key_f63	Fr	F63 function key
+	 { "kf7",	"\x1b[18~",	"F7"	},	// key_f7	k7	F7 function key
+	 { "kf8",	"\x1b[19~",	"F8"	},	// key_f8	k8	F8 function key
+	 { "kf9",	"\x1b[20~",	"F9"	},	// key_f9	k9	F9 function key
+	 { "khome",	"\x1bOH",	"Home"	},	// key_home	kh	home key
+	 { "kich1",	"\x1b[2~",	"Insert"	},	// key_ic	kI	insert-character key
+	 { "kind",	"\x1b[1;2B",	"ScrollForward"	},	// key_sf	kF	scroll-forward key
+	 { "knp",	"\x1b[6~",	"NextPage"	},	// key_npage	kN	next-page key
+	 { "kpp",	"\x1b[5~",	"PreviousPage"	},	// key_ppage	kP	previous-page key
+	 { "kri",	"\x1b[1;2A",	"ScrollBackward"	},	// key_sr	kR	scroll-backward key
+};
+
+const char *ui_terminal_control[][2] = {
+	 { "rmkx",	"\x1b[?1l\x1b>"	},	// keypad_local	ke	leave 'keyboard_transmit' mode
+	 { "smkx",	"\x1b[?1h\x1b="	},	// keypad_xmit	ks	enter 'keyboard_transmit' mode
+};
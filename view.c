@@ -132,7 +132,7 @@ static void view_clear(View *view) {
 		if (IS_EMARK(view->start_mark))
 			start = 0;
 		else
-			start = text_mark_get(view->text, view->start_mark);
+			start = text_mark_update(view->text, &view->start_mark);
 		if (start != EPOS)
 			view->start = start;
 	}
@@ -328,16 +328,16 @@ void view_draw(View *view) {
 	view_clear(view);
 	/* read a screenful of text considering each character as 4-byte UTF character*/
 	const size_t size = view->width * view->height * 4;
-	/* current buffer to work with */
-	char *text = view->textbuf;
+	/* the viewport is accessed randomly, avoid needless read ahead */
+	text_advise(view->text, view->start, size, TEXT_ADVICE_RANDOM);
 	/* remaining bytes to process in buffer */
-	size_t rem = text_bytes_get(view->text, view->start, size, text);
-	/* NUL terminate text section */
-	text[rem] = '\0';
+	size_t rem = size;
+	/* current buffer to work with, only copied if not stored contiguously */
+	const char *text = text_bytes_contiguous(view->text, view->start, &rem, view->textbuf);
 	/* absolute position of character currently being added to display */
 	size_t pos = view->start;
 	/* current position into buffer from which to interpret a character */
-	char *cur = text;
+	const char *cur = text;
 	/* start from known multibyte state */
 	mbstate_t mbstate = { 0 };
 
@@ -361,8 +361,8 @@ void view_draw(View *view) {
 			 * wide character. Advance file position and read
 			 * another junk into buffer.
 			 */
-			rem = text_bytes_get(view->text, pos+prev_cell.len, size, text);
-			text[rem] = '\0';
+			rem = size;
+			text = text_bytes_contiguous(view->text, pos+prev_cell.len, &rem, view->textbuf);
 			cur = text;
 			continue;
 		} else if (len == 0) {
@@ -502,6 +502,15 @@ void view_reload(View *view, Text *text) {
 	view_cursor_to(view, 0);
 }
 
+void view_marks_update(View *view) {
+	if (!IS_EMARK(view->start_mark))
+		text_mark_update(view->text, &view->start_mark);
+	for (Selection *s = view->selections; s; s = s->next) {
+		text_mark_update(view->text, &s->cursor);
+		text_mark_update(view->text, &s->anchor);
+	}
+}
+
 View *view_new(Text *text) {
 	if (!text)
 		return NULL;
@@ -1092,7 +1101,7 @@ Selection *view_selections_next(Selection *s) {
 }
 
 size_t view_cursors_pos(Selection *s) {
-	return text_mark_get(s->view->text, s->cursor);
+	return text_mark_update(s->view->text, &s->cursor);
 }
 
 size_t view_cursors_line(Selection *s) {
@@ -1216,8 +1225,8 @@ Filerange view_selections_get(Selection *s) {
 	if (!s)
 		return text_range_empty();
 	Text *txt = s->view->text;
-	size_t anchor = text_mark_get(txt, s->anchor);
-	size_t cursor = text_mark_get(txt, s->cursor);
+	size_t anchor = text_mark_update(txt, &s->anchor);
+	size_t cursor = text_mark_update(txt, &s->cursor);
 	Filerange sel = text_range_new(anchor, cursor);
 	if (text_range_valid(&sel))
 		sel.end = text_char_next(txt, sel.end);
@@ -1229,8 +1238,8 @@ bool view_selections_set(Selection *s, const Filerange *r) {
 	size_t max = text_size(txt);
 	if (!text_range_valid(r) || r->start >= max)
 		return false;
-	size_t anchor = text_mark_get(txt, s->anchor);
-	size_t cursor = text_mark_get(txt, s->cursor);
+	size_t anchor = text_mark_update(txt, &s->anchor);
+	size_t cursor = text_mark_update(txt, &s->cursor);
 	bool left_extending = anchor != EPOS && anchor > cursor;
 	size_t end = r->end > max ? max : r->end;
 	if (r->start != end)
@@ -1242,8 +1251,8 @@ bool view_selections_set(Selection *s, const Filerange *r) {
 
 Filerange view_regions_restore(View *view, SelectionRegion *s) {
 	Text *txt = view->text;
-	size_t anchor = text_mark_get(txt, s->anchor);
-	size_t cursor = text_mark_get(txt, s->cursor);
+	size_t anchor = text_mark_update(txt, &s->anchor);
+	size_t cursor = text_mark_update(txt, &s->cursor);
 	Filerange sel = text_range_new(anchor, cursor);
 	if (text_range_valid(&sel))
 		sel.end = text_char_next(txt, sel.end);
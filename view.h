@@ -46,6 +46,8 @@ void view_free(View*);
 void view_ui(View*, UiWin*);
 Text *view_text(View*);
 void view_reload(View*, Text*);
+/** Update all marks of the view to the current state of the text. */
+void view_marks_update(View*);
 /**
  * @}
  * @defgroup view_viewport
@@ -135,6 +135,11 @@ static void tabwidth_set(Vis *vis, int tabwidth) {
 	vis->tabwidth = tabwidth;
 }
 
+static void history_limit_set(Vis *vis) {
+	for (File *file = vis->files; file; file = file->next)
+		text_history_limit(file->text, vis->history_revisions, vis->history_age, vis->history_size);
+}
+
 /* parse human-readable boolean value in s. If successful, store the result in
  * outval and return true. Else return false and leave outval alone. */
 static bool parse_bool(const char *s, bool *outval) {
@@ -331,9 +336,11 @@ static bool cmd_set(Vis *vis, Win *win, Command *cmd, const char *argv[], Select
 			vis->load_method = TEXT_LOAD_READ;
 		} else if (strcmp("mmap", arg.s) == 0) {
 			vis->load_method = TEXT_LOAD_MMAP;
+		} else if (strcmp("progressive", arg.s) == 0) {
+			vis->load_method = TEXT_LOAD_PROGRESSIVE;
 		} else {
 			vis_info_show(vis, "Invalid load method `%s', expected "
-			              "'auto', 'read' or 'mmap'", arg.s);
+			              "'auto', 'read', 'mmap' or 'progressive'", arg.s);
 			return false;
 		}
 		break;
@@ -356,6 +363,39 @@ static bool cmd_set(Vis *vis, Win *win, Command *cmd, const char *argv[], Select
 	case OPTION_IGNORECASE:
 		vis->ignorecase = toggle ? !vis->ignorecase : arg.b;
 		break;
+	case OPTION_HISTORY_REVISIONS:
+		vis->history_revisions = arg.i;
+		history_limit_set(vis);
+		break;
+	case OPTION_HISTORY_AGE:
+		vis->history_age = arg.i;
+		history_limit_set(vis);
+		break;
+	case OPTION_HISTORY_SIZE:
+		vis->history_size = (size_t)arg.i * 1024;
+		history_limit_set(vis);
+		break;
+	case OPTION_STREAM_LIMIT:
+		vis->stream_limit = (size_t)arg.i * 1024;
+		break;
+	case OPTION_FOLLOW:
+		if (!file_follow(vis, win->file, toggle ? win->file->follow == -1 : arg.b)) {
+			vis_info_show(vis, "Can not follow file: %s", strerror(errno));
+			return false;
+		}
+		break;
+	case OPTION_JOURNAL:
+		if (!file_journal(vis, win->file, toggle ? !win->file->journal : arg.b)) {
+			if (errno == EEXIST)
+				vis_info_show(vis, "Recovery journal exists, use :recover to replay it");
+			else
+				vis_info_show(vis, "Can not create recovery journal: %s", strerror(errno));
+			return false;
+		}
+		break;
+	case OPTION_SESSION:
+		vis->session = toggle ? !vis->session : arg.b;
+		break;
 	default:
 		if (!opt->func)
 			return false;
@@ -624,6 +664,27 @@ static bool cmd_earlier_later(Vis *vis, Win *win, Command *cmd, const char *argv
 	return pos != EPOS;
 }
 
+static bool cmd_recover(Vis *vis, Win *win, Command *cmd, const char *argv[], Selection *sel, Filerange *range) {
+	if (!win)
+		return false;
+	File *file = win->file;
+	if (!file->name) {
+		vis_info_show(vis, "Filename expected");
+		return false;
+	}
+	if (!text_recover(file->text, file->name, cmd->flags == '!')) {
+		if (errno == ESTALE)
+			vis_info_show(vis, "File changed since the journal was started, use :recover! to replay it anyway");
+		else if (errno == EBUSY)
+			vis_info_show(vis, "Can not recover a modified file");
+		else
+			vis_info_show(vis, "Can not recover file: %s", strerror(errno));
+		return false;
+	}
+	file->journal = true;
+	return true;
+}
+
 static int space_replace(char *dest, const char *src, size_t dlen) {
 	int invisiblebytes = 0;
 	size_t i, size = LENGTH("␣") - 1;
@@ -2,6 +2,9 @@
 #define VIS_CORE_H
 
 #include <setjmp.h>
+#if CONFIG_PTHREAD
+#include <pthread.h>
+#endif
 #include "sam.h"
 #include "vis-lua.h"
 #include "text.h"
@@ -173,6 +176,12 @@ struct File { /* shared state among windows displaying the same file */
 	const char *name;                /* file name used when loading/saving */
 	volatile sig_atomic_t truncated; /* whether the underlying memory mapped region became invalid (SIGBUS) */
 	int fd;                          /* output file descriptor associated with this file or -1 if loaded by file name */
+	int stream;                      /* input file descriptor whose data is appended as it arrives or -1 */
+	int follow;                      /* file descriptor of the file if growth is being followed or -1 */
+	int follow_watch;                /* inotify(7) watch descriptor of a followed file or -1 */
+	bool journal;                    /* whether changes are recorded in a crash recovery journal */
+	bool lazy;                       /* whether only name and stat are known, see file_load */
+	int error;                       /* errno(3) value if loading a lazy file failed, its windows are closed */
 	bool internal;                   /* whether it is an internal file (e.g. used for the prompt) */
 	struct stat stat;                /* filesystem information when loaded/saved, used to detect changes outside the editor */
 	int refcount;                    /* how many windows are displaying this file? (always >= 1) */
@@ -182,6 +191,40 @@ struct File { /* shared state among windows displaying the same file */
 	File *next, *prev;
 };
 
+/* The worker only reads the blocks of the snapshot. Their reference counts
+ * (Block.refs) are not atomic, hence snapshots are only taken and released
+ * on the main thread. */
+typedef struct {                 /* a file written in the background */
+	File *file;                  /* file being saved, holds a reference until completion */
+	const Text *snapshot;        /* immutable view of the text being written */
+	TextSave *ctx;               /* save context of the destination */
+	char *path;                  /* absolute path of the destination */
+	Array ranges;                /* Filerange of the snapshot to write */
+	bool existing;               /* whether the destination existed before */
+	bool same;                   /* whether the destination is the file itself */
+	int error;                   /* errno(3) value if the save failed, 0 otherwise */
+} SaveFile;
+
+#define REGEX_CACHE_SIZE 8
+
+typedef struct {                 /* a compiled regex kept for reuse */
+	char *pattern;               /* pattern it was compiled from, NULL if unused */
+	int cflags;                  /* flags it was compiled with */
+	Regex *regex;                /* reference held by the cache */
+} RegexCache;
+
+typedef struct Save Save;
+struct Save {                    /* files written together by a worker thread */
+	Array files;                 /* SaveFile of all files, flushed to disk at once */
+#if CONFIG_PTHREAD
+	Vis *vis;                    /* editor instance the worker belongs to */
+	pthread_t thread;
+	int done[2];                 /* pipe(2) written to by the worker once it is finished */
+	sigjmp_buf sigbus_jmpbuf;    /* used by the worker to fail the file being written after SIGBUS */
+#endif
+	Save *next;
+};
+
 struct Win {
 	Vis *vis;               /* editor instance to which this window belongs */
 	UiWin *ui;              /* ui object handling visual appearance of this window */
@@ -241,6 +284,11 @@ struct Vis {
 	volatile sig_atomic_t resume;        /* need to resume UI (SIGCONT occurred) */
 	volatile sig_atomic_t terminate;     /* need to terminate we were being killed by SIGTERM */
 	sigjmp_buf sigbus_jmpbuf;            /* used to jump back to a known good state in the mainloop after (SIGBUS) */
+#if CONFIG_PTHREAD
+	pthread_t thread;                    /* main thread, the only one which may jump to sigbus_jmpbuf */
+	pthread_key_t save_key;              /* Save written by the current worker thread */
+	bool save_threads;                   /* whether saves are written by worker threads */
+#endif
 	Map *actions;                        /* registered editor actions / special keys commands */
 	Array actions_user;                  /* dynamically allocated editor actions */
 	lua_State *lua;                      /* lua context used for syntax highlighting */
@@ -251,6 +299,16 @@ struct Vis {
 	Array textobjects;
 	Array bindings;
 	bool ignorecase;                     /* whether to ignore case when searching */
+	RegexCache regexes[REGEX_CACHE_SIZE]; /* recently compiled regexes, most recently used first */
+	size_t history_revisions;            /* maximal number of undo revisions per file, 0 for unlimited */
+	time_t history_age;                  /* maximal age of undo revisions in seconds, 0 for unlimited */
+	size_t history_size;                 /* maximal undo history size per file in bytes, 0 for unlimited */
+	size_t stream_limit;                 /* maximal size of a streamed file in bytes, 0 for unlimited */
+	bool session;                        /* whether to restore and preserve the undo history of files */
+	Map *inodes;                         /* named files indexed by device and inode number */
+	int inotify;                         /* inotify(7) instance watching followed files or -1 */
+	Save *save;                          /* files to be saved once the current command completes */
+	Save *saves;                         /* saves in progress */
 
 	Array notes[2]; // file descriptors we're listening to
 	Array children; // pids of children processes
@@ -307,15 +365,31 @@ char *absolute_path(const char *path);
 
 const char *file_name_get(File*);
 void file_name_set(File*, const char *name);
+bool file_follow(Vis*, File*, bool follow);
+/* load the content of a lazily opened file, a no-op for all others */
+bool file_load(Vis*, File*);
+/* update the file system information of a file */
+void file_stat_set(Vis*, File*, struct stat);
+bool file_journal(Vis*, File*, bool journal);
+void file_journal_reset(Vis*, File*);
+
+/* queue a background save of the given snapshot ranges, takes ownership of path */
+bool vis_save_add(Vis*, File*, const Text *snapshot, TextSave*, char *path, Array *ranges, bool existing, bool same);
+/* start all queued saves, returns false if a synchronous fallback failed */
+bool vis_save_start(Vis*);
+/* wait for all saves of file (or any file if NULL), returns false if one failed */
+bool vis_save_wait(Vis*, File*);
 
 bool register_init(Register*);
 void register_release(Register*);
 
 void mark_init(Array*);
 void mark_release(Array*);
+void mark_update(Text*, Array*);
 
 void marklist_init(MarkList*, size_t max);
 void marklist_release(MarkList*);
+void marklist_update(Text*, MarkList*);
 
 const char *register_get(Vis*, Register*, size_t *len);
 const char *register_slot_get(Vis*, Register*, size_t slot, size_t *len);
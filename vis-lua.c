@@ -68,6 +68,13 @@ static void window_status_update(Vis *vis, Win *win) {
 	         text_modified(txt) ? " [+]" : "",
 	         vis_macro_recording(vis) ? " @": "");
 
+	size_t remaining = text_loading(txt);
+	if (remaining) {
+		size_t total = text_stat(txt).st_size;
+		snprintf(left_parts[left_count++], sizeof(left_parts[0]),
+		         "loading %zu%%", (total - remaining) * 100 / total);
+	}
+
 	int count = vis_count_get(vis);
 	const char *keys = string_content0(&vis->input_queue);
 	if (keys && keys[0])
@@ -146,6 +153,7 @@ void vis_lua_file_open(Vis *vis, File *file) { }
 bool vis_lua_file_save_pre(Vis *vis, File *file, const char *path) { return true; }
 void vis_lua_file_save_post(Vis *vis, File *file, const char *path) { }
 void vis_lua_file_close(Vis *vis, File *file) { }
+void vis_lua_file_marks_update(Vis *vis, File *file) { }
 void vis_lua_win_open(Vis *vis, Win *win) { }
 void vis_lua_win_close(Vis *vis, Win *win) { }
 void vis_lua_win_highlight(Vis *vis, Win *win) { }
@@ -647,7 +655,8 @@ static int files(lua_State *L) {
 	Vis *vis = obj_ref_check(L, 1, "vis");
 	File **handle = lua_newuserdata(L, sizeof *handle);
 	*handle = vis->files;
-	lua_pushcclosure(L, files_iter, 1);
+	lua_pushlightuserdata(L, vis);
+	lua_pushcclosure(L, files_iter, 2);
 	return 1;
 }
 
@@ -655,6 +664,8 @@ static int files_iter(lua_State *L) {
 	File **handle = lua_touserdata(L, lua_upvalueindex(1));
 	if (!*handle)
 		return 0;
+	/* the contents of lazily opened files are needed from now on */
+	file_load(lua_touserdata(L, lua_upvalueindex(2)), *handle);
 	File *file = obj_ref_new(L, *handle, VIS_LUA_TYPE_FILE);
 	if (file)
 		*handle = file->next;
@@ -1681,6 +1692,7 @@ static int window_index(lua_State *L) {
 		}
 
 		if (strcmp(key, "file") == 0) {
+			file_load(win->vis, win->file);
 			obj_ref_new(L, win->file, VIS_LUA_TYPE_FILE);
 			return 1;
 		}
@@ -2145,6 +2157,14 @@ static const struct luaL_Reg window_selection_funcs[] = {
  * File permission.
  * @tfield int permission the file permission bits as of the most recent load/save
  */
+/***
+ * File fragmentation.
+ * @tfield int pieces the number of pieces the file content is currently split into
+ */
+/***
+ * Progress of a progressive load.
+ * @tfield int loading the percentage of the file loaded so far, `nil` once it is complete
+ */
 static int file_index(lua_State *L) {
 	File *file = obj_ref_check(L, 1, VIS_LUA_TYPE_FILE);
 
@@ -2181,6 +2201,21 @@ static int file_index(lua_State *L) {
 			return 1;
 		}
 
+		if (strcmp(key, "pieces") == 0) {
+			lua_pushunsigned(L, text_pieces(file->text));
+			return 1;
+		}
+
+		if (strcmp(key, "loading") == 0) {
+			size_t remaining = text_loading(file->text);
+			size_t total = text_stat(file->text).st_size;
+			if (remaining)
+				lua_pushunsigned(L, (total - remaining) * 100 / total);
+			else
+				lua_pushnil(L);
+			return 1;
+		}
+
 		if (strcmp(key, "internal") == 0) {
 			lua_pushboolean(L, file->internal);
 			return 1;
@@ -2282,11 +2317,14 @@ static int file_lines_iterator_it(lua_State *L) {
 		return 0;
 	size_t end = text_line_end(file->text, *start);
 	size_t len = end - *start;
-	char *buf = lua_newuserdata(L, len);
-	if (!buf && len)
-		return 0;
-	len = text_bytes_get(file->text, *start, len, buf);
-	lua_pushlstring(L, buf, len);
+	const char *data = text_bytes_contiguous(file->text, *start, &len, NULL);
+	if (!data) {
+		char *buf = lua_newuserdata(L, len);
+		if (!buf && len)
+			return 0;
+		data = text_bytes_contiguous(file->text, *start, &len, buf);
+	}
+	lua_pushlstring(L, data, len);
 	*start = text_line_next(file->text, end);
 	return 1;
 }
@@ -2316,10 +2354,13 @@ static int file_content(lua_State *L) {
 	if (!text_range_valid(&range))
 		goto err;
 	size_t len = text_range_size(&range);
-	char *data = lua_newuserdata(L, len);
-	if (!data)
-		goto err;
-	len = text_bytes_get(file->text, range.start, len, data);
+	const char *data = text_bytes_contiguous(file->text, range.start, &len, NULL);
+	if (!data) {
+		char *buf = lua_newuserdata(L, len);
+		if (!buf)
+			goto err;
+		data = text_bytes_contiguous(file->text, range.start, &len, buf);
+	}
 	lua_pushlstring(L, data, len);
 	return 1;
 err:
@@ -2327,6 +2368,34 @@ err:
 	return 1;
 }
 
+/* remembers the mark handle at the top of the stack, to keep it valid
+ * when the file's marks are updated:
+ *
+ *   registry["vis.marks"][file][mark] = true
+ *
+ * with weak keys, hence unused handles are still collected
+ */
+static void file_mark_register(lua_State *L, File *file) {
+	lua_getfield(L, LUA_REGISTRYINDEX, "vis.marks");
+	lua_pushlightuserdata(L, file);
+	lua_gettable(L, -2);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_pushstring(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushlightuserdata(L, file);
+		lua_pushvalue(L, -2);
+		lua_settable(L, -4);
+	}
+	lua_pushvalue(L, -3);
+	lua_pushboolean(L, 1);
+	lua_settable(L, -3);
+	lua_pop(L, 2);
+}
+
 /***
  * Set mark.
  * @function mark_set
@@ -2340,6 +2409,7 @@ static int file_mark_set(lua_State *L) {
 	if (!IS_EMARK(mark)) {
 		Mark *handle = obj_new(L, sizeof(mark), VIS_LUA_TYPE_MARK);
 		*handle = mark;
+		file_mark_register(L, file);
 	} else
 		lua_pushnil(L);
 	return 1;
@@ -2354,7 +2424,7 @@ static int file_mark_set(lua_State *L) {
 static int file_mark_get(lua_State *L) {
 	File *file = obj_ref_check(L, 1, VIS_LUA_TYPE_FILE);
 	Mark *mark = luaL_checkudata(L, 2, VIS_LUA_TYPE_MARK);
-	size_t pos = text_mark_get(file->text, *mark);
+	size_t pos = text_mark_update(file->text, mark);
 	if (pos == EPOS)
 		lua_pushnil(L);
 	else
@@ -2411,10 +2481,13 @@ static int file_lines_index(lua_State *L) {
 	size_t end = text_line_end(txt, start);
 	if (start != EPOS && end != EPOS) {
 		size_t size = end - start;
-		char *data = lua_newuserdata(L, size);
-		if (!data && size)
-			goto err;
-		size = text_bytes_get(txt, start, size, data);
+		const char *data = text_bytes_contiguous(txt, start, &size, NULL);
+		if (!data) {
+			char *buf = lua_newuserdata(L, size);
+			if (!buf && size)
+				goto err;
+			data = text_bytes_contiguous(txt, start, &size, buf);
+		}
 		lua_pushlstring(L, data, size);
 		return 1;
 	}
@@ -2697,6 +2770,9 @@ void vis_lua_init(Vis *vis) {
 	/* table in registry to track lifetimes of C objects */
 	lua_newtable(L);
 	lua_setfield(L, LUA_REGISTRYINDEX, "vis.objects");
+	/* table in registry to track the mark handles of files */
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, "vis.marks");
 	/* table in registry to store references to Lua functions */
 	lua_newtable(L);
 	lua_setfield(L, LUA_REGISTRYINDEX, "vis.functions");
@@ -3013,6 +3089,29 @@ void vis_lua_file_close(Vis *vis, File *file) {
 	obj_ref_free(L, file->text);
 	obj_ref_free(L, file);
 	lua_pop(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, "vis.marks");
+	lua_pushlightuserdata(L, file);
+	lua_pushnil(L);
+	lua_settable(L, -3);
+	lua_pop(L, 1);
+}
+
+/* update the marks handed out for the file to the current state of its text */
+void vis_lua_file_marks_update(Vis *vis, File *file) {
+	lua_State *L = vis->lua;
+	if (!L)
+		return;
+	lua_getfield(L, LUA_REGISTRYINDEX, "vis.marks");
+	lua_pushlightuserdata(L, file);
+	lua_gettable(L, -2);
+	if (lua_istable(L, -1)) {
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			text_mark_update(file->text, lua_touserdata(L, -2));
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 2);
 }
 
 /***
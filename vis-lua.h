@@ -55,6 +55,7 @@ void vis_lua_file_open(Vis*, File*);
 bool vis_lua_file_save_pre(Vis*, File*, const char *path);
 void vis_lua_file_save_post(Vis*, File*, const char *path);
 void vis_lua_file_close(Vis*, File*);
+void vis_lua_file_marks_update(Vis*, File*);
 void vis_lua_win_open(Vis*, Win*);
 void vis_lua_win_close(Vis*, Win*);
 void vis_lua_win_highlight(Vis*, Win*);
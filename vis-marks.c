@@ -47,6 +47,15 @@ void mark_release(Array *arr) {
 	array_release(arr);
 }
 
+/* update all regions to the current state of the text */
+void mark_update(Text *txt, Array *arr) {
+	for (size_t i = 0, len = array_length(arr); i < len; i++) {
+		SelectionRegion *sr = array_get(arr, i);
+		text_mark_update(txt, &sr->anchor);
+		text_mark_update(txt, &sr->cursor);
+	}
+}
+
 static Array *mark_from(Vis *vis, enum VisMark id) {
 	if (!vis->win)
 		return NULL;
@@ -125,6 +134,13 @@ void marklist_release(MarkList *list) {
 	array_release(&list->next);
 }
 
+void marklist_update(Text *txt, MarkList *list) {
+	for (size_t i = 0, len = array_length(&list->prev); i < len; i++)
+		mark_update(txt, array_get(&list->prev, i));
+	for (size_t i = 0, len = array_length(&list->next); i < len; i++)
+		mark_update(txt, array_get(&list->next, i));
+}
+
 static bool marklist_push(Win *win, MarkList *list, Array *sel) {
 	Array *top = array_peek(&list->prev);
 	if (top) {
@@ -100,6 +100,20 @@ static size_t op_put(Vis *vis, Text *txt, OperatorContext *c) {
 	return pos;
 }
 
+/* The line based operators below determine their modifications while
+ * walking backwards through the range. Apply them as one batch, given
+ * in descending order. */
+static bool edits_apply_reverse(Text *txt, Array *edits, ptrdiff_t *deltas) {
+	size_t len = array_length(edits);
+	for (size_t i = 0; i < len / 2; i++) {
+		TextEdit *a = array_get(edits, i), *b = array_get(edits, len - i - 1);
+		TextEdit tmp = *a;
+		*a = *b;
+		*b = tmp;
+	}
+	return text_edit(txt, array_get(edits, 0), len, deltas);
+}
+
 static size_t op_shift_right(Vis *vis, Text *txt, OperatorContext *c) {
 	char spaces[9] = "         ";
 	spaces[MIN(vis->tabwidth, LENGTH(spaces) - 1)] = '\0';
@@ -113,15 +127,23 @@ static size_t op_shift_right(Vis *vis, Text *txt, OperatorContext *c) {
 		pos = text_line_prev(txt, pos);
 	bool multiple_lines = text_line_prev(txt, pos) >= c->range.start;
 
+	Array edits;
+	array_init_sized(&edits, sizeof(TextEdit));
+
 	do {
 		size_t end = text_line_end(txt, pos);
 		prev_pos = pos = text_line_begin(txt, end);
-		if ((!multiple_lines || pos != end) &&
-		    text_insert(txt, pos, tab, tablen) && pos <= c->pos)
-			newpos += tablen;
+		if (!multiple_lines || pos != end) {
+			TextEdit edit = { .pos = pos, .data = tab, .size = tablen };
+			if (array_add(&edits, &edit) && pos <= c->pos)
+				newpos += tablen;
+		}
 		pos = text_line_prev(txt, pos);
 	}  while (pos >= c->range.start && pos != prev_pos);
 
+	if (!edits_apply_reverse(txt, &edits, NULL))
+		newpos = c->pos;
+	array_release(&edits);
 	return newpos;
 }
 
@@ -134,6 +156,9 @@ static size_t op_shift_left(Vis *vis, Text *txt, OperatorContext *c) {
 	if (pos == c->range.end)
 		pos = text_line_prev(txt, pos);
 
+	Array edits;
+	array_init_sized(&edits, sizeof(TextEdit));
+
 	do {
 		char b;
 		size_t len = 0;
@@ -146,7 +171,8 @@ static size_t op_shift_left(Vis *vis, Text *txt, OperatorContext *c) {
 				text_iterator_byte_next(&it, NULL);
 		}
 		tablen = MIN(len, tabwidth);
-		if (text_delete(txt, pos, tablen) && pos < c->pos) {
+		TextEdit edit = { .pos = pos, .len = tablen };
+		if (tablen && array_add(&edits, &edit) && pos < c->pos) {
 			size_t delta = c->pos - pos;
 			if (delta > tablen)
 				delta = tablen;
@@ -157,6 +183,9 @@ static size_t op_shift_left(Vis *vis, Text *txt, OperatorContext *c) {
 		pos = text_line_prev(txt, pos);
 	}  while (pos >= c->range.start && pos != prev_pos);
 
+	if (!edits_apply_reverse(txt, &edits, NULL))
+		newpos = c->pos;
+	array_release(&edits);
 	return newpos;
 }
 
@@ -174,9 +203,31 @@ static size_t op_cursor(Vis *vis, Text *txt, OperatorContext *c) {
 	return EPOS;
 }
 
+static size_t join_lines(Text *txt, OperatorContext *c, size_t pos, size_t len) {
+	size_t prev_pos;
+	Mark mark = EMARK;
+
+	do {
+		prev_pos = pos;
+		size_t end = text_line_start(txt, pos);
+		pos = text_line_prev(txt, end);
+		if (pos < c->range.start || end <= pos)
+			break;
+		text_delete(txt, pos, end - pos);
+		char prev, next;
+		if (text_byte_get(txt, pos-1, &prev) && !isspace((unsigned char)prev) &&
+		    text_byte_get(txt, pos, &next) && next != '\n')
+			text_insert(txt, pos, c->arg->s, len);
+		if (IS_EMARK(mark))
+			mark = text_mark_set(txt, pos);
+	} while (pos != prev_pos);
+
+	size_t newpos = text_mark_get(txt, mark);
+	return newpos != EPOS ? newpos : c->range.start;
+}
+
 static size_t op_join(Vis *vis, Text *txt, OperatorContext *c) {
 	size_t pos = text_line_begin(txt, c->range.end), prev_pos;
-	Mark mark = EMARK;
 
 	/* if operator and range are both linewise, skip last line break */
 	if (c->linewise && text_range_is_linewise(txt, &c->range)) {
@@ -187,24 +238,69 @@ static size_t op_join(Vis *vis, Text *txt, OperatorContext *c) {
 	}
 
 	size_t len = c->arg->s ? strlen(c->arg->s) : 0;
+	size_t start = pos;
+
+	Array edits;
+	array_init_sized(&edits, sizeof(TextEdit));
+
+	/* Positions refer to the unmodified text but the lines are joined as
+	 * if it was done one by one from the bottom up. Once the line break
+	 * below is removed, a blank line continues into the joined text:
+	 * its join then ends where the one below starts and has to look at
+	 * the byte which ends up there. */
+	size_t last = EPOS;
+	char last_byte = '\0';
+	bool last_valid = false;
 
 	do {
 		prev_pos = pos;
 		size_t end = text_line_start(txt, pos);
+		if (end > last)
+			end = last;
 		pos = text_line_prev(txt, end);
 		if (pos < c->range.start || end <= pos)
 			break;
-		text_delete(txt, pos, end - pos);
-		char prev, next;
+		TextEdit edit = { .pos = pos, .len = end - pos };
+		char prev, next = last_byte;
+		bool next_valid = last_valid;
+		if (end != last)
+			next_valid = text_byte_get(txt, end, &next);
 		if (text_byte_get(txt, pos-1, &prev) && !isspace((unsigned char)prev) &&
-		    text_byte_get(txt, pos, &next) && next != '\n')
-			text_insert(txt, pos, c->arg->s, len);
-		if (IS_EMARK(mark))
-			mark = text_mark_set(txt, pos);
+		    next_valid && next != '\n') {
+			edit.data = c->arg->s;
+			edit.size = len;
+		}
+		if (!array_add(&edits, &edit))
+			goto sequential;
+		if (edit.size) {
+			last_byte = edit.data[0];
+			last_valid = true;
+		} else {
+			last_byte = next;
+			last_valid = next_valid;
+		}
+		last = pos;
 	} while (pos != prev_pos);
 
-	size_t newpos = text_mark_get(txt, mark);
-	return newpos != EPOS ? newpos : c->range.start;
+	/* the cursor is placed at the last join point */
+	size_t count = array_length(&edits);
+	if (!count) {
+		array_release(&edits);
+		return c->range.start;
+	}
+	ptrdiff_t *deltas = calloc(count, sizeof *deltas);
+	if (!deltas || !edits_apply_reverse(txt, &edits, deltas)) {
+		free(deltas);
+		goto sequential;
+	}
+	TextEdit *first = array_get(&edits, count - 1);
+	size_t newpos = first->pos + (count > 1 ? deltas[count - 2] : 0);
+	free(deltas);
+	array_release(&edits);
+	return newpos;
+sequential:
+	array_release(&edits);
+	return join_lines(txt, c, start, len);
 }
 
 static size_t op_modeswitch(Vis *vis, Text *txt, OperatorContext *c) {
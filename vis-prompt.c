@@ -8,6 +8,8 @@
 bool vis_prompt_cmd(Vis *vis, const char *cmd) {
 	if (!cmd || !cmd[0] || !cmd[1])
 		return true;
+	if (vis->win && !file_load(vis, vis->win->file))
+		return false;
 	switch (cmd[0]) {
 	case '/':
 		return vis_motion(vis, VIS_MOVE_SEARCH_FORWARD, cmd+1);
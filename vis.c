@@ -17,6 +17,9 @@
 #include <sys/mman.h>
 #include <pwd.h>
 #include <libgen.h>
+#if CONFIG_INOTIFY
+#include <sys/inotify.h>
+#endif
 
 #include "vis.h"
 #include "text-util.h"
@@ -29,6 +32,7 @@
 static void macro_replay(Vis *vis, const Macro *macro);
 static void macro_replay_internal(Vis *vis, const Macro *macro);
 static void vis_keys_push(Vis *vis, const char *input, size_t pos, bool record);
+static void regex_cache_release(RegexCache *c);
 
 bool vis_event_emit(Vis *vis, enum VisEvents id, ...) {
 	if (!vis->event)
@@ -102,6 +106,29 @@ bool vis_event_emit(Vis *vis, enum VisEvents id, ...) {
 
 /** window / file handling */
 
+/* Files on disk are identified by their device and inode number, open files
+ * are indexed by the hexadecimal representation of the two. */
+#define FILE_KEY_SIZE (4*sizeof(uintmax_t) + 2)
+
+static void file_key(char *key, const struct stat *meta) {
+	snprintf(key, FILE_KEY_SIZE, "%jx:%jx", (uintmax_t)meta->st_dev, (uintmax_t)meta->st_ino);
+}
+
+void file_stat_set(Vis *vis, File *file, struct stat meta) {
+	char key[FILE_KEY_SIZE];
+	if (file->stat.st_ino) {
+		file_key(key, &file->stat);
+		if (map_get(vis->inodes, key) == file)
+			map_delete(vis->inodes, key);
+	}
+	file->stat = meta;
+	if (meta.st_ino) {
+		file_key(key, &meta);
+		map_delete(vis->inodes, key);
+		map_put(vis->inodes, key, file);
+	}
+}
+
 static void file_free(Vis *vis, File *file) {
 	if (!file)
 		return;
@@ -109,10 +136,19 @@ static void file_free(Vis *vis, File *file) {
 		--file->refcount;
 		return;
 	}
-	vis_event_emit(vis, VIS_EVENT_FILE_CLOSE, file);
+	if (!file->lazy)
+		vis_event_emit(vis, VIS_EVENT_FILE_CLOSE, file);
 	for (size_t i = 0; i < LENGTH(file->marks); i++)
 		mark_release(&file->marks[i]);
+	/* the session is tied to the file on disk, unsaved changes are discarded */
+	if (vis->session && file->name && !file->internal && !file->lazy &&
+	    file->stream == -1 && !text_modified(file->text))
+		text_session_save(file->text, file->name);
+	file_stat_set(vis, file, (struct stat){ 0 });
 	text_free(file->text);
+	if (file->stream != -1)
+		close(file->stream);
+	file_follow(vis, file, false);
 	if (!file->internal) {
 		free((char*)file->name);
 	}
@@ -131,8 +167,12 @@ static File *file_new_text(Vis *vis, Text *text) {
 	if (!file)
 		return NULL;
 	file->fd = -1;
+	file->stream = -1;
+	file->follow = -1;
+	file->follow_watch = -1;
 	file->text = text;
-	file->stat = text_stat(text);
+	file_stat_set(vis, file, text_stat(text));
+	text_history_limit(text, vis->history_revisions, vis->history_age, vis->history_size);
 	for (size_t i = 0; i < LENGTH(file->marks); i++)
 		mark_init(&file->marks[i]);
 	if (vis->files)
@@ -169,10 +209,27 @@ err:
 	return path_normalized[0] ? strdup(path_normalized) : NULL;
 }
 
-static File *file_new(Vis *vis, const char *name) {
+static Text *file_text_load(Vis *vis, const char *name) {
+	Text *text = NULL;
+	if (name && vis->session)
+		text = text_session_load(name);
+	if (!text)
+		text = text_load_method(name, vis->load_method);
+	if (text && name && text_journal_exists(name)) {
+		if (text_modified(text))
+			vis_info_show(vis, "Interrupted save of `%s' rolled back, write the file to keep it", name);
+		else
+			vis_info_show(vis, "Journal of an interrupted save of `%s' does not match the file, left as is", name);
+	}
+	return text;
+}
+
+/* A lazily opened existing file only records its name and stat, it is backed
+ * by an empty placeholder text until file_load is called. */
+static File *file_new(Vis *vis, const char *name, bool lazy) {
 	char *name_absolute = NULL;
 	bool cmp_names = 0;
-	struct stat new;
+	struct stat new = { 0 };
 
 	if (name) {
 		if (!(name_absolute = absolute_path(name)))
@@ -188,23 +245,31 @@ static File *file_new(Vis *vis, const char *name) {
 
 		File *existing = NULL;
 		/* try to detect whether the same file is already open in another window */
-		for (File *file = vis->files; file; file = file->next) {
-			if (file->name) {
-				if ((cmp_names && strcmp(file->name, name_absolute) == 0) ||
-				    (file->stat.st_dev == new.st_dev && file->stat.st_ino == new.st_ino)) {
+		if (cmp_names) {
+			for (File *file = vis->files; file; file = file->next) {
+				if (file->name && strcmp(file->name, name_absolute) == 0) {
 					existing = file;
 					break;
 				}
 			}
+		} else {
+			char key[FILE_KEY_SIZE];
+			file_key(key, &new);
+			existing = map_get(vis->inodes, key);
 		}
-		if (existing) {
+		if (existing && existing->name) {
 			free(name_absolute);
 			return existing;
 		}
 	}
 
 	File *file = NULL;
-	Text *text = text_load_method(name, vis->load_method);
+	Text *text = NULL;
+	lazy &= name && S_ISREG(new.st_mode);
+	if (lazy)
+		text = text_load(NULL);
+	else
+		text = file_text_load(vis, name_absolute);
 	if (!text && name && errno == ENOENT)
 		text = text_load(NULL);
 	if (!text)
@@ -212,7 +277,11 @@ static File *file_new(Vis *vis, const char *name) {
 	if (!(file = file_new_text(vis, text)))
 		goto err;
 	file->name = name_absolute;
-	vis_event_emit(vis, VIS_EVENT_FILE_OPEN, file);
+	file->lazy = lazy;
+	if (lazy)
+		file_stat_set(vis, file, new);
+	else
+		vis_event_emit(vis, VIS_EVENT_FILE_OPEN, file);
 	return file;
 err:
 	free(name_absolute);
@@ -222,7 +291,7 @@ err:
 }
 
 static File *file_new_internal(Vis *vis, const char *filename) {
-	File *file = file_new(vis, NULL);
+	File *file = file_new(vis, NULL, false);
 	if (file) {
 		file->refcount = 1;
 		file->internal = true;
@@ -441,9 +510,18 @@ static void window_draw_eof(Win *win) {
 }
 
 void vis_window_draw(Win *win) {
-	if (!win->ui || !view_update(win->view))
-		return;
 	Vis *vis = win->vis;
+	if (!win->ui)
+		return;
+	/* lazily opened files are loaded once they become visible, windows
+	 * drawn while the command line arguments are processed are skipped */
+	if (win->file->lazy) {
+		if (!vis->running || (vis->win != win && vis_window_height_get(win) <= 0))
+			return;
+		file_load(vis, win->file);
+	}
+	if (!view_update(win->view))
+		return;
 	vis_event_emit(vis, VIS_EVENT_WIN_HIGHLIGHT, win);
 
 	window_draw_colorcolumn(win);
@@ -489,7 +567,9 @@ Win *window_new_file(Vis *vis, File *file, enum UiOption options) {
 	vis->ui->window_focus(win->ui);
 	for (size_t i = 0; i < LENGTH(win->modes); i++)
 		win->modes[i].parent = &vis_modes[i];
-	vis_event_emit(vis, VIS_EVENT_WIN_OPEN, win);
+	/* deferred until the content is loaded */
+	if (!file->lazy)
+		vis_event_emit(vis, VIS_EVENT_WIN_OPEN, win);
 	return win;
 }
 
@@ -499,7 +579,7 @@ bool vis_window_reload(Win *win) {
 		return false; /* can't reload unsaved file */
 	/* temporarily unset file name, otherwise file_new returns the same File */
 	win->file->name = NULL;
-	File *file = file_new(win->vis, name);
+	File *file = file_new(win->vis, name, false);
 	win->file->name = name;
 	if (!file)
 		return false;
@@ -531,6 +611,7 @@ void vis_window_focus(Win *win) {
 		return;
 	Vis *vis = win->vis;
 	vis->win = win;
+	file_load(vis, win->file);
 	vis->ui->window_focus(win->ui);
 }
 
@@ -581,8 +662,8 @@ void vis_resume(Vis *vis) {
 	vis->ui->resume(vis->ui);
 }
 
-bool vis_window_new(Vis *vis, const char *filename) {
-	File *file = file_new(vis, filename);
+static bool window_new(Vis *vis, const char *filename, bool lazy) {
+	File *file = file_new(vis, filename, lazy);
 	if (!file)
 		return false;
 	Win *win = window_new_file(vis, file, UI_OPTION_STATUSBAR|UI_OPTION_SYMBOL_EOF);
@@ -594,6 +675,52 @@ bool vis_window_new(Vis *vis, const char *filename) {
 	return true;
 }
 
+bool vis_window_new(Vis *vis, const char *filename) {
+	return window_new(vis, filename, false);
+}
+
+bool vis_window_new_lazy(Vis *vis, const char *filename) {
+	return window_new(vis, filename, true);
+}
+
+/* Failures are handled as if the file was opened eagerly: a file removed in
+ * the meantime becomes a new one, otherwise all windows displaying it are
+ * closed from the main loop. Changes to the placeholder are never discarded. */
+bool file_load(Vis *vis, File *file) {
+	if (!file->lazy)
+		return true;
+	if (file->error) {
+		errno = file->error;
+		return false;
+	}
+	Text *placeholder = file->text, *text = placeholder;
+	if (!text_modified(placeholder) && !(text = file_text_load(vis, file->name))) {
+		if (errno != ENOENT) {
+			file->error = errno;
+			vis_info_show(vis, "Can not load `%s': %s", file->name, strerror(errno));
+			return false;
+		}
+		text = placeholder;
+	}
+	file->text = text;
+	file->lazy = false;
+	file_stat_set(vis, file, text_stat(text));
+	if (text != placeholder) {
+		text_history_limit(text, vis->history_revisions, vis->history_age, vis->history_size);
+		for (Win *win = vis->windows; win; win = win->next) {
+			if (win->file == file)
+				view_reload(win->view, text);
+		}
+		text_free(placeholder);
+	}
+	vis_event_emit(vis, VIS_EVENT_FILE_OPEN, file);
+	for (Win *win = vis->windows; win; win = win->next) {
+		if (win->file == file)
+			vis_event_emit(vis, VIS_EVENT_WIN_OPEN, win);
+	}
+	return true;
+}
+
 bool vis_window_new_fd(Vis *vis, int fd) {
 	if (fd == -1)
 		return false;
@@ -603,7 +730,258 @@ bool vis_window_new_fd(Vis *vis, int fd) {
 	return true;
 }
 
+bool file_follow(Vis *vis, File *file, bool follow) {
+	if (!follow) {
+#if CONFIG_INOTIFY
+		if (file->follow_watch != -1)
+			inotify_rm_watch(vis->inotify, file->follow_watch);
+#endif
+		if (file->follow != -1)
+			close(file->follow);
+		file->follow = file->follow_watch = -1;
+		return true;
+	}
+	if (file->follow != -1)
+		return true;
+	if (!file->name) {
+		errno = ENOENT;
+		return false;
+	}
+	int fd = open(file->name, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	struct stat meta, loaded = text_stat(file->text);
+	if (fstat(fd, &meta) == -1 || meta.st_dev != loaded.st_dev || meta.st_ino != loaded.st_ino) {
+		/* replaced since it was read */
+		close(fd);
+		errno = ESTALE;
+		return false;
+	}
+	file->follow = fd;
+#if CONFIG_INOTIFY
+	if (vis->inotify == -1)
+		vis->inotify = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (vis->inotify != -1)
+		file->follow_watch = inotify_add_watch(vis->inotify, file->name, IN_MODIFY);
+#endif
+	return true;
+}
+
+bool file_journal(Vis *vis, File *file, bool journal) {
+	if (!journal) {
+		text_recovery_stop(file->text);
+		file->journal = false;
+		return true;
+	}
+	if (!file->name) {
+		errno = ENOENT;
+		return false;
+	}
+	if (!text_recovery_start(file->text, file->name))
+		return false;
+	file->journal = true;
+	return true;
+}
+
+/* restart the recovery journal once the file was saved */
+void file_journal_reset(Vis *vis, File *file) {
+	if (file->journal && !text_recovery_reset(file->text)) {
+		vis_info_show(vis, "Can not write recovery journal: %s", strerror(errno));
+		file_journal(vis, file, false);
+	}
+}
+
+/* write the snapshot ranges of a file. If the file was truncated, reading
+ * its memory mapped blocks raises SIGBUS which fails the save when done by
+ * a worker thread. */
+static void save_write(Save *save, SaveFile *sf) {
+#if CONFIG_PTHREAD
+	if (sigsetjmp(save->sigbus_jmpbuf, 1)) {
+		sf->error = EIO;
+		text_save_cancel(sf->ctx);
+		sf->ctx = NULL;
+		return;
+	}
+#endif
+	for (size_t i = 0, len = array_length(&sf->ranges); i < len; i++) {
+		Filerange *range = array_get(&sf->ranges, i);
+		errno = 0;
+		ssize_t written = text_save_write_range(sf->ctx, range);
+		if (written == -1 || (size_t)written != text_range_size(range)) {
+			sf->error = errno ? errno : EIO;
+			text_save_cancel(sf->ctx);
+			sf->ctx = NULL;
+			break;
+		}
+	}
+}
+
+/* write all files of a save and flush them to disk at once */
+static void save_run(Save *save) {
+	size_t count = array_length(&save->files);
+	TextSave **ctxs = calloc(count, sizeof *ctxs);
+	for (size_t i = 0; i < count; i++) {
+		SaveFile *sf = array_get(&save->files, i);
+		save_write(save, sf);
+		if (ctxs)
+			ctxs[i] = sf->ctx;
+	}
+	/* on failure the files are flushed individually upon commit */
+	if (ctxs)
+		text_save_sync(ctxs, count);
+	free(ctxs);
+	for (size_t i = 0; i < count; i++) {
+		SaveFile *sf = array_get(&save->files, i);
+		errno = 0;
+		if (sf->ctx && !text_save_commit(sf->ctx))
+			sf->error = errno ? errno : EIO;
+		sf->ctx = NULL;
+	}
+}
+
+/* report the outcome of a completed save and release it */
+static bool save_finish(Vis *vis, Save *save) {
+	bool ret = true;
+	for (size_t i = 0, len = array_length(&save->files); i < len; i++) {
+		SaveFile *sf = array_get(&save->files, i);
+		File *file = sf->file;
+		if (sf->error) {
+			vis_info_show(vis, "Can't write `%s': %s", sf->path, strerror(sf->error));
+			ret = false;
+		} else {
+			/* the text might have been modified in the meantime */
+			text_snapshot_saved(file->text, sf->snapshot);
+			if (!file->name) {
+				file_name_set(file, sf->path);
+				sf->same = true;
+			}
+			if (sf->same || (!sf->existing && strcmp(file->name, sf->path) == 0)) {
+				file_stat_set(vis, file, text_stat(file->text));
+				file_journal_reset(vis, file);
+			}
+			vis_event_emit(vis, VIS_EVENT_FILE_SAVE_POST, file, sf->path);
+		}
+		text_snapshot_release(sf->snapshot);
+		array_release(&sf->ranges);
+		free(sf->path);
+		file_free(vis, file);
+	}
+	array_release(&save->files);
+#if CONFIG_PTHREAD
+	if (save->done[0] != -1)
+		close(save->done[0]);
+	if (save->done[1] != -1)
+		close(save->done[1]);
+#endif
+	free(save);
+	return ret;
+}
+
+#if CONFIG_PTHREAD
+static void *save_thread(void *arg) {
+	Save *save = arg;
+	/* a SIGBUS raised while it is blocked would terminate the process */
+	sigset_t sigbus;
+	sigemptyset(&sigbus);
+	sigaddset(&sigbus, SIGBUS);
+	if (pthread_setspecific(save->vis->save_key, save) == 0)
+		pthread_sigmask(SIG_UNBLOCK, &sigbus, NULL);
+	save_run(save);
+	while (write(save->done[1], "", 1) == -1 && errno == EINTR);
+	return NULL;
+}
+#endif
+
+/* join the saves involving file (or all if NULL) which, unless fds is NULL,
+ * signaled their completion */
+static bool vis_saves_finish(Vis *vis, File *file, fd_set *fds) {
+	bool ret = true;
+#if CONFIG_PTHREAD
+	for (Save **prev = &vis->saves, *save; (save = *prev);) {
+		bool match = !file;
+		for (size_t i = 0, len = array_length(&save->files); !match && i < len; i++) {
+			SaveFile *sf = array_get(&save->files, i);
+			match = sf->file == file;
+		}
+		if (!match || (fds && !FD_ISSET(save->done[0], fds))) {
+			prev = &save->next;
+			continue;
+		}
+		*prev = save->next;
+		pthread_join(save->thread, NULL);
+		ret &= save_finish(vis, save);
+	}
+#endif
+	return ret;
+}
+
+bool vis_save_add(Vis *vis, File *file, const Text *snapshot, TextSave *ctx, char *path, Array *ranges, bool existing, bool same) {
+	if (!vis->save) {
+		Save *save = calloc(1, sizeof *save);
+		if (!save)
+			return false;
+		array_init_sized(&save->files, sizeof(SaveFile));
+		vis->save = save;
+	}
+	SaveFile sf = {
+		.file = file,
+		.snapshot = snapshot,
+		.ctx = ctx,
+		.path = path,
+		.ranges = *ranges,
+		.existing = existing,
+		.same = same,
+	};
+	if (!array_add(&vis->save->files, &sf))
+		return false;
+	file->refcount++;
+	return true;
+}
+
+bool vis_save_start(Vis *vis) {
+	Save *save = vis->save;
+	if (!save)
+		return true;
+	vis->save = NULL;
+#if CONFIG_PTHREAD
+	save->vis = vis;
+	if (vis->save_threads && pipe(save->done) == 0) {
+		fcntl(save->done[0], F_SETFD, FD_CLOEXEC);
+		fcntl(save->done[1], F_SETFD, FD_CLOEXEC);
+		if (pthread_create(&save->thread, NULL, save_thread, save) == 0) {
+			save->next = vis->saves;
+			vis->saves = save;
+			return true;
+		}
+		close(save->done[0]);
+		close(save->done[1]);
+	}
+	save->done[0] = save->done[1] = -1;
+#endif
+	save_run(save);
+	return save_finish(vis, save);
+}
+
+bool vis_save_wait(Vis *vis, File *file) {
+	bool ret = vis_save_start(vis);
+	return vis_saves_finish(vis, file, NULL) && ret;
+}
+
+bool vis_window_stream(Win *win, int fd) {
+	if (!win || fd == -1)
+		return false;
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return false;
+	if (win->file->stream != -1)
+		close(win->file->stream);
+	win->file->stream = fd;
+	return true;
+}
+
 bool vis_window_closable(Win *win) {
+	if (win)
+		vis_save_wait(win->vis, win->file);
 	if (!win || !text_modified(win->file->text))
 		return true;
 	return win->file->refcount > 1;
@@ -642,7 +1020,8 @@ void vis_window_close(Win *win) {
 	if (!win)
 		return;
 	Vis *vis = win->vis;
-	vis_event_emit(vis, VIS_EVENT_WIN_CLOSE, win);
+	if (!win->file->lazy)
+		vis_event_emit(vis, VIS_EVENT_WIN_CLOSE, win);
 	file_free(vis, win->file);
 	if (win->prev)
 		win->prev->next = win->next;
@@ -653,8 +1032,10 @@ void vis_window_close(Win *win) {
 	if (vis->win == win)
 		vis->win = win->next ? win->next : win->prev;
 	window_free(win);
-	if (vis->win)
+	if (vis->win) {
+		file_load(vis, vis->win->file);
 		vis->ui->window_focus(vis->win->ui);
+	}
 	vis_draw(vis);
 }
 
@@ -668,9 +1049,14 @@ Vis *vis_new(Ui *ui, VisEvent *event, int argc, char **argv, void* signal_handle
 	vis->argv = argv;
 	vis->exit_status = -1;
 	vis->ui = ui;
+#if CONFIG_PTHREAD
+	vis->thread = pthread_self();
+	vis->save_threads = pthread_key_create(&vis->save_key, NULL) == 0;
+#endif
 	vis->tabwidth = 8;
 	vis->expandtab = false;
 	vis->change_colors = true;
+	vis->inotify = -1;
 	for (size_t i = 0; i < LENGTH(vis->registers); i++)
 		register_init(&vis->registers[i]);
 	vis->registers[VIS_REG_BLACKHOLE].type = REGISTER_BLACKHOLE;
@@ -684,6 +1070,8 @@ Vis *vis_new(Ui *ui, VisEvent *event, int argc, char **argv, void* signal_handle
 	array_init(&vis->actions_user);
 	action_reset(&vis->action);
 	string_init(&vis->input_queue);
+	if (!(vis->inodes = map_new()))
+		goto err;
 	if (!(vis->command_file = file_new_internal(vis, NULL)))
 		goto err;
 	if (!(vis->search_file = file_new_internal(vis, NULL)))
@@ -749,14 +1137,18 @@ err:
 void vis_free(Vis *vis) {
 	if (!vis)
 		return;
+	vis_save_wait(vis, NULL);
 	vis_event_emit(vis, VIS_EVENT_QUIT);
 	vis->event = NULL;
 	while (vis->windows)
 		vis_window_close(vis->windows);
 	file_free(vis, vis->command_file);
 	file_free(vis, vis->search_file);
+	map_free(vis->inodes);
 	for (int i = 0; i < LENGTH(vis->registers); i++)
 		register_release(&vis->registers[i]);
+	for (size_t i = 0; i < LENGTH(vis->regexes); i++)
+		regex_cache_release(&vis->regexes[i]);
 	vis->ui->free(vis->ui);
 	if (vis->usercmds) {
 		const char *name;
@@ -782,7 +1174,13 @@ void vis_free(Vis *vis) {
 	while (array_length(&vis->actions_user))
 		vis_action_free(vis, array_get_ptr(&vis->actions_user, 0));
 	array_release(&vis->actions_user);
+	if (vis->inotify != -1)
+		close(vis->inotify);
 	free(vis->shell);
+#if CONFIG_PTHREAD
+	if (vis->save_threads)
+		pthread_key_delete(vis->save_key);
+#endif
 	free(vis);
 }
 
@@ -794,23 +1192,39 @@ void vis_insert(Vis *vis, size_t pos, const char *data, size_t len) {
 	vis_window_invalidate(win);
 }
 
+static int edits_comparator(const void *a, const void *b) {
+	const TextEdit *e1 = a, *e2 = b;
+	return e1->pos < e2->pos ? -1 : e1->pos > e2->pos;
+}
+
 void vis_insert_key(Vis *vis, const char *data, size_t len) {
 	Win *win = vis->win;
-	Selection *s, *sm;
+	Selection *s, *sm = NULL;
 	size_t max = 0, pos = 0;
 	if (!win)
 		return;
 
+	Array edits;
+	array_init_sized(&edits, sizeof(TextEdit));
 	for (s = view_selections(win->view); s; s = view_selections_next(s)) {
 		pos = view_cursors_pos(s);
 		if (pos > max) {
 			max = pos;
 			sm = s;
 		}
-		vis_insert(vis, pos, data, len);
+		TextEdit edit = { .pos = pos, .data = data, .size = len };
+		if (!array_add(&edits, &edit)) {
+			array_release(&edits);
+			return;
+		}
 	}
-	if (max > 0) {
-		view_cursors_scroll_to(sm, max + len);
+	/* insert at all selections at once, cursors are shifted accordingly */
+	array_sort(&edits, edits_comparator);
+	text_edit(win->file->text, array_get(&edits, 0), array_length(&edits), NULL);
+	array_release(&edits);
+	vis_window_invalidate(win);
+	if (sm) {
+		view_cursors_scroll_to(sm, view_cursors_pos(sm));
 	}
 }
 
@@ -1299,6 +1713,16 @@ static void vis_keys_push(Vis *vis, const char *input, size_t pos, bool record)
 bool vis_signal_handler(Vis *vis, int signum, const siginfo_t *siginfo, const void *context) {
 	switch (signum) {
 	case SIGBUS:
+#if CONFIG_PTHREAD
+		/* a worker only fails the file it is writing, the main thread
+		 * notices the truncation once it accesses the mapping itself */
+		if (!pthread_equal(pthread_self(), vis->thread)) {
+			Save *save = pthread_getspecific(vis->save_key);
+			if (!save)
+				abort();
+			siglongjmp(save->sigbus_jmpbuf, 1);
+		}
+#endif
 		for (File *file = vis->files; file; file = file->next) {
 			if (text_mmaped(file->text, siginfo->si_addr))
 				file->truncated = true;
@@ -1327,6 +1751,252 @@ bool vis_signal_handler(Vis *vis, int signum, const siginfo_t *siginfo, const vo
 	return false;
 }
 
+/* milliseconds without input before compaction of fragmented files starts */
+#define COMPACT_IDLE 200
+/* approximate amount of memory touched per compaction slice and file */
+#define COMPACT_SLICE (1 << 20)
+
+/* bytes read per file before checking for input while loading progressively */
+#define LOAD_SLICE (1 << 20)
+
+/* read the next slice of all files still being loaded, returns whether
+ * some are not yet complete. Files failing to load are retried after
+ * the next input. */
+static bool vis_load(Vis *vis) {
+	bool more = false, redraw = false;
+	for (File *file = vis->files; file; file = file->next) {
+		if (!text_loading(file->text))
+			continue;
+		redraw = true;
+		if (!text_load_continue(file->text, LOAD_SLICE))
+			vis_info_show(vis, "Can not load `%s': %s", file->name, strerror(errno));
+		else if (text_loading(file->text))
+			more = true;
+	}
+	if (redraw) {
+		vis_draw(vis);
+		vis_update(vis);
+	}
+	return more;
+}
+
+/* bytes read per file before checking for input while data is streaming in */
+#define STREAM_SLICE (1 << 20)
+#define STREAM_READ (1 << 16)
+
+/* add the input file descriptors of all streamed files, the inotify(7)
+ * instance and the completion notifications of saves in progress,
+ * returns the highest one */
+static int vis_fds_set(Vis *vis, fd_set *fds) {
+	int max = STDIN_FILENO;
+	if (vis->inotify != -1) {
+		FD_SET(vis->inotify, fds);
+		max = vis->inotify;
+	}
+#if CONFIG_PTHREAD
+	for (Save *save = vis->saves; save; save = save->next) {
+		FD_SET(save->done[0], fds);
+		if (save->done[0] > max)
+			max = save->done[0];
+	}
+#endif
+	for (File *file = vis->files; file; file = file->next) {
+		if (file->stream == -1)
+			continue;
+		FD_SET(file->stream, fds);
+		if (file->stream > max)
+			max = file->stream;
+	}
+	return max;
+}
+
+/* modifications recorded to look up marks before they are discarded */
+#define MARK_LOG_MAX 4096
+
+/* update all marks kept for a file to the current state of its text which
+ * then no longer needs to record how modifications shift them */
+static void file_marks_floor(Vis *vis, File *file) {
+	Text *txt = file->text;
+	for (size_t i = 0; i < LENGTH(file->marks); i++)
+		mark_update(txt, &file->marks[i]);
+	for (Win *win = vis->windows; win; win = win->next) {
+		if (win->file != file)
+			continue;
+		view_marks_update(win->view);
+		mark_update(txt, &win->saved_selections);
+		marklist_update(txt, &win->jumplist);
+	}
+	vis_lua_file_marks_update(vis, file);
+	text_mark_floor(txt);
+}
+
+/* once a streamed file exceeds the limit, drop a quarter of it from the front */
+static void vis_stream_limit(Vis *vis, File *file) {
+	size_t size = text_size(file->text), limit = vis->stream_limit;
+	if (!limit || size <= limit)
+		return;
+	size_t drop = size - limit + limit / 4;
+	size_t line = text_line_next(file->text, drop);
+	if (line < size)
+		drop = line;
+	if (!text_trim(file->text, drop))
+		vis_info_show(vis, "Can not trim stream: %s", strerror(errno));
+	else
+		file_marks_floor(vis, file);
+}
+
+/* append the data available on the streams which are ready, returns whether
+ * anything changed */
+static bool vis_streams_read(Vis *vis, fd_set *fds) {
+	bool read = false;
+	for (File *file = vis->files; file; file = file->next) {
+		if (file->stream == -1 || !FD_ISSET(file->stream, fds))
+			continue;
+		ssize_t len = 0;
+		for (size_t total = 0; total < STREAM_SLICE; total += len) {
+			if ((len = text_append_fd(file->text, file->stream, STREAM_READ)) <= 0)
+				break;
+			read = true;
+		}
+		if (len == 0 || (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			if (len == -1)
+				vis_info_show(vis, "Can not read stream: %s", strerror(errno));
+			close(file->stream);
+			file->stream = -1;
+			read = true;
+		}
+		vis_stream_limit(vis, file);
+	}
+	return read;
+}
+
+/* milliseconds between checks for growth of followed files not watched by inotify(7) */
+#define FOLLOW_INTERVAL 1000
+
+/* scroll down until the end of the file is visible again */
+static void window_pin_eof(Win *win) {
+	View *view = win->view;
+	Text *txt = win->file->text;
+	size_t size = text_size(txt);
+	for (Filerange r = view_viewport_get(view); r.end < size; ) {
+		size_t lines = text_lineno_by_pos(txt, size) - text_lineno_by_pos(txt, r.end);
+		view_slide_up(view, MIN(MAX(lines, 1), INT_MAX));
+		Filerange next = view_viewport_get(view);
+		if (next.start == r.start)
+			break;
+		r = next;
+	}
+}
+
+/* Truncation invalidates the memory mapped file content beyond the new end
+ * of file, accessing it would raise SIGBUS. The data is gone, hence the text
+ * is replaced by the current file content before it is drawn again. Windows
+ * which displayed the end of the file keep doing so. */
+static bool file_follow_reload(Vis *vis, File *file, const struct stat *meta) {
+	Text *text = text_load_method(file->name, vis->load_method);
+	if (!text)
+		return false;
+	struct stat loaded = text_stat(text);
+	if (loaded.st_dev != meta->st_dev || loaded.st_ino != meta->st_ino) {
+		/* replaced in the meantime */
+		text_free(text);
+		return false;
+	}
+	Text *old = file->text;
+	bool journal = file->journal;
+	file_journal(vis, file, false);
+	file->text = text;
+	file_stat_set(vis, file, loaded);
+	text_history_limit(text, vis->history_revisions, vis->history_age, vis->history_size);
+	for (size_t i = 0; i < LENGTH(file->marks); i++)
+		array_clear(&file->marks[i]);
+	for (Win *win = vis->windows; win; win = win->next) {
+		if (win->file != file)
+			continue;
+		bool eof = view_viewport_get(win->view).end >= text_size(old);
+		view_reload(win->view, text);
+		if (eof) {
+			view_cursor_to(win->view, text_size(text));
+			window_pin_eof(win);
+		}
+	}
+	text_free(old);
+	if (journal && !file_journal(vis, file, true))
+		vis_info_show(vis, "Can not write recovery journal: %s", strerror(errno));
+	return true;
+}
+
+/* append the growth of all followed files, windows which displayed the end
+ * of the file keep doing so. Returns whether some files need to be polled. */
+static bool vis_follow(Vis *vis) {
+	bool poll = false, redraw = false;
+	for (File *file = vis->files; file; file = file->next) {
+		if (file->follow == -1)
+			continue;
+		if (file->follow_watch == -1)
+			poll = true;
+		Text *txt = file->text;
+		struct stat meta;
+		if (text_loading(txt) || fstat(file->follow, &meta) == -1)
+			continue;
+		off_t size = text_stat(txt).st_size;
+		if (meta.st_size == size)
+			continue;
+		if (meta.st_size < size) {
+			/* only unmodified buffers are reloaded, changes are kept */
+			if (text_modified(txt) || !file_follow_reload(vis, file, &meta)) {
+				vis_info_show(vis, "WARNING: file `%s' truncated, no longer following", file->name);
+				file_follow(vis, file, false);
+			} else {
+				vis_info_show(vis, "WARNING: file `%s' truncated, reloaded", file->name);
+			}
+			redraw = true;
+			continue;
+		}
+		size_t end = text_size(txt);
+		if (!text_append_file(txt, file->follow, size, meta.st_size - size)) {
+			vis_info_show(vis, "Can not follow `%s': %s", file->name, strerror(errno));
+			file_follow(vis, file, false);
+			continue;
+		}
+		file->stat = meta;
+		redraw = true;
+		for (Win *win = vis->windows; win; win = win->next) {
+			if (win->file != file || view_viewport_get(win->view).end < end)
+				continue;
+			if (view_cursor_get(win->view) == end)
+				view_cursor_to(win->view, text_size(txt));
+			else
+				window_pin_eof(win);
+		}
+	}
+	if (redraw) {
+		vis_draw(vis);
+		vis_update(vis);
+	}
+	return poll;
+}
+
+/* perform one slice of compaction work, returns whether some is left */
+/* flush the recovery journals of all files, done while idle to batch records */
+static void vis_journal_sync(Vis *vis) {
+	for (File *file = vis->files; file; file = file->next) {
+		if (file->journal && !text_recovery_sync(file->text)) {
+			vis_info_show(vis, "Can not write recovery journal: %s", strerror(errno));
+			file_journal(vis, file, false);
+		}
+	}
+}
+
+static bool vis_compact(Vis *vis) {
+	bool more = false;
+	for (File *file = vis->files; file; file = file->next) {
+		if (text_compact(file->text, COMPACT_SLICE))
+			more = true;
+	}
+	return more;
+}
+
 int vis_run(Vis *vis) {
 	if (vis->exit_status != -1)
 		return vis->exit_status;
@@ -1347,14 +2017,48 @@ int vis_run(Vis *vis) {
 	size_t len = 0;
 	char buf[BUFSIZ];
 	char key[VIS_KEY_LENGTH_MAX];
+	/* compact files in slices once no input arrived for a while */
+	struct timespec idle = { .tv_nsec = COMPACT_IDLE * 1000000 };
+	bool compact = true;
+	/* progressively loaded files are read whenever there is no input */
+	struct timespec poll = { 0 };
+	bool loading = true;
+	/* followed files which are not watched are checked periodically */
+	struct timespec interval = { .tv_sec = FOLLOW_INTERVAL / 1000, .tv_nsec = FOLLOW_INTERVAL % 1000 * 1000000 };
+	bool following = true;
 
 	while (vis->running) {
 		fd_set fds;
 		FD_ZERO(&fds);
 		FD_SET(STDIN_FILENO, &fds);
 
+		for (File *file = vis->files; file; file = file->next) {
+			if (text_mark_log(file->text) > MARK_LOG_MAX)
+				file_marks_floor(vis, file);
+		}
+
+		/* close windows of lazily opened files which failed to load */
+		for (Win *next, *win = vis->windows; win; win = next) {
+			next = win->next;
+			File *file = win->file;
+			if (!file->error)
+				continue;
+			if (!next && win == vis->windows)
+				vis_die(vis, "Can not load `%s': %s\n", file->name, strerror(file->error));
+			vis_window_close(win);
+		}
+
 		if (vis->sigbus) {
 			char *name = NULL;
+			/* unmodified followed files are reloaded if the truncation was not yet noticed */
+			for (File *file = vis->files; file; file = file->next) {
+				struct stat meta;
+				if (file->truncated && file->follow != -1 && !text_modified(file->text) &&
+				    fstat(file->follow, &meta) == 0 && file_follow_reload(vis, file, &meta)) {
+					file->truncated = false;
+					vis_info_show(vis, "WARNING: file `%s' truncated, reloaded", file->name);
+				}
+			}
 			for (Win *next, *win = vis->windows; win; win = next) {
 				next = win->next;
 				if (win->file->truncated) {
@@ -1395,7 +2099,21 @@ int vis_run(Vis *vis) {
 		}
 
 		vis_update(vis);
-		if (pselect(1, &fds, NULL, NULL, NULL, &emptyset) >= 0) {
+		int ready, nfds = vis_fds_set(vis, &fds) + 1;
+		while ((ready = pselect(nfds, &fds, NULL, NULL, loading ? &poll : compact ? &idle :
+		                        following ? &interval : NULL, &emptyset)) == 0) {
+			if (loading)
+				loading = vis_load(vis);
+			else if (compact) {
+				vis_journal_sync(vis);
+				compact = vis_compact(vis);
+			}
+			else
+				following = vis_follow(vis);
+			FD_SET(STDIN_FILENO, &fds);
+			vis_fds_set(vis, &fds);
+		}
+		if (ready >= 0) {
 			// success
 			debug_label("select_ready");
 		} else if (errno == EINTR) {
@@ -1406,12 +2124,29 @@ int vis_run(Vis *vis) {
 			vis_die(vis, "Error in mainloop: %s\n", strerror(errno));
 		}
 
+		if (vis_streams_read(vis, &fds)) {
+			compact = true;
+			vis_draw(vis);
+		}
+
+		if (vis->saves) {
+			vis_saves_finish(vis, NULL, &fds);
+			vis_draw(vis);
+		}
+
+		if (vis->inotify != -1 && FD_ISSET(vis->inotify, &fds)) {
+			char events[4096];
+			while (read(vis->inotify, events, sizeof events) > 0);
+			following = vis_follow(vis);
+		}
+
 		if (!FD_ISSET(STDIN_FILENO, &fds)) {
 			continue;
 		}
 
 		if ((n = read(STDIN_FILENO, &buf[len], sizeof(buf)-len)) > 0) {
 			len += n;
+			compact = loading = following = true;
 		} else if (n == 0) {
 			//vis->ui->handle_eof(vis->ui);
 			vis->running = false;
@@ -1692,17 +2427,49 @@ void vis_insert_nl(Vis *vis) {
 	vis_window_invalidate(win);
 }
 
+static void regex_cache_release(RegexCache *c) {
+	free(c->pattern);
+	text_regex_free(c->regex);
+	*c = (RegexCache){ 0 };
+}
+
+/* Look up a compiled regex, moving it to the front of the cache. If it is
+ * missing, compile and insert it, evicting the least recently used one. */
+static Regex *regex_cache_get(Vis *vis, const char *pattern, int cflags) {
+	RegexCache *cache = vis->regexes, entry;
+	size_t i = 0;
+	for (; i < LENGTH(vis->regexes) && cache[i].pattern; i++) {
+		if (cache[i].cflags == cflags && !strcmp(cache[i].pattern, pattern))
+			break;
+	}
+	if (i < LENGTH(vis->regexes) && cache[i].pattern) {
+		entry = cache[i];
+	} else {
+		entry.regex = text_regex_new();
+		if (!entry.regex)
+			return NULL;
+		if (text_regex_compile(entry.regex, pattern, cflags) != 0) {
+			text_regex_free(entry.regex);
+			return NULL;
+		}
+		if (!(entry.pattern = strdup(pattern)))
+			return entry.regex;
+		entry.cflags = cflags;
+		if (i == LENGTH(vis->regexes))
+			regex_cache_release(&cache[--i]);
+	}
+	memmove(cache + 1, cache, i * sizeof *cache);
+	cache[0] = entry;
+	return text_regex_ref(entry.regex);
+}
+
 Regex *vis_regex(Vis *vis, const char *pattern) {
 	if (!pattern && !(pattern = register_get(vis, &vis->registers[VIS_REG_SEARCH], NULL)))
 		return NULL;
-	Regex *regex = text_regex_new();
-	if (!regex)
-		return NULL;
 	int cflags = REG_EXTENDED|REG_NEWLINE|(REG_ICASE*vis->ignorecase);
-	if (text_regex_compile(regex, pattern, cflags) != 0) {
-		text_regex_free(regex);
+	Regex *regex = regex_cache_get(vis, pattern, cflags);
+	if (!regex)
 		return NULL;
-	}
 	register_put0(vis, &vis->registers[VIS_REG_SEARCH], pattern);
 	return regex;
 }
@@ -1826,6 +2593,10 @@ int vis_pipe(Vis *vis, File *file, Filerange *range, const char *argv[],
 		goto err;
 
 	fd_set rfds, wfds;
+	/* start of the input window not yet released */
+	size_t window = rout.start;
+	if (text_range_size(&rout) > TEXT_WINDOW_SIZE)
+		text_advise(text, rout.start, text_range_size(&rout), TEXT_ADVICE_SEQUENTIAL);
 
 	do {
 		if (vis->interrupted) {
@@ -1856,6 +2627,10 @@ int vis_pipe(Vis *vis, File *file, Filerange *range, const char *argv[],
 			ssize_t len = text_write_range(text, &junk, pin[1]);
 			if (len > 0) {
 				rout.start += len;
+				if (rout.start >= window + TEXT_WINDOW_SIZE) {
+					text_advise(text, window, rout.start - window, TEXT_ADVICE_DONTNEED);
+					window = rout.start;
+				}
 				if (text_range_size(&rout) == 0) {
 					close(pin[1]);
 					pin[1] = -1;
@@ -1974,6 +2749,7 @@ bool vis_cmd(Vis *vis, const char *cmdline) {
 	line[len] = '\0';
 
 	enum SamError err = sam_cmd(vis, line);
+	vis_save_start(vis);
 	if (err != SAM_ERR_OK)
 		vis_info_show(vis, "%s", sam_error(err));
 	free(line);
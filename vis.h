@@ -191,6 +191,14 @@ void vis_update(Vis*);
  * @endrst
  */
 bool vis_window_new(Vis*, const char *filename);
+/**
+ * Create a new window for the given file, deferring its loading.
+ *
+ * Only the file name and stat are recorded. The content is loaded,
+ * and the corresponding events are emitted, once a window displaying
+ * the file is focused or drawn, or a command operates on it.
+ */
+bool vis_window_new_lazy(Vis*, const char *filename);
 /**
  * Create a new window associated with a file descriptor.
  * @rst
@@ -199,6 +207,15 @@ bool vis_window_new(Vis*, const char *filename);
  * @endrst
  */
 bool vis_window_new_fd(Vis*, int fd);
+/**
+ * Append data arriving on a file descriptor to the file displayed in the window.
+ * @rst
+ * .. note:: The file descriptor is switched to non-blocking mode and read
+ *           from the main loop whenever data is available. It is closed at
+ *           end of file or when the file is freed.
+ * @endrst
+ */
+bool vis_window_stream(Win*, int fd);
 /** Reload the file currently displayed in the window from disk. */
 bool vis_window_reload(Win*);
 /** Check whether closing the window would loose unsaved changes. */
@@ -945,6 +962,8 @@ void vis_keys_feed(Vis*, const char *keys);
  *        one is substituted.
  * @return A Regex object or ``NULL`` in case of an error.
  * @rst
+ * .. note:: Compiled regexes are cached, the returned object might be
+ *    shared and must not be recompiled.
  * .. warning:: The caller must free the regex object using `text_regex_free`.
  * @endrst
  */